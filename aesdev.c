@@ -11,16 +11,40 @@
 #include <linux/kernel.h>
 #include <linux/sched.h>
 #include <linux/interrupt.h>
+#include <linux/hrtimer.h>
+#include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/dma-mapping.h>
+#include <linux/dmapool.h>
+#include <linux/iommu.h>
+#include <linux/scatterlist.h>
+#include <crypto/aes.h>
+#include <crypto/internal/skcipher.h>
 #include <asm/uaccess.h>
 #include <linux/spinlock_types.h>
 #include <asm/spinlock_types.h>
 #include <asm/spinlock.h>
 
+#define CREATE_TRACE_POINTS
+#include "aesdev_trace.h"
+
 MODULE_LICENSE ("GPL");
 
 static int major; /* Dynamically assigned major number */
 static struct class *dev_class; /* Sysfs class */
 static aes128_dev *aes_devs[AESDRV_MAX_DEV_COUNT]; /* Map minor number to device.  */
+static struct device *any_dev; /* /dev/aes, see AESDRV_ANY_DEV_MINOR.  */
+static struct dentry *aes_debugfs; /* Root of per-device directories.  */
+
+static const char *const aes_mode_names[] = {
+  "ecb_encrypt", "ecb_decrypt", "cbc_encrypt", "cbc_decrypt",
+  "cfb_encrypt", "cfb_decrypt", "ofb", "ctr"
+};
+/* Crypto API algorithms used by sw_fallback, per mode.  */
+static const char *const aes_sw_alg_names[] = {
+  "ecb(aes)", "ecb(aes)", "cbc(aes)", "cbc(aes)",
+  "cfb(aes)", "cfb(aes)", "ofb(aes)", "ctr(aes)"
+};
 
 /* Module should be fail-safe in multi-threading access, therefore I need
    to assure that my context has not been deleted after I entered read/write/ioctl
@@ -34,17 +58,79 @@ DEFINE_MUTEX (context_erase_mutex);
    lists on aes devices.  */
 DEFINE_MUTEX (dev_remove_mutex);
 
+/* Devices that take crypto API requests.  Changed with dev_remove_mutex
+   held, walked under aes_crypto_lock.  */
+static LIST_HEAD (aes_crypto_devs);
+static DEFINE_SPINLOCK (aes_crypto_lock);
+static bool aes_crypto_registered; /* Protected by dev_remove_mutex.  */
+/* Runs software fallback for queued requests, see aes_crypto_fallback.  */
+static struct workqueue_struct *aes_crypto_wq;
+
+/* Default and maximal size of io buffer of a single context.  Size can be
+   changed for each open file with AESDEV_IOCTL_SET_BUFFER_SIZE.  */
+static unsigned int iobuff_size = AESDRV_IOBUFF_DEFAULT_SIZE;
+module_param (iobuff_size, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC (iobuff_size, "Default io buffer size of a context in bytes");
+
+static unsigned int split_len = AESDRV_SPLIT_DEFAULT_LEN;
+module_param (split_len, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC (split_len, "Size of ECB/CTR pieces spread over devices in bytes, 0 to keep streams on one device");
+
+static unsigned int iobuff_max_size = AESDRV_IOBUFF_MAX_SIZE;
+module_param (iobuff_max_size, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC (iobuff_max_size, "Maximal io buffer size of a context in bytes");
+
+/* Size of command buffer of newly probed devices.  It can be changed per
+   device through sysfs (cmd_slots attribute) when the device is not used.  */
+static unsigned int cmd_slots = AESDRV_CMDBUFF_DEFAULT_SLOTS;
+module_param (cmd_slots, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC (cmd_slots, "Number of slots in command buffer of a device");
+
+/* Interrupt coalescing (see __intr_wanted).  With intr_coalesce = 1 every
+   command raises an interrupt.  */
+static unsigned int intr_coalesce = 1;
+module_param (intr_coalesce, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC (intr_coalesce, "Request interrupt every N commands");
+
+static unsigned int intr_delay_us = 50;
+module_param (intr_delay_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC (intr_delay_us,
+                  "Delay before checking commands submitted without interrupt");
+
+/* With sw_fallback, io buffer tasks that find the command buffer full are
+   encrypted on the CPU (by the best AES the kernel has, asynchronous SIMD
+   ones included) instead of waiting for the device.  */
+static unsigned int sw_fallback;
+module_param (sw_fallback, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC (sw_fallback,
+                  "Encrypt on the CPU when command buffer is full");
+
 /*** Kernel structs **********************************************************/
+static const struct vm_operations_struct aes_data_vm_ops = {
+  .open = data_vm_open,
+  .close = data_vm_close
+};
 const static struct file_operations aes_fops = {
   .owner = THIS_MODULE,
-  .read = file_read,
-  .write = file_write,
+  .read_iter = file_read_iter,
+  .write_iter = file_write_iter,
+  .splice_read = generic_file_splice_read,
+  .splice_write = iter_file_splice_write,
+  .poll = file_poll,
   .open = file_open,
   .release = file_release,
   .unlocked_ioctl = file_ioctl,
   .compat_ioctl = file_ioctl,
+  .mmap = file_mmap,
   .llseek = no_llseek
 };
+const static struct file_operations aes_contexts_fops = {
+  .owner = THIS_MODULE,
+  .open = aes_contexts_open,
+  .read = seq_read,
+  .llseek = seq_lseek,
+  .release = single_release
+};
 const static struct pci_device_id pci_ids[] = {
   {PCI_DEVICE (AESDEV_VENDOR_ID, AESDEV_DEVICE_ID)},
   {0}
@@ -56,9 +142,107 @@ static struct pci_driver aes_pci = {
   .remove = pci_remove,
   .shutdown = pci_shutdown
 };
+static struct platform_driver aes_sim_driver = {
+  .driver = {
+    .name = AESDEV_SIM_NAME
+  },
+  .probe = sim_probe,
+  .remove = sim_remove
+};
+
+#define AES_CRYPTO_ALG(_name, _blocksize, _ivsize, _enc_mode, _dec_mode) {\
+    .alg = {\
+      .base = {\
+        .cra_name = _name "(aes)",\
+        .cra_driver_name = _name "-aes-aesdev",\
+        .cra_priority = AESDRV_CRYPTO_PRIORITY,\
+        .cra_flags = CRYPTO_ALG_ASYNC | CRYPTO_ALG_NEED_FALLBACK\
+                     | CRYPTO_ALG_KERN_DRIVER_ONLY,\
+        .cra_blocksize = _blocksize,\
+        .cra_ctxsize = sizeof (aes128_crypto_ctx),\
+        .cra_module = THIS_MODULE,\
+      },\
+      .min_keysize = AES_MIN_KEY_SIZE,\
+      .max_keysize = AES_MAX_KEY_SIZE,\
+      .ivsize = _ivsize,\
+      .chunksize = AES_BLOCK_SIZE,\
+      .setkey = aes_skcipher_setkey,\
+      .encrypt = aes_skcipher_encrypt,\
+      .decrypt = aes_skcipher_decrypt,\
+      .init = aes_skcipher_init,\
+      .exit = aes_skcipher_exit,\
+    },\
+    .enc_mode = _enc_mode,\
+    .dec_mode = _dec_mode,\
+  }
+static aes128_crypto_alg aes_crypto_algs[] = {
+  AES_CRYPTO_ALG ("ecb", AES_BLOCK_SIZE, 0,
+                  AESDEV_MODE_ECB_ENCRYPT, AESDEV_MODE_ECB_DECRYPT),
+  AES_CRYPTO_ALG ("cbc", AES_BLOCK_SIZE, AES_BLOCK_SIZE,
+                  AESDEV_MODE_CBC_ENCRYPT, AESDEV_MODE_CBC_DECRYPT),
+  AES_CRYPTO_ALG ("cfb", 1, AES_BLOCK_SIZE,
+                  AESDEV_MODE_CFB_ENCRYPT, AESDEV_MODE_CFB_DECRYPT),
+  AES_CRYPTO_ALG ("ofb", 1, AES_BLOCK_SIZE,
+                  AESDEV_MODE_OFB, AESDEV_MODE_OFB),
+  AES_CRYPTO_ALG ("ctr", 1, AES_BLOCK_SIZE,
+                  AESDEV_MODE_CTR, AESDEV_MODE_CTR),
+};
 /*****************************************************************************/
 
 /*** Helpers *****************************************************************/
+static inline uint32_t
+aes_reg_read (aes128_dev *aes_dev, unsigned int reg)
+{
+  if (unlikely (aes_dev->sim != NULL))
+    return aes_dev->sim->read (aes_dev->sim->sim, reg);
+  return ioread32 (aes_dev->bar0 + reg);
+}
+
+static inline void
+aes_reg_write (aes128_dev *aes_dev, uint32_t val, unsigned int reg)
+{
+  if (unlikely (aes_dev->sim != NULL))
+    aes_dev->sim->write (aes_dev->sim->sim, val, reg);
+  else
+    iowrite32 (val, aes_dev->bar0 + reg);
+}
+
+/* Device for a new context opened through /dev/aes: the one with fewest
+   commands in flight, then with fewest open contexts.
+   Do NOT use this function without dev_remove_mutex.  */
+static aes128_dev *
+__aes_pick_dev (void)
+{
+  aes128_dev *best;
+  size_t tasks, files, best_tasks, best_files;
+  struct list_head *pos;
+  int minor;
+
+  best = NULL;
+  best_tasks = 0;
+  best_files = 0;
+  for (minor = 0; minor < AESDRV_MAX_DEV_COUNT; ++minor)
+    {
+      if (aes_devs[minor] == NULL)
+        continue;
+
+      tasks = READ_ONCE (aes_devs[minor]->tasks_in_progress);
+      files = 0;
+      list_for_each (pos, &aes_devs[minor]->file_list_head)
+        files++;
+
+      if (best == NULL || tasks < best_tasks
+          || (tasks == best_tasks && files < best_files))
+        {
+          best = aes_devs[minor];
+          best_tasks = tasks;
+          best_files = files;
+        }
+    }
+
+  return best;
+}
+
 static void
 task_init (aes128_task *task)
 {
@@ -69,97 +253,395 @@ task_init (aes128_task *task)
 static void
 task_destroy (aes128_task *task) { }
 
-/* Pick completed tasks from device and return total size of data
-   available to read by user.  */
-static size_t
-__move_completed_tasks (aes128_context *context)
+/* Do NOT use this function without spinlock.  */
+__must_check static size_t
+__free_task_slots (aes128_dev *aes_dev)
 {
-  aes128_task *task, *temp_task;
-  unsigned long flags;
-  struct list_head my_tasks;
+  /* I need at least 2 free slots to distinguish all possible situations.  */
+  return aes_dev->cmd_slots - aes_dev->tasks_in_progress
+          - aes_dev->reserved_slots - 2;
+}
+
+__must_check static size_t
+free_task_slots (aes128_dev *aes_dev)
+{
+  unsigned long irq_flags;
+  size_t ret;
+
+  spin_lock_irqsave (&aes_dev->lock, irq_flags);
+  ret = __free_task_slots (aes_dev);
+  spin_unlock_irqrestore (&aes_dev->lock, irq_flags);
+
+  return ret;
+}
+
+/* Interrupt coalescing policy.  Interrupt is requested on every
+   intr_coalesce-th command and on the last command of a batch if there are
+   too few commands in flight to expect another interrupt soon.  Commands
+   left without an interrupt are picked up by reap_timer.
+   Do NOT use this function without spinlock.  */
+__must_check static bool
+__intr_wanted (aes128_dev *aes_dev, bool last_in_batch)
+{
+  unsigned int every;
+
+  every = max (intr_coalesce, 1u);
+  aes_dev->cmds_since_intr++;
+  if (aes_dev->cmds_since_intr >= every
+      || (last_in_batch && aes_dev->tasks_in_progress < every))
+    {
+      aes_dev->cmds_since_intr = 0;
+      return true;
+    }
+  return false;
+}
+
+/* Do NOT use this function without spinlock.  */
+static void
+__arm_reap_timer (aes128_dev *aes_dev)
+{
+  if (!hrtimer_is_queued (&aes_dev->reap_timer))
+    hrtimer_start (&aes_dev->reap_timer,
+                   ktime_set (0, intr_delay_us * NSEC_PER_USEC),
+                   HRTIMER_MODE_REL);
+}
+
+/* Can tasks of CONTEXT (with own key and state slot if OWN_KS) be
+   encrypted on the CPU now?  Not if they need state left by tasks still on
+   the device.  Do NOT use this function without spinlock of the context's
+   device.  */
+__must_check static bool
+__aes_sw_allowed (aes128_context *context, bool own_ks)
+{
+  return READ_ONCE (sw_fallback)
+          && (own_ks || !HAS_STATE (context->mode) || context->hw_tasks == 0);
+}
+
+/* Reserve up to WANTED slots in command buffer for a following
+   aes_submit_tasks call.  Returns the number of reserved slots (at least one)
+   or error, -EAGAIN if command buffer is full and NONBLOCK is set.  If tasks
+   of CONTEXT can go to sw_fallback, full command buffer gives 0 instead.  */
+__must_check static int
+aes_reserve_slots (aes128_dev *aes_dev, aes128_context *context,
+                   size_t wanted, bool nonblock)
+{
+  unsigned long irq_flags;
+  size_t got;
+  u64 wait_start;
+  int _ret_queue;
 
-  DNOTIF_ENTER_FUN;
   might_sleep ();
 
-  INIT_LIST_HEAD (&my_tasks);
+  /*** CRITICAL SECTION ***/
+  spin_lock_irqsave (&aes_dev->lock, irq_flags);
+  while (__free_task_slots (aes_dev) < 1)
+    {
+      if (__aes_sw_allowed (context, context->split))
+        {
+          spin_unlock_irqrestore (&aes_dev->lock, irq_flags);
+          return 0;
+        }
+      spin_unlock_irqrestore (&aes_dev->lock, irq_flags);
 
-  /*** CRITICAL SECTION ****/
-  spin_lock_irqsave (&context->aes_dev->lock, flags);
+      if (nonblock)
+        {
+          KDEBUG ("no space in command buffer => EAGAIN\n");
+          return -EAGAIN;
+        }
 
-  list_for_each_entry_safe (task,
-                            temp_task,
-                            &context->aes_dev->completed_list_head,
-                            task_list)
-  {
-    /* Move my tasks to my list.  */
-    if (task->context == context)
-      {
-        list_del (&task->task_list);
-        list_add_tail (&task->task_list, &my_tasks);
-      }
-  }
-  spin_unlock_irqrestore (&context->aes_dev->lock, flags);
+      wait_start = ktime_get_ns ();
+      _ret_queue = wait_event_interruptible (aes_dev->command_queue,
+                                             free_task_slots (aes_dev) >= 1);
+      this_cpu_add (aes_dev->stats->cmd_wait_ns, ktime_get_ns () - wait_start);
+      if (_ret_queue != 0)
+        return _ret_queue;
 
-  /*** END CRITICAL SECTION ****/
+      spin_lock_irqsave (&aes_dev->lock, irq_flags);
+    }
 
-  list_for_each_entry_safe (task, temp_task, &my_tasks, task_list)
-  {
-    KDEBUG ("moving task %p at %d\n", task, task->cmd_index);
+  got = min (wanted, __free_task_slots (aes_dev));
+  aes_dev->reserved_slots += got;
+  spin_unlock_irqrestore (&aes_dev->lock, irq_flags);
+  /*** END CRITICAL SECTION ***/
 
-    context->buffer.write_tail += task->block_count * sizeof (aes128_block);
-    context->buffer.write_tail %= AESDRV_IOBUFF_SIZE;
+  return got;
+}
 
-    context->buffer.read_count += task->block_count * sizeof (aes128_block);
-    context->buffer.write_count -= task->block_count * sizeof (aes128_block);
-    assert (context->buffer.write_count >= 0);
+static void
+aes_release_slots (aes128_dev *aes_dev, size_t count)
+{
+  unsigned long irq_flags;
 
-    assert (context->buffer.read_count > 0
-            && context->buffer.read_count <= AESDRV_IOBUFF_SIZE);
+  if (count == 0)
+    return;
 
-    assert (context->buffer.write_count >= 0
-            && context->buffer.write_count <= AESDRV_IOBUFF_SIZE);
+  spin_lock_irqsave (&aes_dev->lock, irq_flags);
+  aes_dev->reserved_slots -= count;
+  spin_unlock_irqrestore (&aes_dev->lock, irq_flags);
 
-    list_del (&task->task_list);
-    task_destroy (task);
-    kfree (task);
-  }
+  wake_up (&aes_dev->command_queue);
+  aes_crypto_pump (aes_dev);
+}
+
+/* Put up to FREE_SLOTS tasks from the list into command buffer, move them
+   to device's list of active tasks and notify the device.  Slots counted in
+   RESERVED (if not NULL) are used first.
+   Do NOT use this function without spinlock.  */
+static void
+__aes_fill_commands (aes128_dev *aes_dev, struct list_head *tasks,
+                     size_t free_slots, size_t *reserved)
+{
+  aes128_task *task;
+  aes128_command *cmd;
+
+  task = NULL;
+  while (free_slots > 0 && !list_empty (tasks))
+    {
+      task = list_first_entry (tasks, aes128_task, task_list);
+      assert (task->context == NULL
+              || task->context->mode != AESDEV_MODE_CLOSING);
+
+      task->intr = __intr_wanted (aes_dev, free_slots == 1
+                                  || list_is_singular (tasks));
+
+      task->cmd_index = aes_dev->cmd_write_index;
+      cmd = (aes128_command *) aes_dev->cmd_buffer.k_ptr + task->cmd_index;
+
+      cmd->in_ptr = task->inout_buffer.d_ptr;
+      cmd->out_ptr = task->out_ptr;
+      cmd->ks_ptr = task->ks_ptr;
+      cmd->xfer_val = AESDEV_TASK (task->block_count,
+                                   task->intr ? 0x01 : 0x00,
+                                   HAS_STATE (task->mode),
+                                   task->mode);
+      trace_aesdev_task_submit (aes_dev, task);
+
+      /* Save task as active on device's list.  */
+      list_move_tail (&task->task_list, &aes_dev->task_list_head);
+      if (task->context != NULL && task->ks_slot.k_ptr == NULL)
+        task->context->hw_tasks++;
+
+      aes_dev->cmd_write_index =
+              (aes_dev->cmd_write_index + 1) % aes_dev->cmd_slots;
+      aes_dev->tasks_in_progress++;
+      aes_dev->commands_submitted++;
+      free_slots--;
+      if (reserved != NULL && *reserved > 0)
+        {
+          (*reserved)--;
+          aes_dev->reserved_slots--;
+        }
+    }
 
-  KDEBUG ("returning %d\n", acb_read_count (&context->buffer));
+  if (task == NULL)
+    return;
 
-  DNOTIF_LEAVE_FUN;
-  return acb_read_count (&context->buffer);
+  /* Commands must be in memory before device sees new write pointer.  */
+  wmb ();
+
+  /* Commit all new commands at once.  */
+  aes_reg_write (aes_dev, (uint32_t) aes_dev->cmd_buffer.d_ptr
+                 + aes_dev->cmd_write_index * sizeof (aes128_command),
+                 AESDEV_CMD_WRITE_PTR);
+  aes_dev->doorbells++;
+
+  /* No interrupt will tell about completion of the last command, so
+     make sure someone checks it later.  */
+  if (!task->intr)
+    __arm_reap_timer (aes_dev);
 }
 
-static size_t
-move_completed_tasks (aes128_context *context)
+/* Put tasks from the list into command buffer and move them to device's
+   list of active tasks.  Device is notified once per batch of commands
+   (once per call, unless the command buffer gets full in the meantime), and
+   the write pointer is tracked in aes_dev, so no register read is needed.
+   RESERVED slots (from aes_reserve_slots) are used first, unused ones are
+   released.  With sw_fallback, io buffer tasks that find no free slot are
+   encrypted on the CPU right here.  */
+static void
+aes_submit_tasks (aes128_dev *aes_dev, struct list_head *tasks,
+                  size_t reserved)
 {
-  size_t ret;
+  unsigned long irq_flags;
+  size_t free_slots, sw_foreign;
+  aes128_task *task;
+  bool sw, sw_failed, foreign;
+  u64 wait_start;
+
   might_sleep ();
-  mutex_lock (&context->buffer.common_lock);
-  ret = __move_completed_tasks (context);
-  mutex_unlock (&context->buffer.common_lock);
-  return ret;
+  sw_foreign = 0;
+  sw_failed = false;
+
+  while (!list_empty (tasks))
+    {
+      /*** CRITICAL SECTION ***/
+      spin_lock_irqsave (&aes_dev->lock, irq_flags);
+      /* Wait for space in command buffer if nothing was reserved.
+         Callers reserve a slot for every task they can, non-blocking ones
+         never get here without one, so skip NONBLOCK support here.  */
+      sw = false;
+      while ((free_slots = __free_task_slots (aes_dev) + reserved) < 1)
+        {
+          task = list_first_entry (tasks, aes128_task, task_list);
+          if (!sw_failed && task->context != NULL
+              && task->inout_buffer.k_ptr != NULL
+              && __aes_sw_allowed (task->context,
+                                   task->ks_slot.k_ptr != NULL))
+            {
+              sw = true;
+              break;
+            }
+          spin_unlock_irqrestore (&aes_dev->lock, irq_flags);
+
+          wait_start = ktime_get_ns ();
+          wait_event (aes_dev->command_queue,
+                      free_task_slots (aes_dev) >= 1);
+          this_cpu_add (aes_dev->stats->cmd_wait_ns,
+                        ktime_get_ns () - wait_start);
+
+          spin_lock_irqsave (&aes_dev->lock, irq_flags);
+        }
+
+      if (sw)
+        {
+          spin_unlock_irqrestore (&aes_dev->lock, irq_flags);
+          /* If this fails, tasks wait for the device after all.  */
+          list_del_init (&task->task_list);
+          foreign = task->context->aes_dev != aes_dev;
+          if (IS_ERR_VALUE (aes_sw_run_task (aes_dev, task)))
+            {
+              list_add (&task->task_list, tasks);
+              sw_failed = true;
+            }
+          else if (foreign)
+            sw_foreign++;
+          continue;
+        }
+
+      __aes_fill_commands (aes_dev, tasks, free_slots, &reserved);
+
+      spin_unlock_irqrestore (&aes_dev->lock, irq_flags);
+      /*** END CRITICAL SECTION ***/
+    }
+
+  aes_release_slots (aes_dev, reserved);
+
+  /* Pieces of split data done here instead of on this device, see
+     __context_split_tasks.  */
+  while (sw_foreign-- > 0)
+    aes_crypto_put_dev (aes_dev);
 }
 
-/* Do NOT use this function without spinlock.  */
-__must_check static size_t
-__free_task_slots (aes128_dev *aes_dev)
+/* Make a task with no context for LEN bytes (whole blocks) of DMA-mapped
+   data and add it to the list.  */
+__must_check static int
+aes_make_task (struct list_head *tasks, dma_addr_t in, dma_addr_t out,
+               size_t len, aes_dma_addr_t ks_ptr, int mode, gfp_t gfp)
 {
-  /* I need at least 2 free slots to distinguish all possible situations.  */
-  return AESDRV_CMDBUFF_SLOTS - aes_dev->tasks_in_progress - 2;
+  aes128_task *task;
+
+  assert (len % sizeof (aes128_block) == 0);
+
+  task = kmalloc (sizeof (aes128_task), gfp);
+  if (task == NULL)
+    return -ENOMEM;
+
+  task_init (task);
+  task->inout_buffer.d_ptr = in;
+  task->out_ptr = out;
+  task->ks_ptr = ks_ptr;
+  task->mode = mode;
+  task->block_count = len / sizeof (aes128_block);
+
+  list_add_tail (&task->task_list, tasks);
+  return 0;
 }
 
-__must_check static size_t
-free_task_slots (aes128_dev *aes_dev)
+/* Make one task for every piece of first LEN bytes that is contiguous in
+   both mapped scatterlists.  Pieces have to be whole blocks.  Returns the
+   number of tasks added to the list.  On error some tasks might have been
+   added already.  */
+__must_check static int
+aes_make_sg_tasks (struct list_head *tasks, struct scatterlist *src,
+                   struct scatterlist *dst, size_t len,
+                   aes_dma_addr_t ks_ptr, int mode, gfp_t gfp)
 {
-  unsigned long irq_flags;
-  size_t ret;
+  size_t src_off, dst_off, piece;
+  int count, ret;
 
-  spin_lock_irqsave (&aes_dev->lock, irq_flags);
-  ret = __free_task_slots (aes_dev);
-  spin_unlock_irqrestore (&aes_dev->lock, irq_flags);
+  count = 0;
+  src_off = 0;
+  dst_off = 0;
+  while (len > 0)
+    {
+      piece = min_t (size_t, sg_dma_len (src) - src_off,
+                     sg_dma_len (dst) - dst_off);
+      piece = min3 (piece, len, (size_t) AESDRV_IOBUFF_MAX_SIZE);
+      if (piece > 0)
+        {
+          ret = aes_make_task (tasks, sg_dma_address (src) + src_off,
+                               sg_dma_address (dst) + dst_off, piece,
+                               ks_ptr, mode, gfp);
+          if (IS_ERR_VALUE (ret))
+            return ret;
+          count++;
+        }
 
-  return ret;
+      len -= piece;
+      src_off += piece;
+      dst_off += piece;
+      if (src_off == sg_dma_len (src))
+        {
+          src = sg_next (src);
+          src_off = 0;
+        }
+      if (dst_off == sg_dma_len (dst))
+        {
+          dst = sg_next (dst);
+          dst_off = 0;
+        }
+    }
+
+  return count;
+}
+
+static void
+aes_free_tasks (struct list_head *tasks)
+{
+  aes128_task *task, *temp_task;
+
+  list_for_each_entry_safe (task, temp_task, tasks, task_list)
+  {
+    list_del (&task->task_list);
+    task_destroy (task);
+    kfree (task);
+  }
+}
+
+static void
+aes_wake_task_owner (aes128_task *task)
+{
+  complete (task->data);
+}
+
+/* Submit tasks with no context and wait until all of them are done.
+   Commands complete in order, so only the last one needs to signal.  */
+static void
+aes_run_tasks (aes128_dev *aes_dev, struct list_head *tasks)
+{
+  DECLARE_COMPLETION_ONSTACK (done);
+  aes128_task *last;
+
+  might_sleep ();
+
+  last = list_last_entry (tasks, aes128_task, task_list);
+  last->complete = aes_wake_task_owner;
+  last->data = &done;
+
+  aes_submit_tasks (aes_dev, tasks, 0);
+
+  /* Device writes to memory of the caller, do not let it go.  */
+  wait_for_completion (&done);
 }
 
 __must_check static int
@@ -184,7 +666,7 @@ context_init (aes128_context *context, aes128_dev *aes_dev)
 
   memset (context, 0, sizeof (aes128_context));
 
-  ret = acb_init (&context->buffer, aes_dev);
+  ret = acb_init (&context->buffer, aes_dev, iobuff_size);
   if (IS_ERR_VALUE (ret))
     {
       printk (KERN_WARNING "acb_init\n");
@@ -193,7 +675,7 @@ context_init (aes128_context *context, aes128_dev *aes_dev)
 
   context->mode = AESDEV_MODE_UNDEF;
   context->aes_dev = aes_dev;
-  context->ks_buffer.k_ptr = dma_alloc_coherent (&aes_dev->pci_dev->dev,
+  context->ks_buffer.k_ptr = dma_alloc_coherent (aes_dev->dev,
                                                  2 * sizeof (aes128_block),
                                                  &temp_dma_addr, GFP_KERNEL);
   context->ks_buffer.d_ptr = temp_dma_addr;
@@ -204,6 +686,10 @@ context_init (aes128_context *context, aes128_dev *aes_dev)
       return -ENOMEM;
     }
 
+  /* Completed tasks wait here for earlier ones (under device spinlock).  */
+  INIT_LIST_HEAD (&context->reorder_list);
+  INIT_LIST_HEAD (&context->async_done);
+
   INIT_LIST_HEAD (&context->lf.file_list);
   list_add_tail (&context->lf.file_list, &aes_dev->file_list_head);
 
@@ -217,10 +703,12 @@ context_destroy (aes128_context *context)
   DNOTIF_ENTER_FUN;
   might_sleep ();
 
-  dma_free_coherent (&context->aes_dev->pci_dev->dev,
+  dma_free_coherent (context->aes_dev->dev,
                      2 * sizeof (aes128_block),
                      context->ks_buffer.k_ptr,
                      context->ks_buffer.d_ptr);
+  if (context->sw_tfm != NULL)
+    crypto_free_skcipher (context->sw_tfm);
 
   acb_destroy (&context->buffer, context->aes_dev);
 
@@ -234,16 +722,22 @@ context_destroy (aes128_context *context)
 __must_check static inline size_t
 __context_busy (aes128_context *context)
 {
+  unsigned long flags;
+  size_t ret;
+
   DNOTIF_ENTER_FUN;
-  __move_completed_tasks (context);
-  KDEBUG ("returning %zu write=%d toenc=%d read=%d\n",
-          context->buffer.write_count - context->buffer.to_encrypt_count,
-          context->buffer.write_count,
-          context->buffer.to_encrypt_count,
-          context->buffer.read_count);
+  /* How many bytes are currently being encrypted at the device?  Read
+     under the device spinlock, so that the context is not seen idle while
+     its last task is still being handed over to it.  */
+  spin_lock_irqsave (&context->aes_dev->lock, flags);
+  ret = acb_in_flight (&context->buffer);
+  spin_unlock_irqrestore (&context->aes_dev->lock, flags);
+  KDEBUG ("returning %zu write=%zu toenc=%zu read=%zu\n", ret,
+          acb_write_count (&context->buffer),
+          acb_to_encrypt_count (&context->buffer),
+          acb_read_count (&context->buffer));
   DNOTIF_LEAVE_FUN;
-  /* How many bytes are currently being encrypted at the device?  */
-  return context->buffer.write_count - context->buffer.to_encrypt_count;
+  return ret;
 }
 
 __must_check static size_t
@@ -261,8 +755,22 @@ context_busy (aes128_context *context)
 /*****************************************************************************/
 
 /*** Combo buffer ************************************************************/
+/* Round requested buffer size up to whole pages (so that the buffer can be
+   mmaped) and clamp it to the allowed range.  */
+__must_check static size_t
+acb_fix_size (size_t size)
+{
+  size_t max_size;
+
+  max_size = min_t (size_t, iobuff_max_size, AESDRV_IOBUFF_MAX_SIZE);
+  max_size = max_t (size_t, max_size & PAGE_MASK, PAGE_SIZE);
+
+  size = PAGE_ALIGN (size);
+  return clamp_t (size_t, size, PAGE_SIZE, max_size);
+}
+
 __must_check static int
-acb_init (aes128_combo_buffer *buffer, aes128_dev *aes_dev)
+acb_init (aes128_combo_buffer *buffer, aes128_dev *aes_dev, size_t size)
 {
   dma_addr_t tmp_dma_addr;
 
@@ -272,8 +780,9 @@ acb_init (aes128_combo_buffer *buffer, aes128_dev *aes_dev)
   memset (buffer, 0, sizeof (aes128_combo_buffer));
 
   /* Start with allocation to avoid cleanup on failure later.  */
-  buffer->data.k_ptr = dma_alloc_coherent (&aes_dev->pci_dev->dev,
-                                           AESDRV_IOBUFF_SIZE,
+  buffer->size = acb_fix_size (size);
+  buffer->data.k_ptr = dma_alloc_coherent (aes_dev->dev,
+                                           buffer->size,
                                            &tmp_dma_addr,
                                            GFP_KERNEL);
   if (buffer->data.k_ptr == NULL)
@@ -301,121 +810,629 @@ acb_destroy (aes128_combo_buffer *buffer, aes128_dev *aes_dev)
   mutex_destroy (&buffer->write_lock);
   mutex_destroy (&buffer->common_lock);
 
-  dma_free_coherent (&aes_dev->pci_dev->dev,
-                     AESDRV_IOBUFF_SIZE,
+  dma_free_coherent (aes_dev->dev,
+                     buffer->size,
                      buffer->data.k_ptr,
                      buffer->data.d_ptr);
+  if (buffer->out_of_place)
+    dma_free_coherent (aes_dev->dev,
+                       buffer->size,
+                       buffer->out_data.k_ptr,
+                       buffer->out_data.d_ptr);
+
+  if (buffer->info != NULL)
+    free_page ((unsigned long) buffer->info);
 
   DNOTIF_LEAVE_FUN;
 }
 
+/* Replace data area of an empty buffer with a new one of given size.
+   Call with common_lock held.  */
+__must_check static int
+acb_resize (aes128_combo_buffer *buffer, aes128_dev *aes_dev, size_t size)
+{
+  dma_addr_t tmp_dma_addr;
+  dma_ptr data, out_data;
+
+  might_sleep ();
+  assert (acb_write_count (buffer) == 0 && acb_read_count (buffer) == 0);
+
+  size = acb_fix_size (size);
+  if (size == buffer->size)
+    return 0;
+
+  data.k_ptr = dma_alloc_coherent (aes_dev->dev, size,
+                                   &tmp_dma_addr, GFP_KERNEL);
+  if (data.k_ptr == NULL)
+    return -ENOMEM;
+  data.d_ptr = tmp_dma_addr;
+
+  if (buffer->out_of_place)
+    {
+      out_data.k_ptr = dma_alloc_coherent (aes_dev->dev, size,
+                                           &tmp_dma_addr, GFP_KERNEL);
+      if (out_data.k_ptr == NULL)
+        {
+          dma_free_coherent (aes_dev->dev, size, data.k_ptr,
+                             data.d_ptr);
+          return -ENOMEM;
+        }
+      out_data.d_ptr = tmp_dma_addr;
+
+      dma_free_coherent (aes_dev->dev, buffer->size,
+                         buffer->out_data.k_ptr, buffer->out_data.d_ptr);
+      buffer->out_data = out_data;
+    }
+
+  dma_free_coherent (aes_dev->dev, buffer->size,
+                     buffer->data.k_ptr, buffer->data.d_ptr);
+
+  buffer->data = data;
+  buffer->size = size;
+
+  /* Buffer is empty, so all positions are equivalent.  */
+  buffer->read_tail = 0;
+  buffer->to_encrypt_tail = 0;
+  buffer->write_head = 0;
+  buffer->out_head = 0;
+
+  acb_publish (buffer);
+  return 0;
+}
+
+/* Switch empty buffer between in-place and out-of-place mode.
+   Call with common_lock held.  */
+__must_check static int
+acb_set_out_of_place (aes128_combo_buffer *buffer, aes128_dev *aes_dev,
+                      bool out_of_place)
+{
+  dma_addr_t tmp_dma_addr;
+
+  might_sleep ();
+  assert (acb_write_count (buffer) == 0 && acb_read_count (buffer) == 0);
+
+  if (out_of_place == buffer->out_of_place)
+    return 0;
+
+  if (out_of_place)
+    {
+      buffer->out_data.k_ptr = dma_alloc_coherent (aes_dev->dev,
+                                                   buffer->size,
+                                                   &tmp_dma_addr,
+                                                   GFP_KERNEL);
+      if (buffer->out_data.k_ptr == NULL)
+        return -ENOMEM;
+      buffer->out_data.d_ptr = tmp_dma_addr;
+    }
+  else
+    {
+      dma_free_coherent (aes_dev->dev, buffer->size,
+                         buffer->out_data.k_ptr, buffer->out_data.d_ptr);
+      buffer->out_data.k_ptr = NULL;
+      buffer->out_data.d_ptr = 0;
+    }
+
+  buffer->out_of_place = out_of_place;
+  buffer->read_tail = 0;
+  buffer->to_encrypt_tail = 0;
+  buffer->write_head = 0;
+  buffer->out_head = 0;
+
+  acb_publish (buffer);
+  return 0;
+}
+
+/* Counters of the other sides are read with smp_load_acquire, so that the
+   data they cover is seen as well.  The one that is behind is read first:
+   counters only grow, so a concurrent update makes a count look larger
+   for a moment, never negative.  */
+
+/* Encrypted data waiting for the reader.  */
 __must_check static inline size_t
 acb_read_count (const aes128_combo_buffer *buffer)
 {
-  return buffer->read_count;
+  size_t consumed = smp_load_acquire (&buffer->consumed);
+
+  return smp_load_acquire (&buffer->completed) - consumed;
 }
 
+/* Data written, but not encrypted yet (with data in flight).  */
 __must_check static inline size_t
 acb_write_count (const aes128_combo_buffer *buffer)
 {
-  return buffer->write_count;
+  size_t completed = smp_load_acquire (&buffer->completed);
+
+  return smp_load_acquire (&buffer->written) - completed;
 }
 
+/* Data written, but not made into tasks yet.  Call with common_lock held
+   (or for information only).  */
 __must_check static inline size_t
-acb_write_count_to_end (const aes128_combo_buffer *buffer)
+acb_to_encrypt_count (const aes128_combo_buffer *buffer)
 {
-  if (buffer->write_tail + buffer->write_count <= AESDRV_IOBUFF_SIZE)
-    return buffer->write_count;
-  return AESDRV_IOBUFF_SIZE - buffer->write_tail;
+  size_t submitted = READ_ONCE (buffer->submitted);
+
+  return READ_ONCE (buffer->written) - submitted;
 }
 
+/* Data made into tasks, but not encrypted yet.  */
 __must_check static inline size_t
-acb_to_encrypt_count_to_end (const aes128_combo_buffer *buffer)
+acb_in_flight (const aes128_combo_buffer *buffer)
 {
-  if (buffer->to_encrypt_tail + buffer->to_encrypt_count <= AESDRV_IOBUFF_SIZE)
-    return buffer->to_encrypt_count;
-  return AESDRV_IOBUFF_SIZE - buffer->to_encrypt_tail;
+  size_t completed = smp_load_acquire (&buffer->completed);
+
+  return READ_ONCE (buffer->submitted) - completed;
 }
 
 __must_check static inline size_t
-acb_free (const aes128_combo_buffer *buffer)
+acb_to_encrypt_count_to_end (const aes128_combo_buffer *buffer)
 {
-  return AESDRV_IOBUFF_SIZE - buffer->write_count - buffer->read_count;
+  size_t count = acb_to_encrypt_count (buffer);
+
+  if (buffer->to_encrypt_tail + count <= buffer->size)
+    return count;
+  return buffer->size - buffer->to_encrypt_tail;
+}
+
+/* Space for new data.  Encrypted data waiting for the reader takes space
+   of input only in in-place mode.  Exact for the writer, others may see
+   less than there is.  */
+__must_check static inline size_t
+acb_free (const aes128_combo_buffer *buffer)
+{
+  size_t done;
+
+  if (buffer->out_of_place)
+    done = smp_load_acquire (&buffer->completed);
+  else
+    done = smp_load_acquire (&buffer->consumed);
+  return buffer->size - (READ_ONCE (buffer->written) - done);
+}
+
+/* Where encrypted data is.  */
+__must_check static inline char *
+acb_out_ptr (const aes128_combo_buffer *buffer)
+{
+  if (buffer->out_of_place)
+    return buffer->out_data.k_ptr;
+  return buffer->data.k_ptr;
+}
+
+/* Contiguous space for output of new tasks in out-of-place mode.  It is
+   taken by data in flight (as long as in input) and data to read, that
+   is everything submitted and not consumed yet.  Call with common_lock
+   held.  */
+__must_check static inline size_t
+acb_out_free_to_end (const aes128_combo_buffer *buffer)
+{
+  size_t taken;
+
+  taken = buffer->submitted - smp_load_acquire (&buffer->consumed);
+  return min (buffer->size - taken, buffer->size - buffer->out_head);
 }
 
+__must_check static inline size_t
+acb_read_count_to_end (const aes128_combo_buffer *buffer)
+{
+  size_t count = acb_read_count (buffer);
+
+  if (buffer->read_tail + count <= buffer->size)
+    return count;
+  return buffer->size - buffer->read_tail;
+}
+
+/* Length of the pieces __context_split_tasks cuts the data of CONTEXT
+   into, or 0 if its data is not split.  */
 __must_check static size_t
-mut_acb_free (aes128_combo_buffer *buffer)
+context_piece_len (const aes128_context *context)
 {
-  size_t ret;
-  mutex_lock (&buffer->common_lock);
-  ret = acb_free (buffer);
-  mutex_unlock (&buffer->common_lock);
-  return ret;
+  if (!context->split)
+    return 0;
+  return READ_ONCE (split_len) / sizeof (aes128_block)
+          * sizeof (aes128_block);
 }
 
+/* How many tasks would be created if LEN more bytes were written.  With
+   PIECE_LEN (see context_piece_len) every contiguous run is cut further
+   into pieces, this gives an upper bound then.  */
 __must_check static size_t
-acb_free_to_end (const aes128_combo_buffer *buffer)
+acb_tasks_needed (const aes128_combo_buffer *buffer, size_t len,
+                  size_t piece_len)
+{
+  size_t total, to_end, needed;
+
+  total = acb_to_encrypt_count (buffer) + len;
+  to_end = buffer->size - buffer->to_encrypt_tail;
+  if (total <= to_end)
+    needed = total >= sizeof (aes128_block) ? 1 : 0;
+  else
+    needed = total - to_end >= sizeof (aes128_block) ? 2 : 1;
+
+  /* Output may wrap at a different place.  */
+  if (buffer->out_of_place && needed > 0
+      && buffer->out_head + total > buffer->size)
+    needed++;
+
+  /* Cutting TOTAL bytes into NEEDED runs adds at most NEEDED - 1 pieces.  */
+  if (piece_len > 0 && needed > 0)
+    needed = DIV_ROUND_UP (total, piece_len) + needed - 1;
+  return needed;
+}
+
+/* Refresh the buffer state visible to user through mmap (if any).
+   Call with common_lock held.  */
+static void
+acb_publish (aes128_combo_buffer *buffer)
 {
-  if (buffer->read_tail == buffer->write_head)
+  if (buffer->info == NULL)
+    return;
+
+  buffer->info->size = buffer->size;
+  buffer->info->write_head = buffer->write_head;
+  buffer->info->write_free = acb_free (buffer);
+  buffer->info->read_tail = buffer->read_tail;
+  buffer->info->read_count = acb_read_count (buffer);
+}
+
+/* Add BLOCKS to big-endian 128-bit counter.  */
+static void
+ctr_add (uint8_t *ctr, size_t blocks)
+{
+  int i;
+
+  for (i = AESDEV_AES_BLOCK_SIZE - 1; i >= 0 && blocks > 0; --i)
+    {
+      blocks += ctr[i];
+      ctr[i] = blocks & 0xff;
+      blocks >>= 8;
+    }
+}
+
+/* Make tasks for LEN bytes (whole blocks) of ECB/CTR data at to_encrypt_tail
+   in pieces of split_len bytes, and send every piece to the least loaded
+   device that can use the DMA addresses of the buffer.  Each piece has its
+   own key and state slot, so no piece waits for the state of the previous
+   one; the counter of the context is advanced here.  A piece goes to
+   another device only if a command slot can be reserved there right away,
+   so nothing waits for it with common_lock held; otherwise, and for the
+   context's own device, pieces are added to OWN_TASKS.  Call with
+   common_lock held.  */
+__must_check static int
+__context_split_tasks (aes128_context *context, aes128_combo_buffer *buffer,
+                       size_t len, struct list_head *own_tasks)
+{
+  aes128_dev *aes_dev;
+  aes128_task *task;
+  struct list_head one_task;
+  dma_addr_t tmp_dma_addr;
+  size_t piece_len, piece;
+
+  piece_len = context_piece_len (context);
+  if (piece_len == 0)
+    piece_len = len;
+
+  for (; len > 0; len -= piece)
     {
-      if (buffer->write_count == 0 && buffer->read_count == 0)
-        return AESDRV_IOBUFF_SIZE - buffer->write_head;
+      piece = min (len, piece_len);
+
+      aes_dev = aes_crypto_get_dev (context->aes_dev);
+      if (aes_dev != NULL
+          && (aes_dev == context->aes_dev
+              || aes_reserve_slots (aes_dev, context, 1, true) != 1))
+        {
+          aes_crypto_put_dev (aes_dev);
+          aes_dev = NULL;
+        }
+
+      task = kmalloc (sizeof (aes128_task), GFP_KERNEL);
+      if (task == NULL)
+        goto nomem;
+      task_init (task);
+
+      task->ks_slot.k_ptr =
+              dma_pool_alloc ((aes_dev ? aes_dev : context->aes_dev)->ks_pool,
+                              GFP_KERNEL, &tmp_dma_addr);
+      if (task->ks_slot.k_ptr == NULL)
+        {
+          kfree (task);
+          goto nomem;
+        }
+      task->ks_slot.d_ptr = tmp_dma_addr;
+      memcpy (task->ks_slot.k_ptr, context->ks_buffer.k_ptr,
+              2 * sizeof (aes128_block));
+      if (context->mode == AESDEV_MODE_CTR)
+        ctr_add ((uint8_t *) context->ks_buffer.k_ptr + sizeof (aes128_block),
+                 piece / sizeof (aes128_block));
+
+      task->context = context;
+      task->seq = context->task_seq++;
+      task->block_count = piece / sizeof (aes128_block);
+      task->inout_buffer.d_ptr = buffer->data.d_ptr + buffer->to_encrypt_tail;
+      task->inout_buffer.k_ptr = buffer->data.k_ptr + buffer->to_encrypt_tail;
+      if (buffer->out_of_place)
+        {
+          task->out_ptr = buffer->out_data.d_ptr + buffer->out_head;
+          buffer->out_head = (buffer->out_head + piece) % buffer->size;
+        }
       else
-        return 0;
+        task->out_ptr = task->inout_buffer.d_ptr;
+      task->ks_ptr = task->ks_slot.d_ptr;
+      task->mode = context->mode;
+
+      /* Before the task can complete.  */
+      WRITE_ONCE (buffer->submitted, buffer->submitted + piece);
+      buffer->to_encrypt_tail = (buffer->to_encrypt_tail + piece)
+              % buffer->size;
+      trace_aesdev_task_create (aes_dev ? aes_dev : context->aes_dev, task);
+
+      if (aes_dev == NULL)
+        list_add_tail (&task->task_list, own_tasks);
+      else
+        {
+          /* Device reference is dropped when the task is reaped.  */
+          INIT_LIST_HEAD (&one_task);
+          list_add_tail (&task->task_list, &one_task);
+          aes_submit_tasks (aes_dev, &one_task, 1);
+        }
+    }
+
+  return 0;
+
+nomem:
+  printk (KERN_WARNING "cannot allocate memory for encryption task\n");
+  if (aes_dev != NULL)
+    {
+      aes_release_slots (aes_dev, 1);
+      aes_crypto_put_dev (aes_dev);
+    }
+  return -ENOMEM;
+}
+
+/* Send all complete blocks waiting in the buffer to the device.  Data to
+   encrypt (and, in out-of-place mode, space for output) can wrap around the
+   end of buffer, so there might be a few tasks.  RESERVED command slots are
+   passed on to aes_submit_tasks.  Call with common_lock held.  */
+__must_check static int
+__acb_make_tasks (aes128_context *context, size_t reserved)
+{
+  aes128_combo_buffer *buffer;
+  aes128_task *task;
+  struct list_head tasks;
+  size_t len;
+  int retval;
+
+  might_sleep ();
+  INIT_LIST_HEAD (&tasks);
+  retval = 0;
+  buffer = &context->buffer;
+
+  /* Loop until there are no complete blocks left (or no space for their
+     output).  */
+  for (;;)
+    {
+      len = acb_to_encrypt_count_to_end (buffer);
+      if (buffer->out_of_place)
+        len = min (len, acb_out_free_to_end (buffer));
+      if (len < sizeof (aes128_block))
+        break;
+      len = len / sizeof (aes128_block) * sizeof (aes128_block);
+
+      if (context->split)
+        {
+          retval = __context_split_tasks (context, buffer, len, &tasks);
+          if (IS_ERR_VALUE (retval))
+            break;
+          continue;
+        }
+
+      task = kmalloc (sizeof (aes128_task), GFP_KERNEL);
+      if (!task)
+        {
+          printk (KERN_WARNING "cannot allocate memory for encryption task\n");
+          retval = -ENOMEM;
+          break;
+        }
+
+      task_init (task);
+      task->context = context;
+      task->seq = context->task_seq++;
+      task->block_count = len / sizeof (aes128_block);
+      assert (task->block_count > 0);
+
+      task->inout_buffer.d_ptr = buffer->data.d_ptr + buffer->to_encrypt_tail;
+      task->inout_buffer.k_ptr = buffer->data.k_ptr + buffer->to_encrypt_tail;
+      if (buffer->out_of_place)
+        {
+          task->out_ptr = buffer->out_data.d_ptr + buffer->out_head;
+          buffer->out_head = (buffer->out_head + len) % buffer->size;
+        }
+      else
+        task->out_ptr = task->inout_buffer.d_ptr;
+      task->ks_ptr = context->ks_buffer.d_ptr;
+      task->mode = context->mode;
+
+      /* Update the pointers and counters for next encryption task.  */
+      WRITE_ONCE (buffer->submitted, buffer->submitted + len);
+      buffer->to_encrypt_tail = (buffer->to_encrypt_tail + len) % buffer->size;
+      assert (acb_to_encrypt_count (buffer) <= buffer->size);
+      trace_aesdev_task_create (context->aes_dev, task);
+
+      list_add_tail (&task->task_list, &tasks);
     }
-  if (buffer->read_tail < buffer->write_head)
-    return AESDRV_IOBUFF_SIZE - buffer->write_head;
+
+  /* Send everything that has been prepared, even if some allocation
+     failed.  */
+  aes_submit_tasks (context->aes_dev, &tasks, reserved);
+
+  return retval;
+}
+
+/* Account LEN bytes, already placed in buffer at write_head, as written and
+   send all complete blocks to the device.  Used both by file_write_iter (after
+   copying user data) and by RING_SUBMIT ioctl (user wrote the data directly
+   into mmaped buffer).  RESERVED command slots are passed on to
+   aes_submit_tasks.  Call with common_lock held.  */
+__must_check static int
+__acb_commit (aes128_context *context, size_t len, size_t reserved)
+{
+  might_sleep ();
+
+  /* Update buffer pointers and counters.  The data is in place, so the
+     counter may be published.  */
+  context->buffer.write_head += len;
+  context->buffer.write_head %= context->buffer.size;
+  smp_store_release (&context->buffer.written, context->buffer.written + len);
+
+  acb_publish (&context->buffer);
+
+  context->bytes_written += len;
+  if (context->mode <= AESDEV_MODE_CTR)
+    this_cpu_add (context->aes_dev->stats->bytes[context->mode], len);
+
+  return __acb_make_tasks (context, reserved);
+}
+
+/* Give LEN bytes of encrypted data at read_tail back to the writer.  Only
+   the reader moves read_tail and consumed, so no lock is needed besides
+   read_lock.  */
+static void
+acb_release (aes128_context *context, size_t len)
+{
+  assert (len <= acb_read_count (&context->buffer));
+
+  context->buffer.read_tail += len;
+  context->buffer.read_tail %= context->buffer.size;
+  /* The data has been copied out, space may be reused now.  */
+  smp_store_release (&context->buffer.consumed,
+                     context->buffer.consumed + len);
+  context->bytes_read += len;
+  trace_aesdev_read (context, len);
+}
+
+/* Release LEN bytes of encrypted data at read_tail.  Call with read_lock and
+   common_lock held.  */
+static void
+__acb_consume (aes128_context *context, size_t len)
+{
+  acb_release (context, len);
+  acb_publish (&context->buffer);
+
+  /* In out-of-place mode the freed space is for output, data waiting for
+     it can go to the device now.  Otherwise some space in io buffer was
+     freed, perhaps someone is willing to write.  */
+  if (context->buffer.out_of_place)
+    (void) __acb_make_tasks (context, 0);
   else
-    return buffer->read_tail - buffer->write_head;
+    wake_up (&context->buffer.write_queue);
 }
 
-__must_check static inline size_t
-acb_read_count_to_end (const aes128_combo_buffer *buffer)
+/* The same for file_read_iter, with read_lock held only.  In the common
+   case (in-place, not mapped) this touches no lock shared with the writer;
+   common_lock is taken only to make tasks waiting for output space or to
+   refresh the mmaped state.  */
+static void
+acb_consume (aes128_context *context, size_t len)
 {
-  if (buffer->read_tail + buffer->read_count <= AESDRV_IOBUFF_SIZE)
-    return buffer->read_count;
-  return AESDRV_IOBUFF_SIZE - buffer->read_tail;
+  if (!context->buffer.out_of_place && READ_ONCE (context->buffer.info) == NULL)
+    {
+      acb_release (context, len);
+      wake_up (&context->buffer.write_queue);
+      return;
+    }
+
+  mutex_lock (&context->buffer.common_lock);
+  __acb_consume (context, len);
+  mutex_unlock (&context->buffer.common_lock);
 }
 /*****************************************************************************/
 
 /*** Irq handlers ************************************************************/
-static irqreturn_t
-irq_handler (int irq, void *ptr)
+/* Account completed task in its context and wake up the waiters.  Pieces of
+   split data run on several devices and may complete out of order, so keep
+   completed tasks sorted and account only those next in line.  This is the
+   producer side of encrypted data: completed is advanced only here, so the
+   reader can take the data without any lock.
+   Do NOT use this function without spinlock of the context's device.  */
+static void
+__hand_task_to_context (aes128_task *task)
+{
+  aes128_context *context = task->context;
+  aes128_combo_buffer *buffer = &context->buffer;
+  aes128_task *pos;
+  size_t done;
+
+  list_for_each_entry_reverse (pos, &context->reorder_list, task_list)
+    if ((ssize_t) (pos->seq - task->seq) < 0)
+      break;
+  list_move (&task->task_list, &pos->task_list);
+
+  done = 0;
+  while (!list_empty (&context->reorder_list))
+    {
+      task = list_first_entry (&context->reorder_list, aes128_task, task_list);
+      if (task->seq != context->next_seq)
+        break;
+      context->next_seq++;
+
+      KDEBUG ("accounting task %p at %d\n", task, task->cmd_index);
+      done += task->block_count * sizeof (aes128_block);
+
+      trace_aesdev_task_consume (context->aes_dev, task);
+      list_del (&task->task_list);
+      task_destroy (task);
+      kfree (task);
+    }
+
+  if (done == 0)
+    return;
+
+  assert (buffer->submitted - (buffer->completed + done) <= buffer->size);
+  smp_store_release (&buffer->completed, buffer->completed + done);
+
+  /* Notify processes waiting for read about new data.  Still under
+     spinlock, because context may go away as soon as its last task is
+     accounted (see __context_busy).  */
+  wake_up (&buffer->read_queue);
+  /* Input space is free after encryption in out-of-place mode.  */
+  if (buffer->out_of_place)
+    wake_up (&buffer->write_queue);
+}
+
+/* Hand all tasks completed by device over to their contexts and wake up
+   the waiters.  Returns number of completed tasks.  Called from irq thread,
+   but does not depend on being run there.  */
+static size_t
+aes_reap_tasks (aes128_dev *aes_dev)
 {
-  aes128_dev *aes_dev;
   aes128_task *task, *temp_task;
-  uint8_t intr;
+  struct list_head crypto_done, foreign_done;
   uint32_t read_index;
   unsigned long irq_flags;
   char dev_running;
+  size_t reaped;
 
-  aes_dev = ptr;
+  reaped = 0;
+  INIT_LIST_HEAD (&crypto_done);
+  INIT_LIST_HEAD (&foreign_done);
 
   /*** CRITICAL SECTION ***/
   spin_lock_irqsave (&aes_dev->lock, irq_flags);
-  intr = ioread32 (aes_dev->bar0 + AESDEV_INTR) & 0xFF;
-  if (!intr)
-    {
-      spin_unlock_irqrestore (&aes_dev->lock, irq_flags);
-      return IRQ_NONE;
-    }
-  /* All current interrupts will be handled.  */
-  iowrite32 (intr, aes_dev->bar0 + AESDEV_INTR);
   /* Check if the device is still running.
-     If it is running, it might stop during this handler, but I have written
-     to interrupt register before this check, so the interrupt handler would
-     be run again.
-     If it is not running, it will not start during this handler (spin lock).  */
-  dev_running = !!(ioread32 (aes_dev->bar0 + AESDEV_STATUS) & 0x03);
-
-  /* Get the instruction pointer. If it would increase during this handler, it
+     If it is running, it might stop during this function, but the interrupt
+     has been acknowledged before, so the interrupt handler would be run
+     again.
+     If it is not running, it will not start during this function (spin
+     lock).  */
+  dev_running = !!(aes_reg_read (aes_dev, AESDEV_STATUS) & 0x03);
+
+  /* Get the instruction pointer. If it would increase during this function, it
      would mean that the device is still running, so it will fire another after
      it finishes next command.  */
   read_index = AESDEV_CMD_INDEXOF (aes_dev->cmd_buffer.d_ptr,
-                                   ioread32 (aes_dev->bar0 + AESDEV_CMD_READ_PTR));
-  assert (read_index < AESDRV_CMDBUFF_SLOTS);
+                                   aes_reg_read (aes_dev, AESDEV_CMD_READ_PTR));
+  assert (read_index < aes_dev->cmd_slots);
 
-  /* Move completed tasks to completed tasks list.  */
+  /* Hand completed tasks over to their contexts.  */
   list_for_each_entry_safe (task, temp_task, &aes_dev->task_list_head, task_list)
   {
     /* Is this task completed?
@@ -423,85 +1440,467 @@ irq_handler (int irq, void *ptr)
        completed. Otherwise I keep iterating until I see uncompleted task.  */
     if (dev_running &&
         (task->cmd_index == read_index ||
-         (task->cmd_index + 1) % AESDRV_CMDBUFF_SLOTS == read_index))
+         (task->cmd_index + 1) % aes_dev->cmd_slots == read_index))
       break;
 
-    list_del (&task->task_list);
-    list_add_tail (&task->task_list, &aes_dev->completed_list_head);
     aes_dev->tasks_in_progress--;
-    /* Notify processes waiting for read about new data.  */
-    wake_up (&task->context->buffer.read_queue);
+    reaped++;
+    trace_aesdev_task_complete (aes_dev, task);
+
+    /* Crypto API tasks are completed below, without spinlock.  */
+    if (task->context == NULL)
+      {
+        list_move_tail (&task->task_list, &crypto_done);
+        continue;
+      }
+
+    if (task->ks_slot.k_ptr != NULL)
+      {
+        dma_pool_free (aes_dev->ks_pool, task->ks_slot.k_ptr,
+                       task->ks_slot.d_ptr);
+        task->ks_slot.k_ptr = NULL;
+      }
+    else
+      task->context->hw_tasks--;
+
+    /* Piece of split data, its context is guarded by other device's
+       lock.  */
+    if (task->context->aes_dev != aes_dev)
+      {
+        list_move_tail (&task->task_list, &foreign_done);
+        continue;
+      }
+
+    __hand_task_to_context (task);
   }
 
-  /* It was "my" interrupt, so at least one command has completed.
-     Therefore, notify processes waiting for a slot in command queue.  */
-  wake_up (&aes_dev->command_queue);
+  /* Notify processes waiting for a slot in command queue.  */
+  if (reaped > 0)
+    wake_up (&aes_dev->command_queue);
 
   spin_unlock_irqrestore (&aes_dev->lock, irq_flags);
   /*** END CRITICAL SECTION ***/
-  return IRQ_HANDLED;
+
+  list_for_each_entry_safe (task, temp_task, &crypto_done, task_list)
+  {
+    list_del (&task->task_list);
+    if (task->complete != NULL)
+      task->complete (task);
+    task_destroy (task);
+    kfree (task);
+  }
+
+  list_for_each_entry_safe (task, temp_task, &foreign_done, task_list)
+  {
+    aes128_dev *owner = task->context->aes_dev;
+
+    spin_lock_irqsave (&owner->lock, irq_flags);
+    __hand_task_to_context (task);
+    spin_unlock_irqrestore (&owner->lock, irq_flags);
+
+    /* Taken in __context_split_tasks.  */
+    aes_crypto_put_dev (aes_dev);
+  }
+
+  /* Some slots were freed, crypto API requests may be waiting for them.  */
+  if (reaped > 0)
+    aes_crypto_pump (aes_dev);
+
+  return reaped;
 }
-/*****************************************************************************/
 
-/*** File handlers ***********************************************************/
-static ssize_t
-file_read (struct file *f, char __user *buf, size_t len, loff_t *off)
+/* Only acknowledge the interrupt here, all the list work is done in
+   irq_thread, with interrupts enabled.  */
+static irqreturn_t
+irq_handler (int irq, void *ptr)
 {
-  aes128_context *context;
-  size_t to_copy, to_copy1, to_copy2;
-  ssize_t retval;
-  int _ret_mutex;
+  aes128_dev *aes_dev;
+  uint8_t intr;
 
-  DNOTIF_ENTER_FUN;
-  might_sleep ();
+  aes_dev = ptr;
 
-  _ret_mutex = mutex_lock_interruptible (&context_erase_mutex);
-  if (_ret_mutex != 0)
-    return _ret_mutex;
-  context = f->private_data;
+  intr = aes_reg_read (aes_dev, AESDEV_INTR) & 0xFF;
+  if (!intr)
+    return IRQ_NONE;
+  this_cpu_inc (aes_dev->stats->irqs);
 
-  if (context == NULL)
-    {
-      mutex_unlock (&context_erase_mutex);
-      return -EBADFD;
-    }
+  /* All current interrupts will be handled.  */
+  aes_reg_write (aes_dev, intr, AESDEV_INTR);
+  return IRQ_WAKE_THREAD;
+}
 
-  /* read_lock is to provide mutual exclusion inside file_read
-     common_lock is to protect context's io buffer */
-  _ret_mutex = mutex_lock_interruptible (&context->buffer.read_lock);
-  if (_ret_mutex != 0)
+static irqreturn_t
+irq_thread (int irq, void *ptr)
+{
+  aes128_dev *aes_dev;
+  aes128_task *last;
+  unsigned long irq_flags;
+
+  aes_dev = ptr;
+
+  /* It was "my" interrupt (or reap_timer), so at least one command has
+     completed.  */
+  aes_reap_tasks (aes_dev);
+
+  /* Check again later, unless the last active command will interrupt.  */
+  spin_lock_irqsave (&aes_dev->lock, irq_flags);
+  if (!list_empty (&aes_dev->task_list_head))
     {
-      mutex_unlock (&context_erase_mutex);
-      return _ret_mutex;
+      last = list_last_entry (&aes_dev->task_list_head, aes128_task, task_list);
+      if (!last->intr)
+        __arm_reap_timer (aes_dev);
     }
+  spin_unlock_irqrestore (&aes_dev->lock, irq_flags);
 
-  mutex_unlock (&context_erase_mutex);
+  return IRQ_HANDLED;
+}
 
-  _ret_mutex = mutex_lock_interruptible (&context->buffer.common_lock);
-  if (_ret_mutex != 0)
+/* Picks up commands that were submitted without an interrupt request (see
+   __intr_wanted).  Runs in hardirq context, so it only wakes irq_thread,
+   which does the reaping.  */
+static enum hrtimer_restart
+reap_timer_fn (struct hrtimer *timer)
+{
+  aes128_dev *aes_dev;
+
+  aes_dev = container_of (timer, aes128_dev, reap_timer);
+  irq_wake_thread (aes_dev->irq, aes_dev);
+
+  return HRTIMER_NORESTART;
+}
+/*****************************************************************************/
+
+/* Busy-poll the device for completions for at most poll_budget_us, instead
+   of waiting for the interrupt and a wakeup.  Polls only when the context
+   has data in flight.  Returns number of bytes ready to read.  Holds
+   read_lock all the time, so it is meant for short budgets only.  Call
+   with read_lock held.  */
+static size_t
+poll_completed_tasks (aes128_context *context)
+{
+  aes128_dev *aes_dev;
+  ktime_t end;
+  size_t ready;
+
+  aes_dev = context->aes_dev;
+  end = ktime_add_us (ktime_get (), READ_ONCE (aes_dev->poll_budget_us));
+
+  ready = 0;
+  while (acb_in_flight (&context->buffer) > 0)
     {
-      mutex_unlock (&context->buffer.read_lock);
-      return _ret_mutex;
+      aes_reap_tasks (aes_dev);
+      ready = acb_read_count (&context->buffer);
+      if (ready > 0 || need_resched () || signal_pending (current)
+          || !ktime_before (ktime_get (), end))
+        break;
+      cpu_relax ();
     }
 
-  if (context->mode == AESDEV_MODE_CLOSING)
+  return ready;
+}
+/*****************************************************************************/
+
+/*** Software fallback *******************************************************/
+/* Describe LEN bytes of kernel memory at BUF page by page.  Coherent DMA
+   memory is not always in the linear mapping (it is vmapped with an IOMMU
+   or on non-coherent architectures), so sg_init_one cannot be used.  */
+__must_check static int
+aes_sw_sg_table (struct sg_table *sgt, char *buf, size_t len)
+{
+  struct scatterlist *sg;
+  struct page *page;
+  size_t off, now;
+  int ret;
+
+  ret = sg_alloc_table (sgt, DIV_ROUND_UP (offset_in_page (buf) + len,
+                                           PAGE_SIZE), GFP_KERNEL);
+  if (IS_ERR_VALUE (ret))
+    return ret;
+
+  sg = sgt->sgl;
+  for (off = 0; off < len; off += now)
     {
-      retval = -EBADFD;
-      goto exit;
+      now = min_t (size_t, len - off, PAGE_SIZE - offset_in_page (buf + off));
+      if (is_vmalloc_addr (buf + off))
+        page = vmalloc_to_page (buf + off);
+      else
+        page = virt_to_page (buf + off);
+      sg_set_page (sg, page, now, offset_in_page (buf + off));
+      sg = sg_next (sg);
     }
+  return 0;
+}
 
-  if (context->mode == AESDEV_MODE_UNDEF)
+/* Encrypt io buffer task TASK, which found the command buffer of AES_DEV
+   full, on the CPU and hand it to its context as if the device did it.
+   Key and state are taken from, and the state is left in, the same place
+   the device would use.  Call with common_lock of the context held.  */
+__must_check static int
+aes_sw_run_task (aes128_dev *aes_dev, aes128_task *task)
+{
+  aes128_context *context;
+  aes128_combo_buffer *buffer;
+  struct skcipher_request *req;
+  struct sg_table src, dst;
+  DECLARE_CRYPTO_WAIT (wait);
+  unsigned long irq_flags;
+  char *ks, *out;
+  size_t len;
+  int ret;
+
+  might_sleep ();
+  context = task->context;
+  buffer = &context->buffer;
+  len = task->block_count * sizeof (aes128_block);
+
+  /* Transform is kept until mode of the context changes.  */
+  if (context->sw_tfm != NULL && context->sw_mode != task->mode)
     {
-      printk (KERN_WARNING "cannot read with no mode set\n");
-      retval = -EINVAL;
-      goto exit;
+      crypto_free_skcipher (context->sw_tfm);
+      context->sw_tfm = NULL;
     }
-
-  if (f->f_flags & O_NONBLOCK)
+  if (context->sw_tfm == NULL)
     {
-      /* This will accept completed tasks from device and return total number
-         of bytes ready to read.  */
-      if (__move_completed_tasks (context) == 0)
+      /* Any one but ours, asynchronous ones (SIMD) are waited for.  */
+      context->sw_tfm =
+              crypto_alloc_skcipher (aes_sw_alg_names[task->mode], 0,
+                                     CRYPTO_ALG_NEED_FALLBACK);
+      if (IS_ERR (context->sw_tfm))
+        {
+          printk (KERN_WARNING "cannot allocate %s for sw_fallback\n",
+                  aes_sw_alg_names[task->mode]);
+          ret = PTR_ERR (context->sw_tfm);
+          context->sw_tfm = NULL;
+          return ret;
+        }
+      context->sw_mode = task->mode;
+    }
+
+  ks = task->ks_slot.k_ptr != NULL ? task->ks_slot.k_ptr
+          : context->ks_buffer.k_ptr;
+  out = task->inout_buffer.k_ptr;
+  if (buffer->out_of_place)
+    out = buffer->out_data.k_ptr + (task->out_ptr - buffer->out_data.d_ptr);
+
+  ret = crypto_skcipher_setkey (context->sw_tfm, (u8 *) ks,
+                                AESDEV_AES_KEY_SIZE);
+  if (IS_ERR_VALUE (ret))
+    return ret;
+
+  req = skcipher_request_alloc (context->sw_tfm, GFP_KERNEL);
+  if (req == NULL)
+    return -ENOMEM;
+
+  ret = aes_sw_sg_table (&src, task->inout_buffer.k_ptr, len);
+  if (IS_ERR_VALUE (ret))
+    goto free_req;
+  if (out != task->inout_buffer.k_ptr)
+    {
+      ret = aes_sw_sg_table (&dst, out, len);
+      if (IS_ERR_VALUE (ret))
+        goto free_src;
+    }
+  else
+    dst = src;
+
+  /* State is updated in place, like the device saves it.  */
+  skcipher_request_set_callback (req, CRYPTO_TFM_REQ_MAY_SLEEP
+                                 | CRYPTO_TFM_REQ_MAY_BACKLOG,
+                                 crypto_req_done, &wait);
+  skcipher_request_set_crypt (req, src.sgl, dst.sgl, len,
+                              ks + sizeof (aes128_block));
+  if (task->mode == AESDEV_MODE_ECB_DECRYPT
+      || task->mode == AESDEV_MODE_CBC_DECRYPT
+      || task->mode == AESDEV_MODE_CFB_DECRYPT)
+    ret = crypto_wait_req (crypto_skcipher_decrypt (req), &wait);
+  else
+    ret = crypto_wait_req (crypto_skcipher_encrypt (req), &wait);
+
+  if (dst.sgl != src.sgl)
+    sg_free_table (&dst);
+free_src:
+  sg_free_table (&src);
+free_req:
+  skcipher_request_free (req);
+  if (IS_ERR_VALUE (ret))
+    return ret;
+
+  this_cpu_add (aes_dev->stats->sw_bytes, len);
+  trace_aesdev_task_complete (aes_dev, task);
+
+  if (task->ks_slot.k_ptr != NULL)
+    {
+      dma_pool_free (aes_dev->ks_pool, task->ks_slot.k_ptr,
+                     task->ks_slot.d_ptr);
+      task->ks_slot.k_ptr = NULL;
+    }
+
+  spin_lock_irqsave (&context->aes_dev->lock, irq_flags);
+  __hand_task_to_context (task);
+  spin_unlock_irqrestore (&context->aes_dev->lock, irq_flags);
+
+  return 0;
+}
+/*****************************************************************************/
+
+/*** Asynchronous jobs *******************************************************/
+static void
+async_req_free (aes128_async_req *req)
+{
+  aes128_dev *aes_dev = req->context->aes_dev;
+
+  dma_unmap_single (aes_dev->dev, req->bounce_dma, req->len,
+                    DMA_BIDIRECTIONAL);
+  kfree (req->bounce);
+  dma_pool_free (aes_dev->ks_pool, req->ks_buffer.k_ptr,
+                 req->ks_buffer.d_ptr);
+  kfree (req);
+}
+
+/* Completion callback of the task of an async job.  Called from
+   aes_reap_tasks, outside of spinlock.  */
+static void
+async_task_done (aes128_task *task)
+{
+  aes128_async_req *req = task->data;
+  aes128_context *context = req->context;
+  unsigned long irq_flags;
+
+  /*** CRITICAL SECTION ***/
+  /* Context cannot go away before async_inflight drops to 0, and it is
+     checked under the same lock.  */
+  spin_lock_irqsave (&context->aes_dev->lock, irq_flags);
+  list_add_tail (&req->list, &context->async_done);
+  context->async_inflight--;
+  if (context->async_eventfd != NULL)
+    eventfd_signal (context->async_eventfd, 1);
+  wake_up (&context->buffer.read_queue);
+  spin_unlock_irqrestore (&context->aes_dev->lock, irq_flags);
+  /*** END CRITICAL SECTION ***/
+}
+
+__must_check static size_t
+async_inflight (aes128_context *context)
+{
+  unsigned long irq_flags;
+  size_t ret;
+
+  spin_lock_irqsave (&context->aes_dev->lock, irq_flags);
+  ret = context->async_inflight;
+  spin_unlock_irqrestore (&context->aes_dev->lock, irq_flags);
+  return ret;
+}
+
+/* Anything to reap, or nothing to wait for.  */
+__must_check static bool
+async_ready (aes128_context *context)
+{
+  unsigned long irq_flags;
+  bool ret;
+
+  spin_lock_irqsave (&context->aes_dev->lock, irq_flags);
+  ret = !list_empty (&context->async_done) || context->async_inflight == 0;
+  spin_unlock_irqrestore (&context->aes_dev->lock, irq_flags);
+  return ret;
+}
+
+/* Replace the eventfd for completions.  Old one is released outside of
+   spinlock.  */
+static void
+async_set_eventfd (aes128_context *context, struct eventfd_ctx *eventfd)
+{
+  unsigned long irq_flags;
+  struct eventfd_ctx *old;
+
+  spin_lock_irqsave (&context->aes_dev->lock, irq_flags);
+  old = context->async_eventfd;
+  context->async_eventfd = eventfd;
+  spin_unlock_irqrestore (&context->aes_dev->lock, irq_flags);
+
+  if (old != NULL)
+    eventfd_ctx_put (old);
+}
+
+/* Wait for jobs in flight and drop results nobody reaped.  */
+static void
+async_release (aes128_context *context)
+{
+  aes128_async_req *req, *temp_req;
+
+  might_sleep ();
+
+  wait_event (context->buffer.read_queue, async_inflight (context) == 0);
+
+  /* No more completions, so no lock needed.  */
+  list_for_each_entry_safe (req, temp_req, &context->async_done, list)
+  {
+    list_del (&req->list);
+    async_req_free (req);
+  }
+  async_set_eventfd (context, NULL);
+}
+/*****************************************************************************/
+
+/*** File handlers ***********************************************************/
+/* Read and write take whole iov_iter at once, so readv/writev with many
+   small segments cost one locking round and one batch of commands.  */
+static ssize_t
+file_read_iter (struct kiocb *iocb, struct iov_iter *to)
+{
+  struct file *f = iocb->ki_filp;
+  aes128_context *context;
+  size_t len, to_copy, to_copy1, to_copy2;
+  u64 wait_start, waited;
+  ssize_t retval;
+  int _ret_mutex;
+
+  DNOTIF_ENTER_FUN;
+  might_sleep ();
+
+  len = iov_iter_count (to);
+  if (len == 0)
+    return 0;
+
+  _ret_mutex = mutex_lock_interruptible (&context_erase_mutex);
+  if (_ret_mutex != 0)
+    return _ret_mutex;
+  context = f->private_data;
+
+  if (context == NULL)
+    {
+      mutex_unlock (&context_erase_mutex);
+      return -EBADFD;
+    }
+
+  /* read_lock is to provide mutual exclusion inside file_read_iter.  The
+     reader is the only consumer of the io buffer, so it needs no other
+     lock: completions are accounted by the irq thread and space is given
+     back to the writer through published counters.  */
+  _ret_mutex = mutex_lock_interruptible (&context->buffer.read_lock);
+  if (_ret_mutex != 0)
+    {
+      mutex_unlock (&context_erase_mutex);
+      return _ret_mutex;
+    }
+
+  mutex_unlock (&context_erase_mutex);
+
+  if (READ_ONCE (context->mode) == AESDEV_MODE_CLOSING)
+    {
+      retval = -EBADFD;
+      goto exit;
+    }
+
+  if (READ_ONCE (context->mode) == AESDEV_MODE_UNDEF)
+    {
+      printk (KERN_WARNING "cannot read with no mode set\n");
+      retval = -EINVAL;
+      goto exit;
+    }
+
+  if (f->f_flags & O_NONBLOCK)
+    {
+      if (acb_read_count (&context->buffer) == 0)
         {
           KDEBUG ("no data, returning EAGAIN\n");
           retval = -EAGAIN;
@@ -510,36 +1909,35 @@ file_read (struct file *f, char __user *buf, size_t len, loff_t *off)
     }
   else
     {
-      /* This will accept completed tasks from device and return total number
-         of bytes ready to read.  */
-      while (__move_completed_tasks (context) == 0)
+      /* With polling enabled, try to catch own tasks before going to
+         sleep.  */
+      if (context->poll && acb_read_count (&context->buffer) == 0)
+        poll_completed_tasks (context);
+
+      while (acb_read_count (&context->buffer) == 0)
         {
           int _ret_queue;
 
           KDEBUG ("going to sleep :(\n");
+          wait_start = ktime_get_ns ();
 
-          /* Let other processes tamper with my buffer, but do not let any
-             other process enter read procedure (do not unlock read_lock).  */
-          mutex_unlock (&context->buffer.common_lock);
-
+          /* Do not let any other process enter read procedure (do not
+             unlock read_lock).  */
           _ret_queue =
                   wait_event_interruptible (context->buffer.read_queue,
-                                            mut_mode (context) == AESDEV_MODE_CLOSING
-                                            || move_completed_tasks (context) != 0);
+                                            READ_ONCE (context->mode) == AESDEV_MODE_CLOSING
+                                            || acb_read_count (&context->buffer) != 0);
           if (_ret_queue != 0)
             {
               mutex_unlock (&context->buffer.read_lock);
               return _ret_queue;
             }
 
-          _ret_mutex = mutex_lock_interruptible (&context->buffer.common_lock);
-          if (_ret_mutex != 0)
-            {
-              mutex_unlock (&context->buffer.read_lock);
-              return _ret_mutex;
-            }
+          waited = ktime_get_ns () - wait_start;
+          context->read_wait_ns += waited;
+          this_cpu_add (context->aes_dev->stats->read_wait_ns, waited);
 
-          if (context->mode == AESDEV_MODE_CLOSING)
+          if (READ_ONCE (context->mode) == AESDEV_MODE_CLOSING)
             {
               KDEBUG ("closing in read\n");
               retval = -EBADFD;
@@ -555,59 +1953,50 @@ file_read (struct file *f, char __user *buf, size_t len, loff_t *off)
   to_copy1 = min (to_copy, acb_read_count_to_end (&context->buffer));
   to_copy2 = to_copy - to_copy1;
 
-  if (copy_to_user (buf,
-                    context->buffer.data.k_ptr + context->buffer.read_tail,
-                    to_copy1))
+  if (copy_to_iter (acb_out_ptr (&context->buffer) + context->buffer.read_tail,
+                    to_copy1, to) != to_copy1)
     {
-      KDEBUG ("copy_to_user (1)\n");
+      KDEBUG ("copy_to_iter (1)\n");
       retval = -EFAULT;
       goto exit;
     }
-  if (to_copy2 && copy_to_user (buf + to_copy1,
-                                context->buffer.data.k_ptr,
-                                to_copy2))
+  if (to_copy2 && copy_to_iter (acb_out_ptr (&context->buffer),
+                                to_copy2, to) != to_copy2)
     {
-      KDEBUG ("copy_to_user (2)\n");
+      KDEBUG ("copy_to_iter (2)\n");
       retval = -EFAULT;
       goto exit;
     }
 
   /* Update buffer pointers and counters.  */
-  context->buffer.read_tail += to_copy;
-  context->buffer.read_tail %= AESDRV_IOBUFF_SIZE;
-  context->buffer.read_count -= to_copy;
-  assert (context->buffer.read_count >= 0);
-
-  /* Some space in io buffer was freed, perhaps someone is willing to
-     write.  */
-  wake_up (&context->buffer.write_queue);
+  acb_consume (context, to_copy);
 
   retval = to_copy;
 
 exit:
-  mutex_unlock (&context->buffer.common_lock);
   mutex_unlock (&context->buffer.read_lock);
   DNOTIF_LEAVE_FUN;
   return retval;
 }
 
 static ssize_t
-file_write (struct file *f, const char __user *buf, size_t len, loff_t *off)
+file_write_iter (struct kiocb *iocb, struct iov_iter *from)
 {
+  struct file *f = iocb->ki_filp;
   aes128_context *context;
-  void __iomem *bar0;
   ssize_t retval;
-  size_t to_take;
-  aes128_task *task;
-  aes128_dev *aes_dev;
-  aes128_command *cmd;
-  dma_ptr cmd_ptr;
-  unsigned long irq_flags;
+  size_t len, to_take, to_take1, to_take2;
+  size_t needed, reserved, piece_len;
+  u64 wait_start, waited, write_waited;
   int _ret_mutex;
 
   DNOTIF_ENTER_FUN;
   might_sleep ();
 
+  len = iov_iter_count (from);
+  if (len == 0)
+    return 0;
+
   _ret_mutex = mutex_lock_interruptible (&context_erase_mutex);
   if (_ret_mutex != 0)
     return _ret_mutex;
@@ -620,8 +2009,10 @@ file_write (struct file *f, const char __user *buf, size_t len, loff_t *off)
       return -EBADFD;
     }
 
-  /* write_lock is to provide mutual exclusion inside file_write
-     common_lock is to protect context's io buffer */
+  /* write_lock is to provide mutual exclusion inside file_write_iter.
+     common_lock is taken to reserve command slots and to make tasks, but
+     not while copying data in or sleeping for space, which is given back
+     by the reader through published counters.  */
   _ret_mutex = mutex_lock_interruptible (&context->buffer.write_lock);
   if (_ret_mutex != 0)
     {
@@ -631,184 +2022,215 @@ file_write (struct file *f, const char __user *buf, size_t len, loff_t *off)
 
   mutex_unlock (&context_erase_mutex);
 
-  _ret_mutex = mutex_lock_interruptible (&context->buffer.common_lock);
-  if (_ret_mutex != 0)
-    {
-      mutex_unlock (&context->buffer.write_lock);
-      return _ret_mutex;
-    }
-
-  aes_dev = context->aes_dev;
-  bar0 = aes_dev->bar0;
-
-  if (context->mode == AESDEV_MODE_CLOSING)
-    {
-      retval = -EBADFD;
-      goto exit;
-    }
-
-  if (context->mode == AESDEV_MODE_UNDEF)
+  write_waited = 0;
+  if (READ_ONCE (context->mode) == AESDEV_MODE_UNDEF)
     {
       printk (KERN_WARNING "cannot write with no mode set\n");
       retval = -EINVAL;
-      goto exit;
+      goto exit_write;
     }
 
+wait_space:
   while (acb_free (&context->buffer) == 0)
     {
-      if (f->f_flags & O_NONBLOCK)
+      if (READ_ONCE (context->mode) == AESDEV_MODE_CLOSING)
+        {
+          retval = -EBADFD;
+          goto exit_write;
+        }
+      else if (f->f_flags & O_NONBLOCK)
         {
           KDEBUG ("no space in buffer => EAGAIN\n");
           retval = -EAGAIN;
-          goto exit;
+          goto exit_write;
         }
       else
         {
           int _ret_queue;
 
           KDEBUG ("no space in buffer => sleep\n");
-
-          mutex_unlock (&context->buffer.common_lock);
+          wait_start = ktime_get_ns ();
 
           _ret_queue =
                   wait_event_interruptible (context->buffer.write_queue,
-                                            mut_mode (context) == AESDEV_MODE_CLOSING
-                                            || mut_acb_free (&context->buffer) > 0);
+                                            READ_ONCE (context->mode) == AESDEV_MODE_CLOSING
+                                            || acb_free (&context->buffer) > 0);
           if (_ret_queue != 0)
             {
               mutex_unlock (&context->buffer.write_lock);
               return _ret_queue;
             }
 
-          _ret_mutex = mutex_lock_interruptible (&context->buffer.common_lock);
-          if (_ret_mutex != 0)
-            {
-              mutex_unlock (&context->buffer.write_lock);
-              return _ret_mutex;
-            }
-
-          if (context->mode == AESDEV_MODE_CLOSING)
-            {
-              KDEBUG ("closing in write\n");
-              retval = -EBADFD;
-              goto exit;
-            }
+          waited = ktime_get_ns () - wait_start;
+          this_cpu_add (context->aes_dev->stats->write_wait_ns, waited);
+          write_waited += waited;
         }
     }
 
-  /* I will only write as much data as possible in continous memory.
-     Otherwise, I would have to create two separate tasks.
-     acb_free > 0 => acb_free_to_end > 0 */
-  to_take = min (acb_free_to_end (&context->buffer), len);
-  assert (to_take > 0);
-  if (copy_from_user (context->buffer.data.k_ptr + context->buffer.write_head,
-                      buf, to_take))
+  _ret_mutex = mutex_lock_interruptible (&context->buffer.common_lock);
+  if (_ret_mutex != 0)
     {
-      retval = -EFAULT;
-      goto exit;
+      mutex_unlock (&context->buffer.write_lock);
+      return _ret_mutex;
     }
 
-  /* Update buffer pointers and counters.  */
-  context->buffer.write_head += to_take;
-  context->buffer.write_head %= AESDRV_IOBUFF_SIZE;
-  context->buffer.write_count += to_take;
-  context->buffer.to_encrypt_count += to_take;
-
-  assert (acb_to_encrypt_count_to_end (&context->buffer) > 0);
+  context->write_wait_ns += write_waited;
+  write_waited = 0;
 
-  /* Check if there is enough data to create an encryption task.  */
-  if (acb_to_encrypt_count_to_end (&context->buffer) / sizeof (aes128_block) == 0)
+  if (context->mode == AESDEV_MODE_CLOSING)
     {
-      KDEBUG ("not enough data for new task (%zu), returning\n",
-              acb_to_encrypt_count_to_end (&context->buffer));
-      /* Still I have copied the data to my io buffer.  */
-      retval = to_take;
+      retval = -EBADFD;
       goto exit;
     }
 
-  task = kmalloc (sizeof (aes128_task), GFP_KERNEL);
-  if (!task)
+  /* The space seen above was checked without common_lock, and a concurrent
+     RING_SUBMIT may have used it up since.  Returning 0 here would look like
+     EOF, so go back and wait (or fail with EAGAIN) instead.  */
+  if (acb_free (&context->buffer) == 0)
     {
-      printk (KERN_WARNING "cannot allocate memory for encryption task\n");
-      retval = -ENOMEM;
-      goto exit;
+      mutex_unlock (&context->buffer.common_lock);
+      goto wait_space;
     }
 
-  task_init (task);
-  task->context = context;
-  task->block_count =
-          acb_to_encrypt_count_to_end (&context->buffer) / sizeof (aes128_block);
-  assert (task->block_count > 0);
-
-  task->inout_buffer.d_ptr =
-          context->buffer.data.d_ptr + context->buffer.to_encrypt_tail;
-  task->inout_buffer.k_ptr =
-          context->buffer.data.k_ptr + context->buffer.to_encrypt_tail;
-
-  /* Update the pointers and counters for next encryption task.  */
-  context->buffer.to_encrypt_count -= task->block_count * sizeof (aes128_block);
-  context->buffer.to_encrypt_tail += task->block_count * sizeof (aes128_block);
-  context->buffer.to_encrypt_tail %= AESDRV_IOBUFF_SIZE;
-  assert (context->buffer.to_encrypt_count >= 0);
-  assert (context->buffer.to_encrypt_count < sizeof (aes128_block));
-
-  /*** CRITICAL SECTION ***/
-  spin_lock_irqsave (&context->aes_dev->lock, irq_flags);
-  /* Wait for space in command buffer.
-     This wait will not take too long, so skip NONBLOCK support here.  */
-  while (__free_task_slots (context->aes_dev) < 1)
+  /* Take as much data as fits in the buffer.  Free space starts at
+     write_head and might wrap around the end of buffer, so copy it in (at
+     most) two parts, the same way file_read_iter does it.  */
+  to_take = min (acb_free (&context->buffer), len);
+
+  /* Reserve command slots before touching the buffer, so that full command
+     buffer can be reported to non-blocking writers.  */
+  piece_len = context_piece_len (context);
+  needed = acb_tasks_needed (&context->buffer, to_take, piece_len);
+  reserved = 0;
+  if (needed > 0)
     {
-      spin_unlock_irqrestore (&context->aes_dev->lock, irq_flags);
+      retval = aes_reserve_slots (context->aes_dev, context, needed,
+                                  f->f_flags & O_NONBLOCK);
+      if (IS_ERR_VALUE (retval))
+        goto exit;
+      reserved = retval;
+
+      /* Only one slot, so do not wrap around the end of buffer (then single
+         task is enough).  */
+      if (reserved < needed)
+        to_take = min (to_take,
+                       context->buffer.size - context->buffer.write_head);
+
+      /* Split data can still need more tasks than reserved, and the rest
+         would wait for the device in aes_submit_tasks.  Non-blocking
+         writers take only what the reserved slots cover.  */
+      if ((f->f_flags & O_NONBLOCK) && reserved > 0 && piece_len > 0)
+        while (to_take > 0
+               && acb_tasks_needed (&context->buffer, to_take,
+                                    piece_len) > reserved)
+          to_take = to_take > piece_len ? to_take - piece_len : 0;
+      if (to_take == 0)
+        {
+          aes_release_slots (context->aes_dev, reserved);
+          retval = -EAGAIN;
+          goto exit;
+        }
+    }
 
-      wait_event (context->aes_dev->command_queue,
-                  free_task_slots (context->aes_dev) >= 1);
+  /* Copy without common_lock, the free space is the writer's alone.
+     write_pending keeps the buffer from being resized meanwhile.  */
+  context->buffer.write_pending = true;
+  mutex_unlock (&context->buffer.common_lock);
 
-      assert (context->mode != AESDEV_MODE_CLOSING);
+  to_take1 = min (to_take, context->buffer.size - context->buffer.write_head);
+  to_take2 = to_take - to_take1;
+  assert (to_take > 0);
+  retval = 0;
+  if (copy_from_iter (context->buffer.data.k_ptr + context->buffer.write_head,
+                      to_take1, from) != to_take1)
+    retval = -EFAULT;
+  else if (to_take2 && copy_from_iter (context->buffer.data.k_ptr,
+                                       to_take2, from) != to_take2)
+    retval = -EFAULT;
 
-      spin_lock_irqsave (&context->aes_dev->lock, irq_flags);
+  mutex_lock (&context->buffer.common_lock);
+  context->buffer.write_pending = false;
+  if (IS_ERR_VALUE (retval))
+    {
+      aes_release_slots (context->aes_dev, reserved);
+      goto exit;
     }
 
-  //KDEBUG ("have slots: %d\n", __free_task_slots (context->aes_dev));
+  retval = __acb_commit (context, to_take, reserved);
+  if (IS_ERR_VALUE (retval))
+    goto exit;
+
+  retval = to_take;
+exit:
+  mutex_unlock (&context->buffer.common_lock);
+exit_write:
+  mutex_unlock (&context->buffer.write_lock);
+  DNOTIF_LEAVE_FUN;
+  return retval;
+}
+
+static unsigned int
+file_poll (struct file *f, poll_table *wait)
+{
+  aes128_context *context;
+  unsigned long irq_flags;
+  unsigned int mask;
+
+  DNOTIF_ENTER_FUN;
+  might_sleep ();
 
-  cmd_ptr.d_ptr = ioread32 (bar0 + AESDEV_CMD_WRITE_PTR);
-  cmd_ptr.k_ptr =
-          aes_dev->cmd_buffer.k_ptr + (cmd_ptr.d_ptr - aes_dev->cmd_buffer.d_ptr);
+  mutex_lock (&context_erase_mutex);
+  context = f->private_data;
 
-  task->cmd_index = AESDEV_CMD_INDEXOF (aes_dev->cmd_buffer.d_ptr, cmd_ptr.d_ptr);
+  if (context == NULL)
+    {
+      mutex_unlock (&context_erase_mutex);
+      return POLLERR;
+    }
 
-  cmd = (aes128_command *) cmd_ptr.k_ptr;
+  /* Register on all queues before checking the buffer, so that no wake up
+     between the check and the return from this function can be missed.  */
+  poll_wait (f, &context->buffer.read_queue, wait);
+  poll_wait (f, &context->buffer.write_queue, wait);
+  poll_wait (f, &context->aes_dev->command_queue, wait);
 
-  /* Use same buffer for both input and output.  */
-  cmd->in_ptr = task->inout_buffer.d_ptr;
-  cmd->out_ptr = task->inout_buffer.d_ptr;
-  cmd->ks_ptr = context->ks_buffer.d_ptr;
-  cmd->xfer_val = AESDEV_TASK (task->block_count,
-                               0x01, /* Not used, just cannot be 0. */
-                               HAS_STATE (context->mode),
-                               context->mode);
+  mutex_lock (&context->buffer.common_lock);
+  mutex_unlock (&context_erase_mutex);
 
-  /* Save task as active on device's list.  */
-  list_add_tail (&task->task_list, &aes_dev->task_list_head);
+  if (context->mode == AESDEV_MODE_CLOSING)
+    {
+      mask = POLLERR | POLLHUP;
+      goto exit;
+    }
 
-  /* Increment command write pointer.  */
-  cmd_ptr.d_ptr += sizeof (aes128_command);
-  if (cmd_ptr.d_ptr == aes_dev->cmd_buffer.d_ptr + AESDRV_CMDBUFF_SIZE)
-    cmd_ptr.d_ptr = aes_dev->cmd_buffer.d_ptr;
+  /* Not an error, read and write become possible once a mode is set (the
+     SET_* ioctl wakes pollers up).  */
+  if (context->mode == AESDEV_MODE_UNDEF)
+    {
+      mask = 0;
+      goto exit;
+    }
 
-  aes_dev->tasks_in_progress++;
+  mask = 0;
 
-  /* Commit new command.  */
-  iowrite32 ((uint32_t) cmd_ptr.d_ptr, context->aes_dev->bar0 + AESDEV_CMD_WRITE_PTR);
+  if (acb_read_count (&context->buffer) > 0)
+    mask |= POLLIN | POLLRDNORM;
 
-  spin_unlock_irqrestore (&context->aes_dev->lock, irq_flags);
-  /*** END CRITICAL SECTION ***/
+  /* Non-blocking write also needs a command slot (unless sw_fallback takes
+     the tasks), otherwise it would only get EAGAIN.  */
+  if (acb_free (&context->buffer) > 0)
+    {
+      spin_lock_irqsave (&context->aes_dev->lock, irq_flags);
+      if (__free_task_slots (context->aes_dev) >= 1
+          || __aes_sw_allowed (context, context->split))
+        mask |= POLLOUT | POLLWRNORM;
+      spin_unlock_irqrestore (&context->aes_dev->lock, irq_flags);
+    }
 
-  retval = to_take;
 exit:
   mutex_unlock (&context->buffer.common_lock);
-  mutex_unlock (&context->buffer.write_lock);
   DNOTIF_LEAVE_FUN;
-  return retval;
+  return mask;
 }
 
 static int
@@ -825,7 +2247,11 @@ file_open (struct inode *i, struct file * f)
   if (retval != 0)
     return retval;
 
-  aes_dev = aes_devs[iminor (i)];
+  /* Contexts opened through /dev/aes are spread over all devices.  */
+  if (iminor (i) == AESDRV_ANY_DEV_MINOR)
+    aes_dev = __aes_pick_dev ();
+  else
+    aes_dev = aes_devs[iminor (i)];
   if (aes_dev == NULL)
     {
       retval = -EBADFD;
@@ -844,7 +2270,7 @@ file_open (struct inode *i, struct file * f)
   if (list_empty (&aes_dev->file_list_head))
     AESDEV_START (aes_dev);
 
-  retval = context_init (context, aes_devs[iminor (i)]);
+  retval = context_init (context, aes_dev);
   if (IS_ERR_VALUE (retval))
     {
       kfree (context);
@@ -854,6 +2280,8 @@ file_open (struct inode *i, struct file * f)
 
   f->private_data = context;
   context->lf.f = f;
+  context->pid = current->tgid;
+  get_task_comm (context->comm, current);
 
   KDEBUG ("assigned opened file to device %p at context %p\n",
           context->aes_dev, context);
@@ -910,6 +2338,7 @@ file_release (struct inode *i, struct file * f)
       wait_event (context->buffer.read_queue, context_busy (context) == 0);
       mutex_lock (&context->buffer.common_lock);
     }
+  async_release (context);
 
   /* Now it is safe to actually destroy the context.  */
   mutex_unlock (&context->buffer.common_lock);
@@ -920,8 +2349,10 @@ file_release (struct inode *i, struct file * f)
   context_destroy (context);
   kfree (context);
 
+  /* Devices serving crypto API keep running.  */
   mutex_lock (&dev_remove_mutex);
-  if (list_empty (&aes_dev->file_list_head))
+  if (list_empty (&aes_dev->file_list_head)
+      && list_empty (&aes_dev->crypto_list))
     AESDEV_STOP (aes_dev);
   mutex_unlock (&dev_remove_mutex);
 
@@ -929,197 +2360,1997 @@ file_release (struct inode *i, struct file * f)
   return 0;
 }
 
-static long
-file_ioctl (struct file *f, unsigned int cmd, unsigned long arg)
+/* Change size of io buffer.  Allowed only when the buffer is empty and not
+   mapped.  Actual (rounded) size is written back.  Call with common_lock
+   held.  */
+__must_check static long
+ioctl_set_buffer_size (aes128_context *context, uint32_t __user *arg)
 {
-  aes128_context *context;
-  long retval;
-  int _ret_mutex;
-
-  DNOTIF_ENTER_FUN;
-  might_sleep ();
-
-  _ret_mutex = mutex_lock_interruptible (&context_erase_mutex);
-  if (_ret_mutex != 0)
-    return _ret_mutex;
+  uint32_t size;
+  int ret;
 
-  context = f->private_data;
+  if (get_user (size, arg))
+    return -EFAULT;
 
-  if (context == NULL)
+  if (acb_write_count (&context->buffer) > 0
+      || acb_read_count (&context->buffer) > 0
+      || context->buffer.write_pending)
     {
-      mutex_unlock (&context_erase_mutex);
-      return -EBADFD;
+      KDEBUG ("cannot resize buffer with data\n");
+      return -EBUSY;
+    }
+  if (atomic_read (&context->buffer.mmap_count) > 0)
+    {
+      KDEBUG ("cannot resize mapped buffer\n");
+      return -EBUSY;
     }
 
-  KDEBUG ("context=%p mode=0x%x\n", context, context->mode);
+  ret = acb_resize (&context->buffer, context->aes_dev, size);
+  if (IS_ERR_VALUE (ret))
+    return ret;
 
-  _ret_mutex = mutex_lock_interruptible (&context->buffer.common_lock);
-  if (_ret_mutex != 0)
+  if (put_user ((uint32_t) context->buffer.size, arg))
+    return -EFAULT;
+  return 0;
+}
+
+/* Switch between in-place and out-of-place io buffer.  Same restrictions as
+   for changing its size.  Call with common_lock held.  */
+__must_check static long
+ioctl_set_out_of_place (aes128_context *context, uint32_t __user *arg)
+{
+  uint32_t enable;
+
+  if (get_user (enable, arg))
+    return -EFAULT;
+
+  if (acb_write_count (&context->buffer) > 0
+      || acb_read_count (&context->buffer) > 0
+      || context->buffer.write_pending)
     {
-      mutex_unlock (&context_erase_mutex);
-      return _ret_mutex;
+      KDEBUG ("cannot change buffer mode with data\n");
+      return -EBUSY;
+    }
+  if (atomic_read (&context->buffer.mmap_count) > 0)
+    {
+      KDEBUG ("cannot change mode of mapped buffer\n");
+      return -EBUSY;
     }
 
-  mutex_unlock (&context_erase_mutex);
+  return acb_set_out_of_place (&context->buffer, context->aes_dev,
+                               enable != 0);
+}
 
-  if (context->mode == AESDEV_MODE_CLOSING)
+/* Doorbell for the mmaped buffer.  RING_SUBMIT tells that user has put LEN
+   bytes of data at write_head, RING_CONSUME that user has finished with LEN
+   bytes of encrypted data at read_tail.  Both refresh the shared state.
+   They are the producer and the consumer of the io buffer like write and
+   read, so they are refused with EBUSY while one of those is in progress.
+   Call with common_lock held.  */
+__must_check static long
+ioctl_ring (aes128_context *context, unsigned int cmd, uint32_t __user *arg,
+            bool nonblock)
+{
+  uint32_t len;
+  size_t needed;
+  int reserved;
+
+  if (context->mode == AESDEV_MODE_UNDEF)
     {
-      retval = -EBADFD;
-      goto exit;
+      KDEBUG ("ring ioctl with no mode set\n");
+      return -EINVAL;
     }
 
-  if (cmd == AESDEV_IOCTL_SET_ECB_ENCRYPT)
-    context->mode = AESDEV_MODE_ECB_ENCRYPT;
-  else if (cmd == AESDEV_IOCTL_SET_ECB_DECRYPT)
-    context->mode = AESDEV_MODE_ECB_DECRYPT;
-  else if (cmd == AESDEV_IOCTL_SET_CBC_ENCRYPT)
-    context->mode = AESDEV_MODE_CBC_ENCRYPT;
-  else if (cmd == AESDEV_IOCTL_SET_CBC_DECRYPT)
-    context->mode = AESDEV_MODE_CBC_DECRYPT;
-  else if (cmd == AESDEV_IOCTL_SET_CFB_ENCRYPT)
-    context->mode = AESDEV_MODE_CFB_ENCRYPT;
-  else if (cmd == AESDEV_IOCTL_SET_CFB_DECRYPT)
-    context->mode = AESDEV_MODE_CFB_DECRYPT;
-  else if (cmd == AESDEV_IOCTL_SET_OFB)
-    context->mode = AESDEV_MODE_OFB;
-  else if (cmd == AESDEV_IOCTL_SET_CTR)
-    context->mode = AESDEV_MODE_CTR;
-  else if (cmd == AESDEV_IOCTL_GET_STATE)
+  if (get_user (len, arg))
+    return -EFAULT;
+
+  acb_publish (&context->buffer);
+
+  if (cmd == AESDEV_IOCTL_RING_SUBMIT)
     {
-      if (context->mode == AESDEV_MODE_ECB_DECRYPT ||
-          context->mode == AESDEV_MODE_ECB_ENCRYPT ||
-          context->mode == AESDEV_MODE_UNDEF)
+      if (context->buffer.write_pending)
+        return -EBUSY;
+      if (len > acb_free (&context->buffer))
+        return -EINVAL;
+      if (len == 0)
+        return 0;
+
+      needed = acb_tasks_needed (&context->buffer, len,
+                                 context_piece_len (context));
+      reserved = 0;
+      if (needed > 0)
         {
-          /* Other commands will also yield undefined behaviour when
-             data is being processed. But no EINVAL in other cases.  */
-          KDEBUG ("illegal GET_STATE in current mode\n");
-          retval = -EINVAL;
-          goto exit;
+          reserved = aes_reserve_slots (context->aes_dev, context, needed,
+                                        nonblock);
+          if (IS_ERR_VALUE (reserved))
+            return reserved;
+          /* Nothing reserved means the tasks go to sw_fallback.  */
+          if (nonblock && reserved > 0 && reserved < needed)
+            {
+              aes_release_slots (context->aes_dev, reserved);
+              return -EAGAIN;
+            }
+        }
+      return __acb_commit (context, len, reserved);
+    }
+  else
+    {
+      /* Reverse lock order, so only try.  */
+      if (!mutex_trylock (&context->buffer.read_lock))
+        return -EBUSY;
+      if (len > acb_read_count (&context->buffer))
+        {
+          mutex_unlock (&context->buffer.read_lock);
+          return -EINVAL;
         }
+      if (len > 0)
+        __acb_consume (context, len);
+      mutex_unlock (&context->buffer.read_lock);
+      return 0;
+    }
+}
+
+/* Pin LEN bytes of user memory at ADDR and map them for DMA.  */
+__must_check static int
+user_map (aes128_dev *aes_dev, aes128_user_map *map, unsigned long addr,
+          size_t len, enum dma_data_direction dir)
+{
+  int pinned, ret;
+
+  might_sleep ();
+
+  map->dir = dir;
+  map->page_count = DIV_ROUND_UP (offset_in_page (addr) + len, PAGE_SIZE);
+  map->pages = kmalloc_array (map->page_count, sizeof (struct page *),
+                              GFP_KERNEL);
+  if (map->pages == NULL)
+    return -ENOMEM;
+
+  pinned = get_user_pages_fast (addr & PAGE_MASK, map->page_count,
+                                dir != DMA_TO_DEVICE ? FOLL_WRITE : 0,
+                                map->pages);
+  if (pinned < map->page_count)
+    {
+      ret = IS_ERR_VALUE (pinned) ? pinned : -EFAULT;
+      goto unpin;
+    }
+
+  /* Physically contiguous pages end up in a single segment.  */
+  ret = sg_alloc_table_from_pages (&map->sgt, map->pages, map->page_count,
+                                   offset_in_page (addr), len, GFP_KERNEL);
+  if (IS_ERR_VALUE (ret))
+    goto unpin;
+
+  if (dma_map_sg (aes_dev->dev, map->sgt.sgl, map->sgt.orig_nents,
+                  dir) == 0)
+    {
+      ret = -ENOMEM;
+      sg_free_table (&map->sgt);
+      goto unpin;
+    }
+  return 0;
+
+unpin:
+  while (pinned-- > 0)
+    put_page (map->pages[pinned]);
+  kfree (map->pages);
+  return ret;
+}
+
+static void
+user_unmap (aes128_dev *aes_dev, aes128_user_map *map)
+{
+  int i;
+
+  dma_unmap_sg (aes_dev->dev, map->sgt.sgl, map->sgt.orig_nents,
+                map->dir);
+  sg_free_table (&map->sgt);
+  for (i = 0; i < map->page_count; ++i)
+    {
+      if (map->dir != DMA_TO_DEVICE)
+        set_page_dirty_lock (map->pages[i]);
+      put_page (map->pages[i]);
+    }
+  kfree (map->pages);
+}
+
+/* Let the device read and write user memory directly.  */
+__must_check static int
+crypt_direct (aes128_context *context, unsigned long in, unsigned long out,
+              size_t len)
+{
+  aes128_dev *aes_dev;
+  aes128_user_map in_map, out_map;
+  struct list_head tasks;
+  int ret;
+
+  aes_dev = context->aes_dev;
+  INIT_LIST_HEAD (&tasks);
 
-      if (context->buffer.read_count > 0 || context->buffer.write_count > 0)
+  if (in == out)
+    ret = user_map (aes_dev, &in_map, in, len, DMA_BIDIRECTIONAL);
+  else
+    ret = user_map (aes_dev, &in_map, in, len, DMA_TO_DEVICE);
+  if (IS_ERR_VALUE (ret))
+    return ret;
+  if (in != out)
+    {
+      ret = user_map (aes_dev, &out_map, out, len, DMA_FROM_DEVICE);
+      if (IS_ERR_VALUE (ret))
         {
-          KDEBUG ("illegal GET_STATE with data in buffer\n");
-          retval = -EINVAL;
-          goto exit;
+          user_unmap (aes_dev, &in_map);
+          return ret;
         }
+    }
 
-      if (copy_to_user ((void *) arg,
-                        context->ks_buffer.k_ptr + sizeof (aes128_block),
-                        sizeof (aes128_block)))
+  ret = aes_make_sg_tasks (&tasks, in_map.sgt.sgl,
+                           in == out ? in_map.sgt.sgl : out_map.sgt.sgl, len,
+                           context->ks_buffer.d_ptr, context->mode,
+                           GFP_KERNEL);
+  if (IS_ERR_VALUE (ret))
+    aes_free_tasks (&tasks);
+  else
+    {
+      aes_run_tasks (aes_dev, &tasks);
+      ret = 0;
+    }
+
+  if (in != out)
+    user_unmap (aes_dev, &out_map);
+  user_unmap (aes_dev, &in_map);
+  return ret;
+}
+
+/* Copy user data through a kernel buffer, for requests too small or not
+   aligned enough for crypt_direct.  The buffer holds AESDRV_BOUNCE_LEN at
+   most, longer requests go through it piece by piece; every piece runs to
+   the end before the next one, so the state carries over.  */
+__must_check static int
+crypt_bounce (aes128_context *context, unsigned long in, unsigned long out,
+              size_t len)
+{
+  struct device *dev;
+  struct list_head tasks;
+  char *bounce;
+  dma_addr_t bounce_dma;
+  size_t done, piece;
+  int ret;
+
+  dev = context->aes_dev->dev;
+  INIT_LIST_HEAD (&tasks);
+
+  bounce = kmalloc (min_t (size_t, len, AESDRV_BOUNCE_LEN), GFP_KERNEL);
+  if (bounce == NULL)
+    return -ENOMEM;
+
+  ret = 0;
+  for (done = 0; done < len; done += piece)
+    {
+      piece = min_t (size_t, len - done, AESDRV_BOUNCE_LEN);
+
+      if (copy_from_user (bounce, (void __user *) (in + done), piece))
         {
-          KDEBUG ("copy_to_user\n");
-          retval = -EFAULT;
-          goto exit;
+          ret = -EFAULT;
+          break;
         }
 
-      retval = 0;
-      goto exit;
+      bounce_dma = dma_map_single (dev, bounce, piece, DMA_BIDIRECTIONAL);
+      if (dma_mapping_error (dev, bounce_dma))
+        {
+          ret = -ENOMEM;
+          break;
+        }
+
+      ret = aes_make_task (&tasks, bounce_dma, bounce_dma, piece,
+                           context->ks_buffer.d_ptr, context->mode,
+                           GFP_KERNEL);
+      if (ret == 0)
+        aes_run_tasks (context->aes_dev, &tasks);
+      dma_unmap_single (dev, bounce_dma, piece, DMA_BIDIRECTIONAL);
+      if (ret != 0)
+        break;
+
+      if (copy_to_user ((void __user *) (out + done), bounce, piece))
+        {
+          ret = -EFAULT;
+          break;
+        }
     }
-  else
+
+  kfree (bounce);
+  return ret;
+}
+
+/* Encrypt user memory without the io buffer, see AESDEV_IOCTL_CRYPT.
+   Commands use key and state of the context and are queued after its
+   buffered data, so the stream stays consistent.  Call with common_lock
+   held, the context stays locked until all data is done.  */
+__must_check static long
+ioctl_crypt (aes128_context *context,
+             struct aesdev_ioctl_crypt __user *arg)
+{
+  struct aesdev_ioctl_crypt req;
+  unsigned long in, out;
+  size_t done, chunk;
+  int ret;
+
+  if (copy_from_user (&req, arg, sizeof (req)))
+    return -EFAULT;
+
+  if (context->mode == AESDEV_MODE_UNDEF || req.flags != 0
+      || req.len % sizeof (aes128_block) != 0
+      || acb_to_encrypt_count (&context->buffer) != 0)
+    return -EINVAL;
+
+  for (done = 0; done < req.len; done += chunk)
     {
-      /* Unknow command.  */
-      printk (KERN_WARNING "unknown command passed to ioctl\n");
-      retval = -EINVAL;
-      goto exit;
+      chunk = min_t (size_t, req.len - done, AESDRV_DIRECT_CHUNK);
+      in = req.in + done;
+      out = req.out + done;
+
+      /* Every piece contiguous in both buffers must be whole blocks.  */
+      if (chunk >= AESDRV_DIRECT_MIN_LEN
+          && in % sizeof (aes128_block) == 0
+          && out % sizeof (aes128_block) == 0)
+        ret = crypt_direct (context, in, out, chunk);
+      else
+        ret = crypt_bounce (context, in, out, chunk);
+      if (IS_ERR_VALUE (ret))
+        return ret;
     }
 
-  /* Read encryption key.  */
-  if (copy_from_user (context->ks_buffer.k_ptr, (void *) arg, sizeof (aes128_block)))
+  return 0;
+}
+
+/* Device mode for AESDEV_BATCH_* MODE of a batch or async job, or
+   -EINVAL.  */
+__must_check static int
+batch_mode (uint32_t mode)
+{
+  static const int modes[] = {
+    [AESDEV_BATCH_ECB_ENCRYPT] = AESDEV_MODE_ECB_ENCRYPT,
+    [AESDEV_BATCH_ECB_DECRYPT] = AESDEV_MODE_ECB_DECRYPT,
+    [AESDEV_BATCH_CBC_ENCRYPT] = AESDEV_MODE_CBC_ENCRYPT,
+    [AESDEV_BATCH_CBC_DECRYPT] = AESDEV_MODE_CBC_DECRYPT,
+    [AESDEV_BATCH_CFB_ENCRYPT] = AESDEV_MODE_CFB_ENCRYPT,
+    [AESDEV_BATCH_CFB_DECRYPT] = AESDEV_MODE_CFB_DECRYPT,
+    [AESDEV_BATCH_OFB] = AESDEV_MODE_OFB,
+    [AESDEV_BATCH_CTR] = AESDEV_MODE_CTR,
+  };
+
+  if (mode >= ARRAY_SIZE (modes))
+    return -EINVAL;
+  return modes[mode];
+}
+
+/* Encrypt independent jobs, see AESDEV_IOCTL_BATCH.  Every job gets its own
+   key and state slot, data of all jobs is copied through one kernel buffer,
+   and all commands are submitted at once.  Mode and state of the context
+   are not used.  */
+__must_check static long
+ioctl_batch (aes128_context *context, struct aesdev_ioctl_batch __user *arg)
+{
+  struct aesdev_ioctl_batch req;
+  struct aesdev_batch_job *jobs;
+  struct aesdev_batch_job __user *user_jobs;
+  struct device *dev;
+  struct list_head tasks;
+  dma_ptr ks;
+  dma_addr_t tmp_dma_addr, bounce_dma;
+  char *bounce;
+  size_t total, off, ks_size;
+  uint32_t i;
+  int ret;
+
+  dev = context->aes_dev->dev;
+  INIT_LIST_HEAD (&tasks);
+
+  if (copy_from_user (&req, arg, sizeof (req)))
+    return -EFAULT;
+  if (req.flags != 0 || req.count > AESDRV_BATCH_MAX_JOBS)
+    return -EINVAL;
+  if (req.count == 0)
+    return 0;
+
+  user_jobs = (struct aesdev_batch_job __user *) (unsigned long) req.jobs;
+  jobs = kmalloc_array (req.count, sizeof (*jobs), GFP_KERNEL);
+  if (jobs == NULL)
+    return -ENOMEM;
+  if (copy_from_user (jobs, user_jobs, req.count * sizeof (*jobs)))
     {
-      KDEBUG ("copy_from_user\n");
-      retval = -EFAULT;
-      goto exit;
+      ret = -EFAULT;
+      goto free_jobs;
     }
 
-  /* Read initialization vector.  */
-  if (cmd != AESDEV_IOCTL_SET_ECB_ENCRYPT && cmd != AESDEV_IOCTL_SET_ECB_DECRYPT)
-    if (copy_from_user (context->ks_buffer.k_ptr + sizeof (aes128_block),
-                        ((char *) arg) + sizeof (aes128_block),
-                        sizeof (aes128_block)))
-      {
-        KDEBUG ("copy_from_user\n");
-        retval = -EFAULT;
-        goto exit;
-      }
+  /* From here on jobs[i].mode is the device mode.  */
+  total = 0;
+  for (i = 0; i < req.count; ++i)
+    {
+      ret = batch_mode (jobs[i].mode);
+      if (IS_ERR_VALUE (ret)
+          || jobs[i].len % sizeof (aes128_block) != 0
+          || jobs[i].len > AESDRV_BATCH_MAX_LEN - total)
+        {
+          ret = -EINVAL;
+          goto free_jobs;
+        }
+      jobs[i].mode = ret;
+      total += jobs[i].len;
+    }
+  if (total == 0)
+    {
+      ret = 0;
+      goto free_jobs;
+    }
 
-  retval = 0;
-exit:
-  mutex_unlock (&context->buffer.common_lock);
-  DNOTIF_LEAVE_FUN;
-  return retval;
+  /* Key and state of job I at 2 * I blocks.  */
+  ks_size = req.count * 2 * sizeof (aes128_block);
+  ks.k_ptr = dma_alloc_coherent (dev, ks_size, &tmp_dma_addr, GFP_KERNEL);
+  if (ks.k_ptr == NULL)
+    {
+      ret = -ENOMEM;
+      goto free_jobs;
+    }
+  ks.d_ptr = tmp_dma_addr;
+
+  bounce = kmalloc (total, GFP_KERNEL);
+  if (bounce == NULL)
+    {
+      ret = -ENOMEM;
+      goto free_ks;
+    }
+
+  for (i = 0, off = 0; i < req.count; off += jobs[i].len, ++i)
+    {
+      memcpy (ks.k_ptr + 2 * i * sizeof (aes128_block), jobs[i].key,
+              AESDEV_AES_KEY_SIZE);
+      memcpy (ks.k_ptr + (2 * i + 1) * sizeof (aes128_block), jobs[i].iv,
+              AESDEV_AES_BLOCK_SIZE);
+      if (copy_from_user (bounce + off, (void __user *) (unsigned long) jobs[i].in,
+                          jobs[i].len))
+        {
+          ret = -EFAULT;
+          goto free_bounce;
+        }
+    }
+
+  bounce_dma = dma_map_single (dev, bounce, total, DMA_BIDIRECTIONAL);
+  if (dma_mapping_error (dev, bounce_dma))
+    {
+      ret = -ENOMEM;
+      goto free_bounce;
+    }
+
+  ret = 0;
+  for (i = 0, off = 0; i < req.count && ret == 0; off += jobs[i].len, ++i)
+    if (jobs[i].len > 0)
+      ret = aes_make_task (&tasks, bounce_dma + off, bounce_dma + off,
+                           jobs[i].len,
+                           ks.d_ptr + 2 * i * sizeof (aes128_block),
+                           jobs[i].mode, GFP_KERNEL);
+  if (ret == 0)
+    aes_run_tasks (context->aes_dev, &tasks);
+  else
+    aes_free_tasks (&tasks);
+  dma_unmap_single (dev, bounce_dma, total, DMA_BIDIRECTIONAL);
+  if (IS_ERR_VALUE (ret))
+    goto free_bounce;
+
+  for (i = 0, off = 0; i < req.count; off += jobs[i].len, ++i)
+    {
+      if (copy_to_user ((void __user *) (unsigned long) jobs[i].out,
+                        bounce + off, jobs[i].len))
+        {
+          ret = -EFAULT;
+          break;
+        }
+      if (HAS_STATE (jobs[i].mode)
+          && copy_to_user (user_jobs[i].iv,
+                           ks.k_ptr + (2 * i + 1) * sizeof (aes128_block),
+                           AESDEV_AES_BLOCK_SIZE))
+        {
+          ret = -EFAULT;
+          break;
+        }
+    }
+
+free_bounce:
+  kfree (bounce);
+free_ks:
+  dma_free_coherent (dev, ks_size, ks.k_ptr, ks.d_ptr);
+free_jobs:
+  kfree (jobs);
+  return ret;
 }
-/*****************************************************************************/
 
-/*** Device procedures *******************************************************/
+/* Prepare one async job (copy its data in and set up key and state) and
+   add its task to the list.  */
 __must_check static int
-cmd_buffer_init (aes128_dev *aes_dev)
+async_prepare (aes128_context *context, const struct aesdev_async_job *job,
+               struct list_head *tasks)
 {
-  void __iomem *bar0;
+  aes128_dev *aes_dev = context->aes_dev;
+  aes128_async_req *req;
   dma_addr_t tmp_dma_addr;
+  int mode, ret;
 
-  DNOTIF_ENTER_FUN;
-  might_sleep ();
-  bar0 = aes_dev->bar0;
+  mode = batch_mode (job->job.mode);
+  if (IS_ERR_VALUE (mode) || job->job.len == 0
+      || job->job.len % sizeof (aes128_block) != 0
+      || job->job.len > AESDRV_ASYNC_MAX_LEN)
+    return -EINVAL;
 
-  /* Allocate the buffer.  */
-  aes_dev->cmd_buffer.k_ptr =
-          dma_alloc_coherent (&aes_dev->pci_dev->dev, AESDRV_CMDBUFF_SIZE,
-                              &tmp_dma_addr, GFP_KERNEL);
-  if (aes_dev->cmd_buffer.k_ptr == NULL)
+  req = kzalloc (sizeof (aes128_async_req), GFP_KERNEL);
+  if (req == NULL)
     return -ENOMEM;
-  aes_dev->cmd_buffer.d_ptr = tmp_dma_addr;
+  req->context = context;
+  req->user_data = job->user_data;
+  req->out = job->job.out;
+  req->len = job->job.len;
 
-  /* Tell device about buffer location.  */
-  iowrite32 ((uint32_t) aes_dev->cmd_buffer.d_ptr,
-             bar0 + AESDEV_CMD_BEGIN_PTR);
-  iowrite32 ((uint32_t) aes_dev->cmd_buffer.d_ptr + AESDRV_CMDBUFF_SIZE,
-             bar0 + AESDEV_CMD_END_PTR);
-  iowrite32 ((uint32_t) aes_dev->cmd_buffer.d_ptr,
-             bar0 + AESDEV_CMD_READ_PTR);
-  iowrite32 ((uint32_t) aes_dev->cmd_buffer.d_ptr,
-             bar0 + AESDEV_CMD_WRITE_PTR);
+  req->bounce = kmalloc (req->len, GFP_KERNEL);
+  if (req->bounce == NULL)
+    {
+      ret = -ENOMEM;
+      goto free_req;
+    }
+  if (copy_from_user (req->bounce, (void __user *) (unsigned long) job->job.in,
+                      req->len))
+    {
+      ret = -EFAULT;
+      goto free_bounce;
+    }
+
+  req->ks_buffer.k_ptr = dma_pool_alloc (aes_dev->ks_pool, GFP_KERNEL,
+                                         &tmp_dma_addr);
+  if (req->ks_buffer.k_ptr == NULL)
+    {
+      ret = -ENOMEM;
+      goto free_bounce;
+    }
+  req->ks_buffer.d_ptr = tmp_dma_addr;
+  memcpy (req->ks_buffer.k_ptr, job->job.key, AESDEV_AES_KEY_SIZE);
+  memcpy (req->ks_buffer.k_ptr + sizeof (aes128_block), job->job.iv,
+          AESDEV_AES_BLOCK_SIZE);
+
+  req->bounce_dma = dma_map_single (aes_dev->dev, req->bounce,
+                                    req->len, DMA_BIDIRECTIONAL);
+  if (dma_mapping_error (aes_dev->dev, req->bounce_dma))
+    {
+      ret = -ENOMEM;
+      goto free_ks;
+    }
+
+  ret = aes_make_task (tasks, req->bounce_dma, req->bounce_dma, req->len,
+                       req->ks_buffer.d_ptr, mode, GFP_KERNEL);
+  if (IS_ERR_VALUE (ret))
+    {
+      dma_unmap_single (aes_dev->dev, req->bounce_dma, req->len,
+                        DMA_BIDIRECTIONAL);
+      goto free_ks;
+    }
+  list_last_entry (tasks, aes128_task, task_list)->complete = async_task_done;
+  list_last_entry (tasks, aes128_task, task_list)->data = req;
   return 0;
-}
 
-static void
-cmd_buffer_destroy (aes128_dev *aes_dev)
-{
-  might_sleep ();
-  dma_free_coherent (&aes_dev->pci_dev->dev, AESDRV_CMDBUFF_SIZE,
-                     aes_dev->cmd_buffer.k_ptr, aes_dev->cmd_buffer.d_ptr);
+free_ks:
+  dma_pool_free (aes_dev->ks_pool, req->ks_buffer.k_ptr,
+                 req->ks_buffer.d_ptr);
+free_bounce:
+  kfree (req->bounce);
+free_req:
+  kfree (req);
+  return ret;
 }
-/*****************************************************************************/
 
-/*** PCI handlers ************************************************************/
-static int
-pci_probe (struct pci_dev *pci_dev, const struct pci_device_id * id)
+/* Queue jobs without waiting for them, see AESDEV_IOCTL_ASYNC_SUBMIT.
+   Jobs are accepted until the first bad one or the in-flight limit, the
+   number of accepted ones is written back.  Call with common_lock held.  */
+__must_check static long
+ioctl_async_submit (aes128_context *context,
+                    struct aesdev_ioctl_async __user *arg)
 {
-  aes128_dev *aes_dev;
-  uint32_t intr;
-  int minor, ret;
+  struct aesdev_ioctl_async req;
+  struct aesdev_async_job job;
+  struct aesdev_async_job __user *user_jobs;
+  struct list_head tasks;
+  unsigned long irq_flags;
+  uint32_t done, room;
+  int ret;
+
+  INIT_LIST_HEAD (&tasks);
+
+  if (copy_from_user (&req, arg, sizeof (req)))
+    return -EFAULT;
+  if (req.flags != 0)
+    return -EINVAL;
+
+  /* Completed jobs keep their buffers until reaped, so they count too.  */
+  spin_lock_irqsave (&context->aes_dev->lock, irq_flags);
+  room = AESDRV_ASYNC_MAX_INFLIGHT - context->async_jobs;
+  spin_unlock_irqrestore (&context->aes_dev->lock, irq_flags);
+  if (req.count > 0 && room == 0)
+    return -EAGAIN;
+
+  user_jobs = (struct aesdev_async_job __user *) (unsigned long) req.entries;
+  ret = 0;
+  for (done = 0; done < min (req.count, room); ++done)
+    {
+      if (copy_from_user (&job, user_jobs + done, sizeof (job)))
+        {
+          ret = -EFAULT;
+          break;
+        }
+      ret = async_prepare (context, &job, &tasks);
+      if (IS_ERR_VALUE (ret))
+        break;
+    }
+
+  /* Count them before any can complete.  */
+  spin_lock_irqsave (&context->aes_dev->lock, irq_flags);
+  context->async_inflight += done;
+  context->async_jobs += done;
+  spin_unlock_irqrestore (&context->aes_dev->lock, irq_flags);
+
+  /* One batch of commands for the whole call.  */
+  aes_submit_tasks (context->aes_dev, &tasks, 0);
+
+  /* Report the error only if nothing was accepted.  */
+  if (done == 0 && IS_ERR_VALUE (ret))
+    return ret;
+  if (put_user (done, &arg->count))
+    return -EFAULT;
+  return 0;
+}
+
+/* Collect completed jobs, see AESDEV_IOCTL_ASYNC_REAP.  Call with
+   common_lock held, it is dropped while waiting.  */
+__must_check static long
+ioctl_async_reap (aes128_context *context,
+                  struct aesdev_ioctl_async __user *arg)
+{
+  struct aesdev_ioctl_async req;
+  struct aesdev_async_completion comp;
+  struct aesdev_async_completion __user *user_comps;
+  aes128_async_req *areq, *temp_areq;
+  struct list_head done_list;
+  unsigned long irq_flags;
+  uint32_t done;
+  int ret;
+
+  INIT_LIST_HEAD (&done_list);
+
+  if (copy_from_user (&req, arg, sizeof (req)))
+    return -EFAULT;
+  if (req.flags & ~AESDEV_ASYNC_WAIT)
+    return -EINVAL;
+
+  if ((req.flags & AESDEV_ASYNC_WAIT) && req.count > 0)
+    {
+      mutex_unlock (&context->buffer.common_lock);
+      ret = wait_event_interruptible (context->buffer.read_queue,
+                                      mut_mode (context) == AESDEV_MODE_CLOSING
+                                      || async_ready (context));
+      mutex_lock (&context->buffer.common_lock);
+      if (ret != 0)
+        return ret;
+      if (context->mode == AESDEV_MODE_CLOSING)
+        return -EBADFD;
+    }
+
+  /*** CRITICAL SECTION ***/
+  spin_lock_irqsave (&context->aes_dev->lock, irq_flags);
+  done = 0;
+  list_for_each_entry_safe (areq, temp_areq, &context->async_done, list)
+  {
+    if (done == req.count)
+      break;
+    list_move_tail (&areq->list, &done_list);
+    done++;
+  }
+  spin_unlock_irqrestore (&context->aes_dev->lock, irq_flags);
+  /*** END CRITICAL SECTION ***/
+
+  user_comps = (struct aesdev_async_completion __user *)
+          (unsigned long) req.entries;
+  ret = 0;
+  done = 0;
+  list_for_each_entry_safe (areq, temp_areq, &done_list, list)
+  {
+    dma_sync_single_for_cpu (context->aes_dev->dev,
+                             areq->bounce_dma, areq->len, DMA_BIDIRECTIONAL);
+
+    memset (&comp, 0, sizeof (comp));
+    comp.user_data = areq->user_data;
+    memcpy (comp.iv, areq->ks_buffer.k_ptr + sizeof (aes128_block),
+            AESDEV_AES_BLOCK_SIZE);
+    if (copy_to_user ((void __user *) (unsigned long) areq->out,
+                      areq->bounce, areq->len))
+      comp.result = -EFAULT;
+    if (copy_to_user (user_comps + done, &comp, sizeof (comp)))
+      {
+        ret = -EFAULT;
+        break;
+      }
+
+    list_del (&areq->list);
+    async_req_free (areq);
+    done++;
+  }
+
+  spin_lock_irqsave (&context->aes_dev->lock, irq_flags);
+  context->async_jobs -= done;
+  spin_unlock_irqrestore (&context->aes_dev->lock, irq_flags);
+
+  /* Give back what could not be reported.  */
+  if (!list_empty (&done_list))
+    {
+      spin_lock_irqsave (&context->aes_dev->lock, irq_flags);
+      list_splice (&done_list, &context->async_done);
+      spin_unlock_irqrestore (&context->aes_dev->lock, irq_flags);
+    }
+
+  if (done == 0 && IS_ERR_VALUE (ret))
+    return ret;
+  if (put_user (done, &arg->count))
+    return -EFAULT;
+  return 0;
+}
+
+__must_check static bool
+ioctl_sets_mode (unsigned int cmd)
+{
+  return cmd == AESDEV_IOCTL_SET_ECB_ENCRYPT
+          || cmd == AESDEV_IOCTL_SET_ECB_DECRYPT
+          || cmd == AESDEV_IOCTL_SET_CBC_ENCRYPT
+          || cmd == AESDEV_IOCTL_SET_CBC_DECRYPT
+          || cmd == AESDEV_IOCTL_SET_CFB_ENCRYPT
+          || cmd == AESDEV_IOCTL_SET_CFB_DECRYPT
+          || cmd == AESDEV_IOCTL_SET_OFB
+          || cmd == AESDEV_IOCTL_SET_CTR;
+}
+
+static long
+file_ioctl (struct file *f, unsigned int cmd, unsigned long arg)
+{
+  aes128_context *context;
+  long retval;
+  int _ret_mutex;
+
+  DNOTIF_ENTER_FUN;
+  might_sleep ();
+
+  _ret_mutex = mutex_lock_interruptible (&context_erase_mutex);
+  if (_ret_mutex != 0)
+    return _ret_mutex;
+
+  context = f->private_data;
+
+  if (context == NULL)
+    {
+      mutex_unlock (&context_erase_mutex);
+      return -EBADFD;
+    }
+
+  KDEBUG ("context=%p mode=0x%x\n", context, context->mode);
+
+  _ret_mutex = mutex_lock_interruptible (&context->buffer.common_lock);
+  if (_ret_mutex != 0)
+    {
+      mutex_unlock (&context_erase_mutex);
+      return _ret_mutex;
+    }
+
+  mutex_unlock (&context_erase_mutex);
+
+  if (context->mode == AESDEV_MODE_CLOSING)
+    {
+      retval = -EBADFD;
+      goto exit;
+    }
+
+  /* A new stream replaces key and state and decides split mode anew, so
+     tasks of the previous one must be off the devices first.  */
+  if (ioctl_sets_mode (cmd))
+    while (__context_busy (context) > 0)
+      {
+        mutex_unlock (&context->buffer.common_lock);
+        retval = wait_event_interruptible (context->buffer.read_queue,
+                                           context_busy (context) == 0);
+        if (retval != 0)
+          return retval;
+
+        _ret_mutex = mutex_lock_interruptible (&context->buffer.common_lock);
+        if (_ret_mutex != 0)
+          return _ret_mutex;
+
+        if (context->mode == AESDEV_MODE_CLOSING)
+          {
+            retval = -EBADFD;
+            goto exit;
+          }
+      }
+
+  if (cmd == AESDEV_IOCTL_SET_ECB_ENCRYPT)
+    context->mode = AESDEV_MODE_ECB_ENCRYPT;
+  else if (cmd == AESDEV_IOCTL_SET_ECB_DECRYPT)
+    context->mode = AESDEV_MODE_ECB_DECRYPT;
+  else if (cmd == AESDEV_IOCTL_SET_CBC_ENCRYPT)
+    context->mode = AESDEV_MODE_CBC_ENCRYPT;
+  else if (cmd == AESDEV_IOCTL_SET_CBC_DECRYPT)
+    context->mode = AESDEV_MODE_CBC_DECRYPT;
+  else if (cmd == AESDEV_IOCTL_SET_CFB_ENCRYPT)
+    context->mode = AESDEV_MODE_CFB_ENCRYPT;
+  else if (cmd == AESDEV_IOCTL_SET_CFB_DECRYPT)
+    context->mode = AESDEV_MODE_CFB_DECRYPT;
+  else if (cmd == AESDEV_IOCTL_SET_OFB)
+    context->mode = AESDEV_MODE_OFB;
+  else if (cmd == AESDEV_IOCTL_SET_CTR)
+    context->mode = AESDEV_MODE_CTR;
+  else if (cmd == AESDEV_IOCTL_SET_BUFFER_SIZE)
+    {
+      retval = ioctl_set_buffer_size (context, (uint32_t __user *) arg);
+      goto exit;
+    }
+  else if (cmd == AESDEV_IOCTL_SET_OUT_OF_PLACE)
+    {
+      retval = ioctl_set_out_of_place (context, (uint32_t __user *) arg);
+      goto exit;
+    }
+  else if (cmd == AESDEV_IOCTL_RING_SUBMIT || cmd == AESDEV_IOCTL_RING_CONSUME)
+    {
+      retval = ioctl_ring (context, cmd, (uint32_t __user *) arg,
+                           f->f_flags & O_NONBLOCK);
+      goto exit;
+    }
+  else if (cmd == AESDEV_IOCTL_CRYPT)
+    {
+      retval = ioctl_crypt (context, (struct aesdev_ioctl_crypt __user *) arg);
+      goto exit;
+    }
+  else if (cmd == AESDEV_IOCTL_BATCH)
+    {
+      retval = ioctl_batch (context, (struct aesdev_ioctl_batch __user *) arg);
+      goto exit;
+    }
+  else if (cmd == AESDEV_IOCTL_ASYNC_SUBMIT)
+    {
+      retval = ioctl_async_submit (context,
+                                   (struct aesdev_ioctl_async __user *) arg);
+      goto exit;
+    }
+  else if (cmd == AESDEV_IOCTL_ASYNC_REAP)
+    {
+      retval = ioctl_async_reap (context,
+                                 (struct aesdev_ioctl_async __user *) arg);
+      goto exit;
+    }
+  else if (cmd == AESDEV_IOCTL_SET_EVENTFD)
+    {
+      struct eventfd_ctx *eventfd;
+      int32_t efd;
+
+      retval = 0;
+      if (get_user (efd, (int32_t __user *) arg))
+        retval = -EFAULT;
+      else if (efd < 0)
+        async_set_eventfd (context, NULL);
+      else
+        {
+          eventfd = eventfd_ctx_fdget (efd);
+          if (IS_ERR (eventfd))
+            retval = PTR_ERR (eventfd);
+          else
+            async_set_eventfd (context, eventfd);
+        }
+      goto exit;
+    }
+  else if (cmd == AESDEV_IOCTL_SET_POLL)
+    {
+      uint32_t enable;
+
+      if (get_user (enable, (uint32_t __user *) arg))
+        retval = -EFAULT;
+      else
+        {
+          context->poll = enable != 0;
+          retval = 0;
+        }
+      goto exit;
+    }
+  else if (cmd == AESDEV_IOCTL_GET_STATE)
+    {
+      if (context->mode == AESDEV_MODE_ECB_DECRYPT ||
+          context->mode == AESDEV_MODE_ECB_ENCRYPT ||
+          context->mode == AESDEV_MODE_UNDEF)
+        {
+          /* Other commands will also yield undefined behaviour when
+             data is being processed. But no EINVAL in other cases.  */
+          KDEBUG ("illegal GET_STATE in current mode\n");
+          retval = -EINVAL;
+          goto exit;
+        }
+
+      if (acb_read_count (&context->buffer) > 0
+          || acb_write_count (&context->buffer) > 0)
+        {
+          KDEBUG ("illegal GET_STATE with data in buffer\n");
+          retval = -EINVAL;
+          goto exit;
+        }
+
+      if (copy_to_user ((void *) arg,
+                        context->ks_buffer.k_ptr + sizeof (aes128_block),
+                        sizeof (aes128_block)))
+        {
+          KDEBUG ("copy_to_user\n");
+          retval = -EFAULT;
+          goto exit;
+        }
+
+      retval = 0;
+      goto exit;
+    }
+  else
+    {
+      /* Unknow command.  */
+      printk (KERN_WARNING "unknown command passed to ioctl\n");
+      retval = -EINVAL;
+      goto exit;
+    }
+
+  /* Independent blocks can be spread over devices, the new stream starts
+     with no tasks in flight (drained above), so it is safe to decide it
+     now.  */
+  context->split = split_len > 0
+          && (context->mode == AESDEV_MODE_ECB_ENCRYPT
+              || context->mode == AESDEV_MODE_ECB_DECRYPT
+              || context->mode == AESDEV_MODE_CTR);
+
+  /* Read encryption key.  */
+  if (copy_from_user (context->ks_buffer.k_ptr, (void *) arg, sizeof (aes128_block)))
+    {
+      KDEBUG ("copy_from_user\n");
+      retval = -EFAULT;
+      goto exit;
+    }
+
+  /* Read initialization vector.  */
+  if (cmd != AESDEV_IOCTL_SET_ECB_ENCRYPT && cmd != AESDEV_IOCTL_SET_ECB_DECRYPT)
+    if (copy_from_user (context->ks_buffer.k_ptr + sizeof (aes128_block),
+                        ((char *) arg) + sizeof (aes128_block),
+                        sizeof (aes128_block)))
+      {
+        KDEBUG ("copy_from_user\n");
+        retval = -EFAULT;
+        goto exit;
+      }
+
+  /* Writing is possible now, tell pollers registered before.  */
+  wake_up (&context->buffer.write_queue);
+
+  retval = 0;
+exit:
+  mutex_unlock (&context->buffer.common_lock);
+  DNOTIF_LEAVE_FUN;
+  return retval;
+}
+static void
+data_vm_open (struct vm_area_struct *vma)
+{
+  aes128_combo_buffer *buffer = vma->vm_private_data;
+  atomic_inc (&buffer->mmap_count);
+}
+
+static void
+data_vm_close (struct vm_area_struct *vma)
+{
+  aes128_combo_buffer *buffer = vma->vm_private_data;
+  atomic_dec (&buffer->mmap_count);
+}
+
+/* Map either the shared state page (read only) at AESDEV_RING_INFO_OFFSET,
+   the io buffer itself at AESDEV_RING_DATA_OFFSET or, in out-of-place mode,
+   its output part at AESDEV_RING_OUT_OFFSET.  */
+static int
+file_mmap (struct file *f, struct vm_area_struct *vma)
+{
+  aes128_context *context;
+  aes128_combo_buffer *buffer;
+  unsigned long offset, len;
+  int retval;
+
+  DNOTIF_ENTER_FUN;
+  might_sleep ();
+
+  retval = mutex_lock_interruptible (&context_erase_mutex);
+  if (retval != 0)
+    return retval;
+
+  context = f->private_data;
+  if (context == NULL)
+    {
+      mutex_unlock (&context_erase_mutex);
+      return -EBADFD;
+    }
+
+  retval = mutex_lock_interruptible (&context->buffer.common_lock);
+  if (retval != 0)
+    {
+      mutex_unlock (&context_erase_mutex);
+      return retval;
+    }
+
+  mutex_unlock (&context_erase_mutex);
+
+  buffer = &context->buffer;
+  offset = vma->vm_pgoff << PAGE_SHIFT;
+  len = vma->vm_end - vma->vm_start;
+
+  if (context->mode == AESDEV_MODE_CLOSING)
+    {
+      retval = -EBADFD;
+      goto exit;
+    }
+
+  if (offset == AESDEV_RING_INFO_OFFSET)
+    {
+      if (len != PAGE_SIZE || (vma->vm_flags & VM_WRITE))
+        {
+          retval = -EINVAL;
+          goto exit;
+        }
+
+      if (buffer->info == NULL)
+        {
+          buffer->info = (struct aesdev_ring_info *) get_zeroed_page (GFP_KERNEL);
+          if (buffer->info == NULL)
+            {
+              retval = -ENOMEM;
+              goto exit;
+            }
+          acb_publish (buffer);
+        }
+
+      vma->vm_flags &= ~VM_MAYWRITE;
+      retval = remap_pfn_range (vma, vma->vm_start,
+                                virt_to_phys (buffer->info) >> PAGE_SHIFT,
+                                PAGE_SIZE, vma->vm_page_prot);
+    }
+  else if (offset == AESDEV_RING_DATA_OFFSET
+           || (offset == AESDEV_RING_OUT_OFFSET && buffer->out_of_place))
+    {
+      dma_ptr *area;
+
+      if (len > buffer->size)
+        {
+          retval = -EINVAL;
+          goto exit;
+        }
+
+      area = offset == AESDEV_RING_DATA_OFFSET ? &buffer->data
+                                               : &buffer->out_data;
+
+      /* dma_mmap_coherent treats vm_pgoff as offset into the buffer.  */
+      vma->vm_pgoff = 0;
+      retval = dma_mmap_coherent (context->aes_dev->dev, vma,
+                                  area->k_ptr, area->d_ptr, buffer->size);
+      if (retval == 0)
+        {
+          /* Buffer cannot be resized while it is mapped.  */
+          vma->vm_private_data = buffer;
+          vma->vm_ops = &aes_data_vm_ops;
+          atomic_inc (&buffer->mmap_count);
+        }
+    }
+  else
+    retval = -EINVAL;
+
+exit:
+  mutex_unlock (&context->buffer.common_lock);
+  DNOTIF_LEAVE_FUN;
+  return retval;
+}
+/*****************************************************************************/
+
+/*** Device procedures *******************************************************/
+__must_check static int
+cmd_buffer_init (aes128_dev *aes_dev)
+{
+  dma_addr_t tmp_dma_addr;
+
+  DNOTIF_ENTER_FUN;
+  might_sleep ();
+
+  /* Allocate the buffer.  */
+  aes_dev->cmd_buffer.k_ptr =
+          dma_alloc_coherent (aes_dev->dev,
+                              AESDRV_CMDBUFF_SIZE (aes_dev->cmd_slots),
+                              &tmp_dma_addr, GFP_KERNEL);
+  if (aes_dev->cmd_buffer.k_ptr == NULL)
+    return -ENOMEM;
+  aes_dev->cmd_buffer.d_ptr = tmp_dma_addr;
+
+  /* Tell device about buffer location.  */
+  aes_reg_write (aes_dev, (uint32_t) aes_dev->cmd_buffer.d_ptr,
+                 AESDEV_CMD_BEGIN_PTR);
+  aes_reg_write (aes_dev, (uint32_t) aes_dev->cmd_buffer.d_ptr
+                 + AESDRV_CMDBUFF_SIZE (aes_dev->cmd_slots),
+                 AESDEV_CMD_END_PTR);
+  aes_reg_write (aes_dev, (uint32_t) aes_dev->cmd_buffer.d_ptr,
+                 AESDEV_CMD_READ_PTR);
+  aes_reg_write (aes_dev, (uint32_t) aes_dev->cmd_buffer.d_ptr,
+                 AESDEV_CMD_WRITE_PTR);
+  aes_dev->cmd_write_index = 0;
+  return 0;
+}
+
+static void
+cmd_buffer_destroy (aes128_dev *aes_dev)
+{
+  might_sleep ();
+  dma_free_coherent (aes_dev->dev,
+                     AESDRV_CMDBUFF_SIZE (aes_dev->cmd_slots),
+                     aes_dev->cmd_buffer.k_ptr, aes_dev->cmd_buffer.d_ptr);
+}
+
+/* Replace command buffer with a new one with SLOTS slots.  Device must be
+   idle (no open files), call with dev_remove_mutex held.  */
+__must_check static int
+cmd_buffer_resize (aes128_dev *aes_dev, unsigned int slots)
+{
+  dma_ptr old_buffer;
+  unsigned int old_slots;
+  int ret;
+
+  might_sleep ();
+  assert (aes_dev->tasks_in_progress == 0);
+
+  old_buffer = aes_dev->cmd_buffer;
+  old_slots = aes_dev->cmd_slots;
+
+  aes_dev->cmd_slots = slots;
+  ret = cmd_buffer_init (aes_dev);
+  if (IS_ERR_VALUE (ret))
+    {
+      aes_dev->cmd_slots = old_slots;
+      aes_dev->cmd_buffer = old_buffer;
+      return ret;
+    }
+
+  dma_free_coherent (aes_dev->dev, AESDRV_CMDBUFF_SIZE (old_slots),
+                     old_buffer.k_ptr, old_buffer.d_ptr);
+  return 0;
+}
+/*****************************************************************************/
+
+/*** Crypto API **************************************************************/
+/* Requests of crypto API users are queued per device and turned into tasks
+   with no context.  Data is DMA-mapped in place when the scatterlists are
+   made of whole blocks, otherwise it goes through a bounce buffer.  All
+   tasks of a request share its key and state, and only the last one
+   completes the request.  Keys other than AES-128, too long requests and
+   requests made when no device is present are passed to a software
+   fallback.  This path never sleeps, it may be entered from softirq.  */
+
+/* Can OTHER use DMA addresses mapped for AES_DEV?  Only if both translate
+   them the same way: the same IOMMU domain, or no IOMMU for either (bus
+   addresses are physical then, the software model uses them the same).  */
+__must_check static bool
+aes_dev_shares_dma (aes128_dev *aes_dev, aes128_dev *other)
+{
+  return other == aes_dev
+          || iommu_get_domain_for_dev (other->dev)
+             == iommu_get_domain_for_dev (aes_dev->dev);
+}
+
+/* Pick the least loaded device and account a request on it, so that the
+   device does not go away until aes_crypto_put_dev.  If NEAR is given,
+   only devices that can use DMA addresses mapped for it are considered.
+   Returns NULL if no device takes crypto API requests.  */
+static aes128_dev *
+aes_crypto_get_dev (aes128_dev *near)
+{
+  aes128_dev *aes_dev, *best;
+  unsigned long irq_flags;
+
+  best = NULL;
+  spin_lock_irqsave (&aes_crypto_lock, irq_flags);
+  list_for_each_entry (aes_dev, &aes_crypto_devs, crypto_list)
+  {
+    if (near != NULL && !aes_dev_shares_dma (near, aes_dev))
+      continue;
+    if (best == NULL
+        || READ_ONCE (aes_dev->tasks_in_progress)
+           < READ_ONCE (best->tasks_in_progress))
+      best = aes_dev;
+  }
+  if (best != NULL)
+    {
+      spin_lock (&best->lock);
+      best->crypto_requests++;
+      spin_unlock (&best->lock);
+    }
+  spin_unlock_irqrestore (&aes_crypto_lock, irq_flags);
+
+  return best;
+}
+
+static void
+aes_crypto_put_dev (aes128_dev *aes_dev)
+{
+  unsigned long irq_flags;
+
+  /* Wake up under spinlock, aes_dev may be freed right after it is
+     released.  */
+  spin_lock_irqsave (&aes_dev->lock, irq_flags);
+  aes_dev->crypto_requests--;
+  if (aes_dev->crypto_requests == 0)
+    wake_up (&aes_dev->command_queue);
+  spin_unlock_irqrestore (&aes_dev->lock, irq_flags);
+}
+
+__must_check static size_t
+crypto_requests (aes128_dev *aes_dev)
+{
+  unsigned long irq_flags;
+  size_t ret;
+
+  spin_lock_irqsave (&aes_dev->lock, irq_flags);
+  ret = aes_dev->crypto_requests;
+  spin_unlock_irqrestore (&aes_dev->lock, irq_flags);
+
+  return ret;
+}
+
+/* Start taking crypto API requests.  Device has to run since now.
+   Call with dev_remove_mutex held.  */
+static void
+aes_crypto_attach (aes128_dev *aes_dev)
+{
+  unsigned long irq_flags;
+
+  AESDEV_START (aes_dev);
+
+  spin_lock_irqsave (&aes_crypto_lock, irq_flags);
+  list_add_tail (&aes_dev->crypto_list, &aes_crypto_devs);
+  spin_unlock_irqrestore (&aes_crypto_lock, irq_flags);
+}
+
+/* Stop taking crypto API requests and wait for the accepted ones.
+   Call with dev_remove_mutex held.  */
+static void
+aes_crypto_detach (aes128_dev *aes_dev)
+{
+  unsigned long irq_flags;
+
+  might_sleep ();
+
+  spin_lock_irqsave (&aes_crypto_lock, irq_flags);
+  list_del_init (&aes_dev->crypto_list);
+  spin_unlock_irqrestore (&aes_crypto_lock, irq_flags);
+
+  wait_event (aes_dev->command_queue, crypto_requests (aes_dev) == 0);
+}
+
+/* Returns true if first LEN bytes of the scatterlist consist of whole
+   blocks only.  */
+__must_check static bool
+aes_crypto_sg_aligned (struct scatterlist *sg, size_t len)
+{
+  for (; sg != NULL && len > 0; sg = sg_next (sg))
+    {
+      if (min_t (size_t, sg->length, len) % sizeof (aes128_block) != 0)
+        return false;
+      len -= min_t (size_t, sg->length, len);
+    }
+  return len == 0;
+}
+
+static void
+aes_crypto_unmap (struct skcipher_request *req)
+{
+  aes128_crypto_req *rctx;
+  struct device *dev;
+
+  rctx = skcipher_request_ctx (req);
+  dev = rctx->aes_dev->dev;
+
+  if (rctx->bounce != NULL)
+    {
+      dma_unmap_single (dev, rctx->bounce_dma, rctx->bounce_len,
+                        DMA_BIDIRECTIONAL);
+      kfree (rctx->bounce);
+      rctx->bounce = NULL;
+    }
+  else if (req->src == req->dst)
+    dma_unmap_sg (dev, req->src, rctx->src_nents, DMA_BIDIRECTIONAL);
+  else
+    {
+      dma_unmap_sg (dev, req->src, rctx->src_nents, DMA_TO_DEVICE);
+      dma_unmap_sg (dev, req->dst, rctx->dst_nents, DMA_FROM_DEVICE);
+    }
+}
+
+/* Map scatterlists of the request and make one task for every piece that
+   is contiguous in both of them.  */
+__must_check static int
+aes_crypto_map_sg (struct skcipher_request *req)
+{
+  aes128_crypto_req *rctx;
+  struct device *dev;
+  int ret;
+
+  rctx = skcipher_request_ctx (req);
+  dev = rctx->aes_dev->dev;
+
+  if (req->src == req->dst)
+    {
+      if (dma_map_sg (dev, req->src, rctx->src_nents, DMA_BIDIRECTIONAL) == 0)
+        return -ENOMEM;
+    }
+  else
+    {
+      if (dma_map_sg (dev, req->src, rctx->src_nents, DMA_TO_DEVICE) == 0)
+        return -ENOMEM;
+      if (dma_map_sg (dev, req->dst, rctx->dst_nents, DMA_FROM_DEVICE) == 0)
+        {
+          dma_unmap_sg (dev, req->src, rctx->src_nents, DMA_TO_DEVICE);
+          return -ENOMEM;
+        }
+    }
+
+  ret = aes_make_sg_tasks (&rctx->tasks, req->src, req->dst, req->cryptlen,
+                           rctx->ks_buffer.d_ptr, rctx->mode, GFP_ATOMIC);
+  if (IS_ERR_VALUE (ret))
+    goto fail;
+  rctx->task_count = ret;
+
+  /* All tasks have to fit in command buffer at once.  */
+  if (rctx->task_count > rctx->aes_dev->cmd_slots - 2)
+    {
+      ret = -E2BIG;
+      goto fail;
+    }
+  return 0;
+
+fail:
+  aes_free_tasks (&rctx->tasks);
+  rctx->task_count = 0;
+  aes_crypto_unmap (req);
+  return ret;
+}
+
+/* Copy the request data to a single buffer.  The buffer is rounded up to
+   whole blocks, what is after the data is encrypted and thrown away.  */
+__must_check static int
+aes_crypto_map_bounce (struct skcipher_request *req)
+{
+  aes128_crypto_req *rctx;
+  struct device *dev;
+  int ret;
+
+  rctx = skcipher_request_ctx (req);
+  dev = rctx->aes_dev->dev;
+
+  rctx->bounce_len = round_up (req->cryptlen, sizeof (aes128_block));
+  if (rctx->bounce_len > AESDRV_CRYPTO_MAX_BOUNCE)
+    return -E2BIG;
+  rctx->bounce = kzalloc (rctx->bounce_len, GFP_ATOMIC);
+  if (rctx->bounce == NULL)
+    return -ENOMEM;
+
+  sg_copy_to_buffer (req->src, rctx->src_nents, rctx->bounce, req->cryptlen);
+
+  rctx->bounce_dma = dma_map_single (dev, rctx->bounce, rctx->bounce_len,
+                                     DMA_BIDIRECTIONAL);
+  if (dma_mapping_error (dev, rctx->bounce_dma))
+    {
+      kfree (rctx->bounce);
+      rctx->bounce = NULL;
+      return -ENOMEM;
+    }
+
+  ret = aes_make_task (&rctx->tasks, rctx->bounce_dma, rctx->bounce_dma,
+                       rctx->bounce_len, rctx->ks_buffer.d_ptr, rctx->mode,
+                       GFP_ATOMIC);
+  if (IS_ERR_VALUE (ret))
+    {
+      aes_crypto_unmap (req);
+      return ret;
+    }
+  rctx->task_count = 1;
+  return 0;
+}
+
+static void
+aes_crypto_complete (struct skcipher_request *req, int err)
+{
+  aes128_crypto_req *rctx;
+  aes128_dev *aes_dev;
+
+  rctx = skcipher_request_ctx (req);
+  aes_dev = rctx->aes_dev;
+
+  /* Users expect to be called back from softirq.  */
+  local_bh_disable ();
+  req->base.complete (&req->base, err);
+  local_bh_enable ();
+
+  aes_crypto_put_dev (aes_dev);
+}
+
+static void
+aes_crypto_fallback_work (struct work_struct *work)
+{
+  struct skcipher_request *req;
+  aes128_crypto_ctx *ctx;
+  aes128_crypto_req *rctx;
+  int ret;
+
+  rctx = container_of (work, aes128_crypto_req, fallback_work);
+  req = rctx->req;
+  ctx = crypto_skcipher_ctx (crypto_skcipher_reqtfm (req));
+
+  ret = aes_skcipher_fallback (req, rctx->mode == ctx->enc_mode);
+  if (ret == -EINPROGRESS
+      || (ret == -EBUSY && (req->base.flags & CRYPTO_TFM_REQ_MAY_BACKLOG)))
+    {
+      /* Fallback calls the user back itself.  */
+      aes_crypto_put_dev (rctx->aes_dev);
+      return;
+    }
+  aes_crypto_complete (req, ret);
+}
+
+/* Hand queued request REQ, which could not be prepared for the device, to
+   software fallback.  The pump runs requests of other callers, possibly in
+   atomic context, while REQ may have been queued with MAY_SLEEP, so the
+   fallback is run from aes_crypto_wq.  REQ is called back the same way in
+   the end.  */
+static void
+aes_crypto_fallback (struct skcipher_request *req)
+{
+  aes128_crypto_req *rctx;
+
+  rctx = skcipher_request_ctx (req);
+  rctx->req = req;
+  INIT_WORK (&rctx->fallback_work, aes_crypto_fallback_work);
+  queue_work (aes_crypto_wq, &rctx->fallback_work);
+}
+
+/* Called after the last task of a request has completed.  */
+static void
+aes_crypto_task_done (aes128_task *task)
+{
+  struct skcipher_request *req;
+  aes128_crypto_req *rctx;
+
+  req = task->data;
+  rctx = skcipher_request_ctx (req);
+
+  if (rctx->bounce != NULL)
+    {
+      dma_unmap_single (rctx->aes_dev->dev, rctx->bounce_dma,
+                        rctx->bounce_len, DMA_BIDIRECTIONAL);
+      sg_copy_from_buffer (req->dst, rctx->dst_nents, rctx->bounce,
+                           req->cryptlen);
+      kfree (rctx->bounce);
+      rctx->bounce = NULL;
+    }
+  else
+    aes_crypto_unmap (req);
+
+  /* Device has saved the state for the next request in chain.  */
+  if (HAS_STATE (rctx->mode))
+    memcpy (req->iv, rctx->ks_buffer.k_ptr + sizeof (aes128_block),
+            AES_BLOCK_SIZE);
+
+  dma_pool_free (rctx->aes_dev->ks_pool, rctx->ks_buffer.k_ptr,
+                 rctx->ks_buffer.d_ptr);
+
+  aes_crypto_complete (req, 0);
+}
+
+/* Allocate key and state, map data and make tasks of the request.  */
+__must_check static int
+aes_crypto_prepare (struct skcipher_request *req)
+{
+  aes128_crypto_ctx *ctx;
+  aes128_crypto_req *rctx;
+  aes128_task *last;
+  dma_addr_t tmp_dma_addr;
+  int ret;
+
+  ctx = crypto_skcipher_ctx (crypto_skcipher_reqtfm (req));
+  rctx = skcipher_request_ctx (req);
+
+  INIT_LIST_HEAD (&rctx->tasks);
+  rctx->task_count = 0;
+  rctx->bounce = NULL;
+
+  rctx->ks_buffer.k_ptr = dma_pool_alloc (rctx->aes_dev->ks_pool, GFP_ATOMIC,
+                                          &tmp_dma_addr);
+  if (rctx->ks_buffer.k_ptr == NULL)
+    return -ENOMEM;
+  rctx->ks_buffer.d_ptr = tmp_dma_addr;
+
+  memcpy (rctx->ks_buffer.k_ptr, ctx->key, sizeof (aes128_block));
+  if (HAS_STATE (rctx->mode))
+    memcpy (rctx->ks_buffer.k_ptr + sizeof (aes128_block), req->iv,
+            AES_BLOCK_SIZE);
+
+  ret = -EINVAL;
+  if (aes_crypto_sg_aligned (req->src, req->cryptlen)
+      && aes_crypto_sg_aligned (req->dst, req->cryptlen))
+    ret = aes_crypto_map_sg (req);
+  if (IS_ERR_VALUE (ret))
+    ret = aes_crypto_map_bounce (req);
+  if (IS_ERR_VALUE (ret))
+    {
+      dma_pool_free (rctx->aes_dev->ks_pool, rctx->ks_buffer.k_ptr,
+                     rctx->ks_buffer.d_ptr);
+      return ret;
+    }
+
+  last = list_last_entry (&rctx->tasks, aes128_task, task_list);
+  last->complete = aes_crypto_task_done;
+  last->data = req;
+  return 0;
+}
+
+/* Move queued requests to the device as long as there is space in command
+   buffer.  Request waiting for space is kept prepared in crypto_pending.
+   Only one caller pumps at a time, the others leave their requests to
+   it.  */
+static void
+aes_crypto_pump (aes128_dev *aes_dev)
+{
+  struct crypto_async_request *async_req, *backlog;
+  struct skcipher_request *req;
+  aes128_crypto_req *rctx;
+  unsigned long irq_flags;
+  int ret;
+
+  /*** CRITICAL SECTION ***/
+  spin_lock_irqsave (&aes_dev->lock, irq_flags);
+  if (aes_dev->crypto_pumping)
+    {
+      spin_unlock_irqrestore (&aes_dev->lock, irq_flags);
+      return;
+    }
+  aes_dev->crypto_pumping = true;
+
+  for (;;)
+    {
+      req = aes_dev->crypto_pending;
+      if (req == NULL)
+        {
+          backlog = crypto_get_backlog (&aes_dev->crypto_queue);
+          async_req = crypto_dequeue_request (&aes_dev->crypto_queue);
+          if (async_req == NULL)
+            break;
+          spin_unlock_irqrestore (&aes_dev->lock, irq_flags);
+
+          if (backlog != NULL)
+            {
+              local_bh_disable ();
+              backlog->complete (backlog, -EINPROGRESS);
+              local_bh_enable ();
+            }
+
+          req = skcipher_request_cast (async_req);
+          ret = aes_crypto_prepare (req);
+          if (IS_ERR_VALUE (ret))
+            {
+              /* Too big for the command buffer or for a bounce buffer, or
+                 out of atomic memory.  */
+              if (ret == -ENOMEM || ret == -E2BIG)
+                aes_crypto_fallback (req);
+              else
+                aes_crypto_complete (req, ret);
+              spin_lock_irqsave (&aes_dev->lock, irq_flags);
+              continue;
+            }
+
+          spin_lock_irqsave (&aes_dev->lock, irq_flags);
+          aes_dev->crypto_pending = req;
+        }
+
+      rctx = skcipher_request_ctx (req);
+      if (__free_task_slots (aes_dev) < rctx->task_count)
+        break;
+
+      aes_dev->crypto_pending = NULL;
+      __aes_fill_commands (aes_dev, &rctx->tasks, rctx->task_count, NULL);
+    }
+
+  aes_dev->crypto_pumping = false;
+  spin_unlock_irqrestore (&aes_dev->lock, irq_flags);
+  /*** END CRITICAL SECTION ***/
+}
+
+static int
+aes_skcipher_fallback (struct skcipher_request *req, bool encrypt)
+{
+  aes128_crypto_ctx *ctx;
+  aes128_crypto_req *rctx;
+
+  ctx = crypto_skcipher_ctx (crypto_skcipher_reqtfm (req));
+  rctx = skcipher_request_ctx (req);
+
+  skcipher_request_set_tfm (&rctx->fallback_req, ctx->fallback);
+  skcipher_request_set_callback (&rctx->fallback_req, req->base.flags,
+                                 req->base.complete, req->base.data);
+  skcipher_request_set_crypt (&rctx->fallback_req, req->src, req->dst,
+                              req->cryptlen, req->iv);
+
+  if (encrypt)
+    return crypto_skcipher_encrypt (&rctx->fallback_req);
+  else
+    return crypto_skcipher_decrypt (&rctx->fallback_req);
+}
+
+static int
+aes_skcipher_crypt (struct skcipher_request *req, bool encrypt)
+{
+  struct crypto_skcipher *tfm;
+  aes128_crypto_ctx *ctx;
+  aes128_crypto_req *rctx;
+  aes128_dev *aes_dev;
+  unsigned long irq_flags;
+  int ret;
+
+  tfm = crypto_skcipher_reqtfm (req);
+  ctx = crypto_skcipher_ctx (tfm);
+  rctx = skcipher_request_ctx (req);
+
+  if (crypto_skcipher_blocksize (tfm) > 1
+      && req->cryptlen % AES_BLOCK_SIZE != 0)
+    return -EINVAL;
+  if (req->cryptlen == 0)
+    return 0;
+
+  if (ctx->key_len != AES_KEYSIZE_128
+      || req->cryptlen > AESDRV_CRYPTO_MAX_LEN)
+    return aes_skcipher_fallback (req, encrypt);
+
+  aes_dev = aes_crypto_get_dev (NULL);
+  if (aes_dev == NULL)
+    return aes_skcipher_fallback (req, encrypt);
+
+  rctx->src_nents = sg_nents_for_len (req->src, req->cryptlen);
+  rctx->dst_nents = sg_nents_for_len (req->dst, req->cryptlen);
+  if (rctx->src_nents < 0 || rctx->dst_nents < 0)
+    {
+      aes_crypto_put_dev (aes_dev);
+      return -EINVAL;
+    }
+
+  rctx->aes_dev = aes_dev;
+  rctx->mode = encrypt ? ctx->enc_mode : ctx->dec_mode;
+
+  spin_lock_irqsave (&aes_dev->lock, irq_flags);
+  ret = crypto_enqueue_request (&aes_dev->crypto_queue, &req->base);
+  if (ret == -EINPROGRESS
+      || (ret == -EBUSY && (req->base.flags & CRYPTO_TFM_REQ_MAY_BACKLOG)))
+    aes_dev->crypto_requests++;
+  spin_unlock_irqrestore (&aes_dev->lock, irq_flags);
+
+  aes_crypto_pump (aes_dev);
+
+  /* Drop the reference taken by aes_crypto_get_dev, queued request has its
+     own.  */
+  aes_crypto_put_dev (aes_dev);
+  return ret;
+}
+
+static int
+aes_skcipher_encrypt (struct skcipher_request *req)
+{
+  return aes_skcipher_crypt (req, true);
+}
+
+static int
+aes_skcipher_decrypt (struct skcipher_request *req)
+{
+  return aes_skcipher_crypt (req, false);
+}
+
+static int
+aes_skcipher_setkey (struct crypto_skcipher *tfm, const u8 *key,
+                     unsigned int key_len)
+{
+  aes128_crypto_ctx *ctx;
+  int ret;
+
+  ctx = crypto_skcipher_ctx (tfm);
+
+  /* Fallback checks the key and takes requests the device cannot do.  */
+  crypto_skcipher_clear_flags (ctx->fallback, CRYPTO_TFM_REQ_MASK);
+  crypto_skcipher_set_flags (ctx->fallback, crypto_skcipher_get_flags (tfm)
+                                            & CRYPTO_TFM_REQ_MASK);
+  ret = crypto_skcipher_setkey (ctx->fallback, key, key_len);
+  if (ret != 0)
+    return ret;
+
+  memcpy (ctx->key, key, key_len);
+  ctx->key_len = key_len;
+  return 0;
+}
+
+static int
+aes_skcipher_init (struct crypto_skcipher *tfm)
+{
+  aes128_crypto_alg *alg;
+  aes128_crypto_ctx *ctx;
+
+  alg = container_of (crypto_skcipher_alg (tfm), aes128_crypto_alg, alg);
+  ctx = crypto_skcipher_ctx (tfm);
+
+  memset (ctx, 0, sizeof (aes128_crypto_ctx));
+  ctx->enc_mode = alg->enc_mode;
+  ctx->dec_mode = alg->dec_mode;
+
+  ctx->fallback = crypto_alloc_skcipher (alg->alg.base.cra_name, 0,
+                                         CRYPTO_ALG_NEED_FALLBACK);
+  if (IS_ERR (ctx->fallback))
+    {
+      printk (KERN_WARNING "cannot allocate fallback for %s\n",
+              alg->alg.base.cra_name);
+      return PTR_ERR (ctx->fallback);
+    }
+
+  crypto_skcipher_set_reqsize (tfm, sizeof (aes128_crypto_req)
+                                    + crypto_skcipher_reqsize (ctx->fallback));
+  return 0;
+}
+
+static void
+aes_skcipher_exit (struct crypto_skcipher *tfm)
+{
+  aes128_crypto_ctx *ctx;
+
+  ctx = crypto_skcipher_ctx (tfm);
+  crypto_free_skcipher (ctx->fallback);
+}
+
+/* Algorithms are registered with the first device and stay until the
+   module is unloaded, requests go to fallback when there are no devices.
+   Call with dev_remove_mutex held.  */
+static void
+aes_crypto_register (void)
+{
+  int i, ret;
+
+  if (aes_crypto_registered)
+    return;
+
+  for (i = 0; i < ARRAY_SIZE (aes_crypto_algs); ++i)
+    {
+      ret = crypto_register_skcipher (&aes_crypto_algs[i].alg);
+      if (IS_ERR_VALUE (ret))
+        {
+          printk (KERN_WARNING "crypto_register_skcipher %s\n",
+                  aes_crypto_algs[i].alg.base.cra_name);
+          while (i-- > 0)
+            crypto_unregister_skcipher (&aes_crypto_algs[i].alg);
+          return;
+        }
+    }
+  aes_crypto_registered = true;
+}
+
+static void
+aes_crypto_unregister (void)
+{
+  int i;
+
+  if (!aes_crypto_registered)
+    return;
+
+  for (i = 0; i < ARRAY_SIZE (aes_crypto_algs); ++i)
+    crypto_unregister_skcipher (&aes_crypto_algs[i].alg);
+  aes_crypto_registered = false;
+}
+/*****************************************************************************/
+
+/*** PCI handlers ************************************************************/
+/* Set up aes device DEV, already enabled, with registers at BAR0 (or in
+   software model SIM) and interrupts on IRQ, and make it available to
+   users.  Common part of pci_probe and sim_probe.  */
+__must_check static int
+aes_dev_add (struct device *dev, void __iomem *bar0,
+             const struct aesdev_sim_regs *sim, int irq,
+             aes128_dev **result)
+{
+  aes128_dev *aes_dev;
+  uint32_t intr;
+  int minor, ret;
+  struct device *sys_dev;
+
+  DNOTIF_ENTER_FUN;
+  might_sleep ();
+
+  mutex_lock (&dev_remove_mutex);
+
+  /* Find free slot for new device.  */
+  for (minor = 0; minor < AESDRV_MAX_DEV_COUNT; ++minor)
+    if (aes_devs[minor] == NULL)
+      break;
+
+  /* Too many devices in system.  */
+  if (minor == AESDRV_MAX_DEV_COUNT)
+    {
+      ret = -ENOMEM;
+      goto err_unlock;
+    }
+
+  /* Initialize new aes128_device structure.  */
+  aes_dev = kmalloc (sizeof (aes128_dev), GFP_KERNEL);
+  if (aes_dev == NULL)
+    {
+      ret = -ENOMEM;
+      goto err_unlock;
+    }
+  memset (aes_dev, 0, sizeof (aes128_dev));
+
+  aes_dev->stats = alloc_percpu (aes128_dev_stats);
+  if (aes_dev->stats == NULL)
+    {
+      ret = -ENOMEM;
+      goto err_free_dev;
+    }
+
+  spin_lock_init (&aes_dev->lock);
+  init_waitqueue_head (&aes_dev->command_queue);
+  hrtimer_init (&aes_dev->reap_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+  aes_dev->reap_timer.function = reap_timer_fn;
+
+  INIT_LIST_HEAD (&aes_dev->task_list_head);
+  INIT_LIST_HEAD (&aes_dev->file_list_head);
+  INIT_LIST_HEAD (&aes_dev->crypto_list);
+  crypto_init_queue (&aes_dev->crypto_queue, AESDRV_CRYPTO_QUEUE_LEN);
+
+  aes_dev->dev = dev;
+  aes_dev->bar0 = bar0;
+  aes_dev->sim = sim;
+  aes_dev->minor = minor;
+  aes_dev->cmd_slots = clamp_t (unsigned int, cmd_slots,
+                                AESDRV_CMDBUFF_MIN_SLOTS,
+                                AESDRV_CMDBUFF_MAX_SLOTS);
+  aes_dev->poll_budget_us = AESDRV_POLL_DEFAULT_BUDGET_US;
+
+  ret = request_threaded_irq (irq, irq_handler, irq_thread,
+                              IRQF_SHARED, "aesdev", aes_dev);
+  if (IS_ERR_VALUE (ret))
+    {
+      printk (KERN_WARNING "request_threaded_irq\n");
+      goto err_free_stats;
+    }
+  aes_dev->irq = irq;
+
+  /* Init data transfer block.  */
+  aes_reg_write (aes_dev, 0x00000000, AESDEV_XFER_IN_PTR);
+  aes_reg_write (aes_dev, 0x00000000, AESDEV_XFER_OUT_PTR);
+  aes_reg_write (aes_dev, 0x00000000, AESDEV_XFER_STATE_PTR);
+  aes_reg_write (aes_dev, 0x00000000, AESDEV_XFER_TASK);
+
+  /* Init command buffer.  */
+  ret = cmd_buffer_init (aes_dev);
+  if (IS_ERR_VALUE (ret))
+    {
+      printk (KERN_WARNING "cmd_buffer_init\n");
+      goto err_free_irq;
+    }
+
+  /* Key and state of crypto API requests.  */
+  aes_dev->ks_pool = dma_pool_create ("aesdev_ks", dev,
+                                      2 * sizeof (aes128_block),
+                                      sizeof (aes128_block), 0);
+  if (aes_dev->ks_pool == NULL)
+    {
+      printk (KERN_WARNING "dma_pool_create\n");
+      ret = -ENOMEM;
+      goto err_cmd_buffer;
+    }
+
+  /* Clear interrupts.  */
+  intr = aes_reg_read (aes_dev, AESDEV_INTR);
+  aes_reg_write (aes_dev, intr, AESDEV_INTR);
+
+  /* Register device in driver.  */
+  aes_devs[minor] = aes_dev;
+
+  /* Do this at the very end. Since now, the device is available to user.  */
+  sys_dev = device_create (dev_class,
+                           NULL,
+                           MKDEV (major, minor),
+                           aes_dev,
+                           "aes%d",
+                           minor);
+  if (IS_ERR_OR_NULL (sys_dev))
+    {
+      printk (KERN_WARNING "device_create\n");
+      aes_devs[minor] = NULL;
+      ret = sys_dev ? PTR_ERR (sys_dev) : -EIO;
+      goto err_ks_pool;
+    }
+  aes_dev->sys_dev = sys_dev;
+
+  /* Not having debugfs is not an error.  */
+  aes_dev->debugfs = debugfs_create_dir (dev_name (sys_dev), aes_debugfs);
+  if (!IS_ERR_OR_NULL (aes_dev->debugfs))
+    debugfs_create_file ("contexts", S_IRUSR, aes_dev->debugfs, aes_dev,
+                         &aes_contexts_fops);
+
+  /* Device is ready, it can be used by crypto API too.  */
+  aes_crypto_attach (aes_dev);
+  aes_crypto_register ();
+
+  printk (KERN_WARNING "Registered new aesdev\n");
+  DNOTIF_LEAVE_FUN;
+  mutex_unlock (&dev_remove_mutex);
+  *result = aes_dev;
+  return 0;
+
+err_ks_pool:
+  dma_pool_destroy (aes_dev->ks_pool);
+err_cmd_buffer:
+  cmd_buffer_destroy (aes_dev);
+err_free_irq:
+  free_irq (irq, aes_dev);
+err_free_stats:
+  free_percpu (aes_dev->stats);
+err_free_dev:
+  kfree (aes_dev);
+err_unlock:
+  mutex_unlock (&dev_remove_mutex);
+  return ret;
+}
+
+/* Undo aes_dev_add.  */
+static void
+aes_dev_del (aes128_dev *aes_dev)
+{
+  DNOTIF_ENTER_FUN;
+  might_sleep ();
+
+  mutex_lock (&dev_remove_mutex);
+  aes_devs[aes_dev->minor] = NULL;
+  if (!list_empty (&aes_dev->file_list_head))
+    panic ("aesdev: Hot-unplug with open contexts not supported! Fatal.\n");
+  aes_crypto_detach (aes_dev);
+  AESDEV_STOP (aes_dev);
+  mutex_unlock (&dev_remove_mutex);
+
+  debugfs_remove_recursive (aes_dev->debugfs);
+  device_destroy (dev_class, MKDEV (major, aes_dev->minor));
+  free_irq (aes_dev->irq, aes_dev);
+  hrtimer_cancel (&aes_dev->reap_timer);
+  dma_pool_destroy (aes_dev->ks_pool);
+  cmd_buffer_destroy (aes_dev);
+  free_percpu (aes_dev->stats);
+  kfree (aes_dev);
+
+  printk (KERN_WARNING "Unregistered aesdev\n");
+  DNOTIF_LEAVE_FUN;
+}
+
+static int
+pci_probe (struct pci_dev *pci_dev, const struct pci_device_id * id)
+{
+  aes128_dev *aes_dev;
   void __iomem *ioptr;
-  struct device *sys_dev;
+  int ret;
 
   DNOTIF_ENTER_FUN;
   might_sleep ();
 
-  mutex_lock (&dev_remove_mutex);
-
-  /* Find free slot for new device.  */
-  for (minor = 0; minor < AESDRV_MAX_DEV_COUNT; ++minor)
-    if (aes_devs[minor] == NULL)
-      break;
-
-  /* Too many devices in system.  */
-  if (minor == AESDRV_MAX_DEV_COUNT)
-    return -ENOMEM;
-
   ret = pci_enable_device (pci_dev);
   if (IS_ERR_VALUE (ret))
     {
       printk (KERN_WARNING "pci_enable_device\n");
-      mutex_unlock (&dev_remove_mutex);
       return ret;
     }
   ret = pci_request_regions (pci_dev, "aesdev");
@@ -1127,48 +4358,22 @@ pci_probe (struct pci_dev *pci_dev, const struct pci_device_id * id)
     {
       printk (KERN_WARNING "pci_request_regions\n");
       pci_disable_device (pci_dev);
-      mutex_unlock (&dev_remove_mutex);
       return ret;
     }
 
-  /* Initialize new aes128_device structure.  */
-  aes_dev = kmalloc (sizeof (aes128_dev), GFP_KERNEL);
-  if (aes_dev == NULL)
-    {
-      pci_release_regions (pci_dev);
-      pci_disable_device (pci_dev);
-      mutex_unlock (&dev_remove_mutex);
-      return -ENOMEM;
-    }
-  memset (aes_dev, 0, sizeof (aes128_dev));
-
-  spin_lock_init (&aes_dev->lock);
-  init_waitqueue_head (&aes_dev->command_queue);
-
-  INIT_LIST_HEAD (&aes_dev->task_list_head);
-  INIT_LIST_HEAD (&aes_dev->completed_list_head);
-  INIT_LIST_HEAD (&aes_dev->file_list_head);
-
-  aes_dev->pci_dev = pci_dev;
-  aes_dev->minor = minor;
-
   ioptr = pci_iomap (pci_dev, 0, 0);
   if (IS_ERR_OR_NULL (ioptr))
     {
       printk (KERN_WARNING "pci_iomap\n");
-      kfree (aes_dev);
       pci_release_regions (pci_dev);
       pci_disable_device (pci_dev);
-      mutex_unlock (&dev_remove_mutex);
       if (ioptr)
         return PTR_ERR (ioptr);
       else
         return -EIO;
     }
-  aes_dev->bar0 = ioptr;
 
   /* These are fail-safe.  */
-  pci_set_drvdata (pci_dev, aes_dev);
   pci_set_master (pci_dev);
 
   /* No cleanup needed for this function.  */
@@ -1176,13 +4381,7 @@ pci_probe (struct pci_dev *pci_dev, const struct pci_device_id * id)
   if (IS_ERR_VALUE (ret))
     {
       printk (KERN_WARNING "pci_set_dma_mask\n");
-      pci_clear_master (pci_dev);
-      pci_iounmap (pci_dev, ioptr);
-      kfree (aes_dev);
-      pci_release_regions (pci_dev);
-      pci_disable_device (pci_dev);
-      mutex_unlock (&dev_remove_mutex);
-      return ret;
+      goto err;
     }
 
   /* No cleanup needed for this function.  */
@@ -1190,115 +4389,44 @@ pci_probe (struct pci_dev *pci_dev, const struct pci_device_id * id)
   if (IS_ERR_VALUE (ret))
     {
       printk (KERN_WARNING "pci_set_consistent_dma_mask\n");
-      pci_clear_master (pci_dev);
-      pci_iounmap (pci_dev, ioptr);
-      kfree (aes_dev);
-      pci_release_regions (pci_dev);
-      pci_disable_device (pci_dev);
-      mutex_unlock (&dev_remove_mutex);
-      return ret;
-    }
-
-  ret = request_irq (pci_dev->irq, irq_handler, IRQF_SHARED, "aesdev", aes_dev);
-  if (IS_ERR_VALUE (ret))
-    {
-      printk (KERN_WARNING "request_irq\n");
-      pci_clear_master (pci_dev);
-      pci_iounmap (pci_dev, ioptr);
-      kfree (aes_dev);
-      pci_release_regions (pci_dev);
-      pci_disable_device (pci_dev);
-      mutex_unlock (&dev_remove_mutex);
-      return ret;
+      goto err;
     }
 
-  /* Init data transfer block.  */
-  iowrite32 (0x00000000, aes_dev->bar0 + AESDEV_XFER_IN_PTR);
-  iowrite32 (0x00000000, aes_dev->bar0 + AESDEV_XFER_OUT_PTR);
-  iowrite32 (0x00000000, aes_dev->bar0 + AESDEV_XFER_STATE_PTR);
-  iowrite32 (0x00000000, aes_dev->bar0 + AESDEV_XFER_TASK);
-
-  /* Init command buffer.  */
-  ret = cmd_buffer_init (aes_dev);
+  ret = aes_dev_add (&pci_dev->dev, ioptr, NULL, pci_dev->irq, &aes_dev);
   if (IS_ERR_VALUE (ret))
-    {
-      printk (KERN_WARNING "cmd_buffer_init\n");
-      free_irq (pci_dev->irq, aes_dev);
-      pci_clear_master (pci_dev);
-      pci_iounmap (pci_dev, ioptr);
-      kfree (aes_dev);
-      pci_release_regions (pci_dev);
-      pci_disable_device (pci_dev);
-      mutex_unlock (&dev_remove_mutex);
-      return ret;
-    }
-
-  /* Clear interrupts.  */
-  intr = ioread32 (aes_dev->bar0 + AESDEV_INTR);
-  iowrite32 (intr, aes_dev->bar0 + AESDEV_INTR);
-
-  /* Register device in driver.  */
-  aes_devs[minor] = aes_dev;
-
-  /* Do this at the very end. Since now, the device is available to user.  */
-  sys_dev = device_create (dev_class,
-                           NULL,
-                           MKDEV (major, minor),
-                           NULL,
-                           "aes%d",
-                           minor);
-  if (IS_ERR_OR_NULL (sys_dev))
-    {
-      printk (KERN_WARNING "device_create\n");
-      cmd_buffer_destroy (aes_dev);
-      free_irq (pci_dev->irq, aes_dev);
-      pci_clear_master (pci_dev);
-      pci_iounmap (pci_dev, ioptr);
-      kfree (aes_dev);
-      pci_release_regions (pci_dev);
-      pci_disable_device (pci_dev);
-      aes_devs[minor] = NULL;
-      mutex_unlock (&dev_remove_mutex);
-      if (sys_dev)
-        return PTR_ERR (sys_dev);
-      else
-        return -EIO;
-    }
-  aes_dev->sys_dev = sys_dev;
+    goto err;
+  pci_set_drvdata (pci_dev, aes_dev);
 
-  printk (KERN_WARNING "Registered new aesdev\n");
   DNOTIF_LEAVE_FUN;
-  mutex_unlock (&dev_remove_mutex);
   return 0;
+
+err:
+  pci_clear_master (pci_dev);
+  pci_iounmap (pci_dev, ioptr);
+  pci_release_regions (pci_dev);
+  pci_disable_device (pci_dev);
+  return ret;
 }
 
 static void
 pci_remove (struct pci_dev *pci_dev)
 {
   aes128_dev *aes_dev;
+  void __iomem *ioptr;
 
   DNOTIF_ENTER_FUN;
   might_sleep ();
 
   aes_dev = pci_get_drvdata (pci_dev);
+  ioptr = aes_dev->bar0;
+  aes_dev_del (aes_dev);
 
-  mutex_lock (&dev_remove_mutex);
-  aes_devs[aes_dev->minor] = NULL;
-  if (!list_empty (&aes_dev->file_list_head))
-    panic ("aesdev: Hot-unplug with open contexts not supported! Fatal.\n");
-  mutex_unlock (&dev_remove_mutex);
-
-  device_destroy (dev_class, MKDEV (major, aes_dev->minor));
-  free_irq (pci_dev->irq, aes_dev);
-  cmd_buffer_destroy (aes_dev);
   pci_clear_master (pci_dev);
-  pci_iounmap (pci_dev, aes_dev->bar0);
+  pci_iounmap (pci_dev, ioptr);
 
   pci_release_regions (pci_dev);
   pci_disable_device (pci_dev);
-  kfree (aes_dev);
 
-  printk (KERN_WARNING "Unregistered aesdev\n");
   DNOTIF_LEAVE_FUN;
 }
 
@@ -1312,7 +4440,344 @@ pci_shutdown (struct pci_dev *dev)
   AESDEV_STOP (aes_dev);
   DNOTIF_LEAVE_FUN;
 }
+/*****************************************************************************/
+
+/*** Software model handlers *************************************************/
+/* The model takes DMA addresses for physical ones (see aesdev_sim.c), so
+   DEV must be mapped directly: no IOMMU, and a test mapping gives the
+   physical address of the page.  */
+__must_check static int
+sim_check_dma (struct device *dev)
+{
+  struct page *page;
+  dma_addr_t addr;
+  int ret;
+
+  if (iommu_get_domain_for_dev (dev) != NULL)
+    return -ENODEV;
+
+  page = alloc_page (GFP_KERNEL | GFP_DMA32);
+  if (page == NULL)
+    return -ENOMEM;
+
+  addr = dma_map_page (dev, page, 0, PAGE_SIZE, DMA_BIDIRECTIONAL);
+  if (dma_mapping_error (dev, addr))
+    ret = -ENOMEM;
+  else
+    {
+      ret = addr == page_to_phys (page) ? 0 : -ENODEV;
+      dma_unmap_page (dev, addr, PAGE_SIZE, DMA_BIDIRECTIONAL);
+    }
+
+  __free_page (page);
+  return ret;
+}
+
+/* Devices of aesdev_sim.ko, see aesdev_sim.h.  They only differ from PCI
+   ones in how registers are reached.  */
+static int
+sim_probe (struct platform_device *pdev)
+{
+  const struct aesdev_sim_regs *sim;
+  aes128_dev *aes_dev;
+  int ret;
+
+  DNOTIF_ENTER_FUN;
+  might_sleep ();
+
+  sim = dev_get_platdata (&pdev->dev);
+  if (sim == NULL)
+    return -ENODEV;
+
+  ret = dma_set_mask_and_coherent (&pdev->dev, DMA_BIT_MASK (32));
+  if (IS_ERR_VALUE (ret))
+    {
+      printk (KERN_WARNING "dma_set_mask_and_coherent\n");
+      return ret;
+    }
+
+  ret = sim_check_dma (&pdev->dev);
+  if (IS_ERR_VALUE (ret))
+    {
+      printk (KERN_WARNING "aesdev_sim needs direct-mapped DMA\n");
+      return ret;
+    }
+
+  ret = aes_dev_add (&pdev->dev, NULL, sim, sim->irq, &aes_dev);
+  if (IS_ERR_VALUE (ret))
+    return ret;
+  platform_set_drvdata (pdev, aes_dev);
+
+  DNOTIF_LEAVE_FUN;
+  return 0;
+}
+
+static int
+sim_remove (struct platform_device *pdev)
+{
+  aes_dev_del (platform_get_drvdata (pdev));
+  return 0;
+}
+/*****************************************************************************/
+
+/*** Sysfs attributes ********************************************************/
+static void
+aes_dev_stats_sum (aes128_dev *aes_dev, aes128_dev_stats *sum)
+{
+  aes128_dev_stats *stats;
+  int cpu, mode;
+
+  memset (sum, 0, sizeof (*sum));
+  for_each_possible_cpu (cpu)
+    {
+      stats = per_cpu_ptr (aes_dev->stats, cpu);
+      sum->irqs += stats->irqs;
+      for (mode = 0; mode <= AESDEV_MODE_CTR; ++mode)
+        sum->bytes[mode] += stats->bytes[mode];
+      sum->cmd_wait_ns += stats->cmd_wait_ns;
+      sum->read_wait_ns += stats->read_wait_ns;
+      sum->write_wait_ns += stats->write_wait_ns;
+      sum->sw_bytes += stats->sw_bytes;
+    }
+}
+
+static ssize_t
+tasks_in_progress_show (struct device *dev, struct device_attribute *attr,
+                        char *buf)
+{
+  aes128_dev *aes_dev;
+
+  aes_dev = dev_get_drvdata (dev);
+  return sprintf (buf, "%zu\n", READ_ONCE (aes_dev->tasks_in_progress));
+}
+
+/* Sysfs wants one value per file, so every counter gets its own attribute.
+   Bytes done by sw_fallback are also counted in bytes_<mode>.  */
+#define AES_STAT_ATTR(_name, _expr)                                     \
+static ssize_t                                                          \
+_name##_show (struct device *dev, struct device_attribute *attr,        \
+              char *buf)                                                \
+{                                                                       \
+  aes128_dev_stats sum;                                                 \
+                                                                        \
+  aes_dev_stats_sum (dev_get_drvdata (dev), &sum);                      \
+  return sprintf (buf, "%llu\n", (unsigned long long) (_expr));         \
+}                                                                       \
+static DEVICE_ATTR_RO (_name)
+
+AES_STAT_ATTR (irqs, sum.irqs);
+AES_STAT_ATTR (bytes_ecb_encrypt, sum.bytes[AESDEV_MODE_ECB_ENCRYPT]);
+AES_STAT_ATTR (bytes_ecb_decrypt, sum.bytes[AESDEV_MODE_ECB_DECRYPT]);
+AES_STAT_ATTR (bytes_cbc_encrypt, sum.bytes[AESDEV_MODE_CBC_ENCRYPT]);
+AES_STAT_ATTR (bytes_cbc_decrypt, sum.bytes[AESDEV_MODE_CBC_DECRYPT]);
+AES_STAT_ATTR (bytes_cfb_encrypt, sum.bytes[AESDEV_MODE_CFB_ENCRYPT]);
+AES_STAT_ATTR (bytes_cfb_decrypt, sum.bytes[AESDEV_MODE_CFB_DECRYPT]);
+AES_STAT_ATTR (bytes_ofb, sum.bytes[AESDEV_MODE_OFB]);
+AES_STAT_ATTR (bytes_ctr, sum.bytes[AESDEV_MODE_CTR]);
+AES_STAT_ATTR (bytes_sw_fallback, sum.sw_bytes);
+AES_STAT_ATTR (cmd_wait_us, div_u64 (sum.cmd_wait_ns, NSEC_PER_USEC));
+AES_STAT_ATTR (read_wait_us, div_u64 (sum.read_wait_ns, NSEC_PER_USEC));
+AES_STAT_ATTR (write_wait_us, div_u64 (sum.write_wait_ns, NSEC_PER_USEC));
+
+static ssize_t
+commands_submitted_show (struct device *dev, struct device_attribute *attr,
+                         char *buf)
+{
+  aes128_dev *aes_dev;
+  unsigned long irq_flags;
+  uint64_t val;
+
+  aes_dev = dev_get_drvdata (dev);
+  spin_lock_irqsave (&aes_dev->lock, irq_flags);
+  val = aes_dev->commands_submitted;
+  spin_unlock_irqrestore (&aes_dev->lock, irq_flags);
+
+  return sprintf (buf, "%llu\n", (unsigned long long) val);
+}
+
+static ssize_t
+doorbells_show (struct device *dev, struct device_attribute *attr, char *buf)
+{
+  aes128_dev *aes_dev;
+  unsigned long irq_flags;
+  uint64_t val;
+
+  aes_dev = dev_get_drvdata (dev);
+  spin_lock_irqsave (&aes_dev->lock, irq_flags);
+  val = aes_dev->doorbells;
+  spin_unlock_irqrestore (&aes_dev->lock, irq_flags);
+
+  return sprintf (buf, "%llu\n", (unsigned long long) val);
+}
+
+static ssize_t
+cmd_slots_show (struct device *dev, struct device_attribute *attr, char *buf)
+{
+  aes128_dev *aes_dev;
+
+  aes_dev = dev_get_drvdata (dev);
+  return sprintf (buf, "%u\n", aes_dev->cmd_slots);
+}
+
+static ssize_t
+cmd_slots_store (struct device *dev, struct device_attribute *attr,
+                 const char *buf, size_t count)
+{
+  aes128_dev *aes_dev;
+  unsigned int slots;
+  int ret;
+
+  aes_dev = dev_get_drvdata (dev);
+
+  ret = kstrtouint (buf, 0, &slots);
+  if (ret != 0)
+    return ret;
+  if (slots < AESDRV_CMDBUFF_MIN_SLOTS || slots > AESDRV_CMDBUFF_MAX_SLOTS)
+    return -EINVAL;
+
+  ret = mutex_lock_interruptible (&dev_remove_mutex);
+  if (ret != 0)
+    return ret;
+
+  /* Command buffer can be replaced only when the device is stopped, that is
+     when no one has it opened.  Crypto API requests go to other devices or
+     to fallback in the meantime.  */
+  if (!list_empty (&aes_dev->file_list_head))
+    ret = -EBUSY;
+  else if (slots != aes_dev->cmd_slots)
+    {
+      aes_crypto_detach (aes_dev);
+      AESDEV_STOP (aes_dev);
+      ret = cmd_buffer_resize (aes_dev, slots);
+      aes_crypto_attach (aes_dev);
+    }
+
+  mutex_unlock (&dev_remove_mutex);
+
+  if (IS_ERR_VALUE (ret))
+    return ret;
+  return count;
+}
+
+static ssize_t
+poll_budget_us_show (struct device *dev, struct device_attribute *attr,
+                     char *buf)
+{
+  aes128_dev *aes_dev;
+
+  aes_dev = dev_get_drvdata (dev);
+  return sprintf (buf, "%u\n", READ_ONCE (aes_dev->poll_budget_us));
+}
+
+static ssize_t
+poll_budget_us_store (struct device *dev, struct device_attribute *attr,
+                      const char *buf, size_t count)
+{
+  aes128_dev *aes_dev;
+  unsigned int budget;
+  int ret;
+
+  aes_dev = dev_get_drvdata (dev);
+
+  ret = kstrtouint (buf, 0, &budget);
+  if (ret != 0)
+    return ret;
+  if (budget > AESDRV_POLL_MAX_BUDGET_US)
+    return -EINVAL;
+
+  WRITE_ONCE (aes_dev->poll_budget_us, budget);
+  return count;
+}
+
+static DEVICE_ATTR_RO (tasks_in_progress);
+static DEVICE_ATTR_RO (commands_submitted);
+static DEVICE_ATTR_RO (doorbells);
+static DEVICE_ATTR_RW (cmd_slots);
+static DEVICE_ATTR_RW (poll_budget_us);
+
+static struct attribute *aes_dev_attrs[] = {
+  &dev_attr_tasks_in_progress.attr,
+  &dev_attr_irqs.attr,
+  &dev_attr_bytes_ecb_encrypt.attr,
+  &dev_attr_bytes_ecb_decrypt.attr,
+  &dev_attr_bytes_cbc_encrypt.attr,
+  &dev_attr_bytes_cbc_decrypt.attr,
+  &dev_attr_bytes_cfb_encrypt.attr,
+  &dev_attr_bytes_cfb_decrypt.attr,
+  &dev_attr_bytes_ofb.attr,
+  &dev_attr_bytes_ctr.attr,
+  &dev_attr_bytes_sw_fallback.attr,
+  &dev_attr_cmd_wait_us.attr,
+  &dev_attr_read_wait_us.attr,
+  &dev_attr_write_wait_us.attr,
+  &dev_attr_commands_submitted.attr,
+  &dev_attr_doorbells.attr,
+  &dev_attr_cmd_slots.attr,
+  &dev_attr_poll_budget_us.attr,
+  NULL
+};
+
+/* /dev/aes is in the same class, but it is not a device by itself.  */
+static umode_t
+aes_dev_attr_visible (struct kobject *kobj, struct attribute *attr, int n)
+{
+  return dev_get_drvdata (kobj_to_dev (kobj)) != NULL ? attr->mode : 0;
+}
+
+static const struct attribute_group aes_dev_group = {
+  .attrs = aes_dev_attrs,
+  .is_visible = aes_dev_attr_visible,
+};
+static const struct attribute_group *aes_dev_groups[] = {
+  &aes_dev_group,
+  NULL
+};
+/*****************************************************************************/
+
+/*** Debugfs *****************************************************************/
+/* One line per open context of the device, to see who uses it.  Counters
+   are read without locks, they may be slightly off.  */
+static int
+aes_contexts_show (struct seq_file *m, void *v)
+{
+  aes128_dev *aes_dev = m->private;
+  aes128_context *context;
+  int ret;
+
+  ret = mutex_lock_interruptible (&dev_remove_mutex);
+  if (ret != 0)
+    return ret;
+
+  seq_puts (m, "pid comm mode buffer_size write_count to_encrypt_count "
+            "read_count bytes_written bytes_read read_wait_us "
+            "write_wait_us\n");
+  list_for_each_entry (context, &aes_dev->file_list_head, lf.file_list)
+  {
+    int mode = READ_ONCE (context->mode);
+
+    seq_printf (m, "%d %s %s %zu %zu %zu %zu %llu %llu %llu %llu\n",
+                context->pid, context->comm,
+                mode <= AESDEV_MODE_CTR ? aes_mode_names[mode] : "none",
+                context->buffer.size, acb_write_count (&context->buffer),
+                acb_to_encrypt_count (&context->buffer),
+                acb_read_count (&context->buffer),
+                (unsigned long long) context->bytes_written,
+                (unsigned long long) context->bytes_read,
+                (unsigned long long) div_u64 (context->read_wait_ns,
+                                              NSEC_PER_USEC),
+                (unsigned long long) div_u64 (context->write_wait_ns,
+                                              NSEC_PER_USEC));
+  }
+
+  mutex_unlock (&dev_remove_mutex);
+  return 0;
+}
 
+static int
+aes_contexts_open (struct inode *inode, struct file *f)
+{
+  return single_open (f, aes_contexts_show, inode->i_private);
+}
 /*****************************************************************************/
 
 static int
@@ -1321,11 +4786,17 @@ aesdrv_init (void)
   int ret;
   KDEBUG ("hello\n");
 
+  /* Before any device can take crypto API requests.  */
+  aes_crypto_wq = alloc_workqueue ("aesdev_crypto", 0, 0);
+  if (aes_crypto_wq == NULL)
+    return -ENOMEM;
+
   /* Register device major.  */
   major = register_chrdev (0, "aesdev", &aes_fops);
   if (IS_ERR_VALUE (major))
     {
       printk (KERN_WARNING "register_chrdev\n");
+      destroy_workqueue (aes_crypto_wq);
       return major;
     }
 
@@ -1340,6 +4811,14 @@ aesdrv_init (void)
         return -EIO;
     }
 
+  /* Attributes of every aes device.  */
+  dev_class->dev_groups = aes_dev_groups;
+
+  /* Statistics of contexts, optional.  */
+  aes_debugfs = debugfs_create_dir ("aesdev", NULL);
+  if (IS_ERR (aes_debugfs))
+    aes_debugfs = NULL;
+
   /* Register PCI driver.  */
   ret = pci_register_driver (&aes_pci);
   if (IS_ERR_VALUE (ret))
@@ -1348,6 +4827,24 @@ aesdrv_init (void)
       return ret;
     }
 
+  /* Devices of the software model, if aesdev_sim is loaded.  */
+  ret = platform_driver_register (&aes_sim_driver);
+  if (IS_ERR_VALUE (ret))
+    {
+      printk (KERN_WARNING "platform_driver_register\n");
+      pci_unregister_driver (&aes_pci);
+      return ret;
+    }
+
+  /* Node for applications that do not care which device they get.  */
+  any_dev = device_create (dev_class, NULL,
+                           MKDEV (major, AESDRV_ANY_DEV_MINOR), NULL, "aes");
+  if (IS_ERR_OR_NULL (any_dev))
+    {
+      printk (KERN_WARNING "device_create\n");
+      any_dev = NULL;
+    }
+
   return 0;
 }
 
@@ -1360,10 +4857,20 @@ aesdrv_cleanup (void)
   /* All devices will be stopped at this point, because all files have
      been closed.  */
 
+  /* No crypto API user can be left, they hold module reference.  */
+  aes_crypto_unregister ();
+
+  if (any_dev != NULL)
+    device_destroy (dev_class, MKDEV (major, AESDRV_ANY_DEV_MINOR));
+
   /* This will fire all PCI destructors.  */
   pci_unregister_driver (&aes_pci);
+  platform_driver_unregister (&aes_sim_driver);
+  /* Devices are gone, so no fallback can be queued any more.  */
+  destroy_workqueue (aes_crypto_wq);
   class_destroy (dev_class);
   unregister_chrdev (major, "aesdev");
+  debugfs_remove_recursive (aes_debugfs);
 
   DNOTIF_LEAVE_FUN;
 }
@@ -3,31 +3,57 @@
 
 #include "aesdev_ioctl.h"
 #include "aesdev_defines.h"
+#include "aesdev_sim.h"
 
 #include <linux/list.h>
 #include <linux/fs.h>
 #include <linux/pci.h>
+#include <linux/platform_device.h>
 #include <linux/circ_buf.h>
 #include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/uio.h>
+#include <linux/splice.h>
+#include <linux/eventfd.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/hrtimer.h>
+#include <linux/dmapool.h>
+#include <linux/workqueue.h>
+#include <crypto/aes.h>
+#include <crypto/internal/skcipher.h>
 
 struct aes128_combo_buffer; /* Buffer for read/write/encrypted data.  */
 struct aes128_block; /* 16 bytes of data, used for both state,
                                    data and keys.  */
 struct aes128_dev; /* Represents single aes device.  */
+struct aes128_dev_stats;
 struct aes128_context; /* Corresponds to single struct file.  */
 struct aes128_command; /* Represents one slot in dev's cmd buffer.  */
 struct aes128_task;
 struct dma_ptr;
 struct listed_file;
+struct aes128_user_map;
+struct aes128_async_req; /* Job of the asynchronous interface.  */
+struct aes128_crypto_alg; /* Crypto API algorithm backed by the device.  */
+struct aes128_crypto_ctx;
+struct aes128_crypto_req;
 
 typedef struct aes128_combo_buffer aes128_combo_buffer;
 typedef struct aes128_block aes128_block;
 typedef struct aes128_dev aes128_dev;
+typedef struct aes128_dev_stats aes128_dev_stats;
 typedef struct aes128_context aes128_context;
 typedef struct aes128_task aes128_task;
 typedef struct aes128_command aes128_command;
 typedef struct dma_ptr dma_ptr;
 typedef struct listed_file listed_file;
+typedef struct aes128_user_map aes128_user_map;
+typedef struct aes128_async_req aes128_async_req;
+typedef struct aes128_crypto_alg aes128_crypto_alg;
+typedef struct aes128_crypto_ctx aes128_crypto_ctx;
+typedef struct aes128_crypto_req aes128_crypto_req;
 
 typedef uint32_t aes_dma_addr_t; /* Aes device supports 32-bit addresses. */
 
@@ -40,31 +66,61 @@ struct dma_ptr
 
 struct aes128_combo_buffer
 {
+  /* Each position is moved by one side only: read_tail by the reader
+     (read_lock), to_encrypt_tail by the task maker (common_lock),
+     write_head by the writer (write_lock and common_lock).  */
   size_t read_tail; /* Start reading encrypted data here.  */
-  size_t write_tail; /* Stop reading encrypted data here.  */
   size_t to_encrypt_tail; /* Start making new task here.  */
   size_t write_head; /* Append new data here.  */
-  size_t read_count;
-  size_t write_count;
-  size_t to_encrypt_count;
+
+  /* Free-running byte counters, the counts are their differences (see
+     acb_read_count and friends).  Each is advanced by one side only and
+     published with smp_store_release after the data it covers is in
+     place, so the other side can find its space with smp_load_acquire,
+     without common_lock.  */
+  size_t written; /* Committed by writer, under common_lock.  */
+  size_t submitted; /* Made into tasks, under common_lock.  */
+  size_t completed; /* Encrypted and accounted in order, under
+                       aes_dev->lock of the context.  */
+  size_t consumed; /* Taken by reader, under read_lock.  */
+  bool write_pending; /* Writer copies data in at write_head, without
+                         common_lock.  Protected by common_lock.  */
+
+  size_t size; /* Size of data, multiple of PAGE_SIZE.  */
   dma_ptr data;
 
-  struct mutex read_lock; /* For read_tail and read_head.  */
-  struct mutex write_lock; /* For write_head.  */
-  struct mutex common_lock;
+  /* In out-of-place mode device writes encrypted data to out_data (of the
+     same size), so input space is free again as soon as it has been
+     encrypted.  Output of new tasks goes at out_head, encrypted data is
+     read from out_data at read_tail.  */
+  bool out_of_place;
+  dma_ptr out_data;
+  size_t out_head;
+
+  atomic_t mmap_count; /* How many times data is mapped by user.  */
+  struct aesdev_ring_info *info; /* Shared with user through mmap, allocated
+                                    on first mmap.  */
+
+  struct mutex read_lock; /* Reader side, for read_tail and consumed.  */
+  struct mutex write_lock; /* Writer side, for write_head.  */
+  struct mutex common_lock; /* Task making, mode and buffer changes.  */
 
   wait_queue_head_t read_queue;
   wait_queue_head_t write_queue;
 };
 
-static int acb_init (aes128_combo_buffer *buffer, aes128_dev *aes_dev);
+static int acb_init (aes128_combo_buffer *buffer, aes128_dev *aes_dev,
+                     size_t size);
 static void acb_destroy (aes128_combo_buffer *buffer, aes128_dev *aes_dev);
 static size_t acb_read_count (const aes128_combo_buffer *buffer);
 static size_t acb_write_count (const aes128_combo_buffer *buffer);
+static size_t acb_to_encrypt_count (const aes128_combo_buffer *buffer);
+static size_t acb_in_flight (const aes128_combo_buffer *buffer);
 static size_t acb_free (const aes128_combo_buffer *buffer);
-static size_t acb_free_to_end (const aes128_combo_buffer *buffer);
+static char *acb_out_ptr (const aes128_combo_buffer *buffer);
 static size_t
 acb_read_count_to_end (const aes128_combo_buffer *buffer);
+static void acb_publish (aes128_combo_buffer *buffer);
 
 struct aes128_block
 {
@@ -77,20 +133,55 @@ struct listed_file
   struct file *f;
 };
 
+/* Counters of a device, per CPU so that hot paths do not share cache
+   lines.  Summed up when read.  */
+struct aes128_dev_stats
+{
+  uint64_t irqs;
+  uint64_t bytes[AESDEV_MODE_CTR + 1]; /* Written to io buffers, per mode.  */
+  uint64_t cmd_wait_ns; /* Waiting for free command slots.  */
+  uint64_t read_wait_ns; /* Readers waiting for encrypted data.  */
+  uint64_t write_wait_ns; /* Writers waiting for free space.  */
+  uint64_t sw_bytes; /* Encrypted on the CPU, see sw_fallback.  */
+};
+
 struct aes128_dev
 {
   void __iomem *bar0;
+  const struct aesdev_sim_regs *sim; /* Software model, instead of bar0.  */
   struct device *sys_dev;
-  struct pci_dev *pci_dev;
+  struct device *dev; /* PCI or software model device, for DMA.  */
+  int irq;
 
   dma_ptr cmd_buffer;
+  unsigned int cmd_slots; /* Size of cmd_buffer.  */
+  size_t cmd_write_index; /* Shadow of AESDEV_CMD_WRITE_PTR.  */
 
   spinlock_t lock;
   wait_queue_head_t command_queue;
   size_t tasks_in_progress;
+  size_t reserved_slots; /* Promised to writers, but not filled yet.  */
+  unsigned int cmds_since_intr; /* Commands submitted since last one with
+                                   interrupt request.  */
+  struct hrtimer reap_timer; /* For commands without interrupt request.  */
+  unsigned int poll_budget_us; /* Busy-poll time for polling contexts.  */
+
+  /* Crypto API requests, protected by lock.  */
+  struct crypto_queue crypto_queue;
+  struct skcipher_request *crypto_pending; /* Prepared, waiting for space in
+                                              command buffer.  */
+  bool crypto_pumping; /* Someone is in aes_crypto_pump.  */
+  size_t crypto_requests; /* Accepted and not completed yet.  */
+  struct list_head crypto_list; /* On aes_crypto_devs.  */
+  struct dma_pool *ks_pool; /* Key and state of crypto API requests.  */
+
+  /* Statistics, protected by lock.  */
+  uint64_t commands_submitted;
+  uint64_t doorbells;
+  aes128_dev_stats __percpu *stats;
+  struct dentry *debugfs; /* Directory with per-context dump.  */
 
   struct list_head task_list_head;
-  struct list_head completed_list_head;
   struct list_head file_list_head;
 
   int minor;
@@ -103,17 +194,113 @@ struct aes128_context
   int mode;
   dma_ptr ks_buffer; /* Key and state.  */
   listed_file lf;
+  bool poll; /* Busy-poll for completions in blocking read.  */
+  bool split; /* ECB/CTR data is split over devices, see split_len.  */
+  size_t task_seq; /* Sequence number for the next task.  */
+  size_t next_seq; /* Sequence number of the next task to account.  */
+  struct list_head reorder_list; /* Completed, but some earlier task is
+                                    not.  Protected by aes_dev->lock.  */
+  size_t hw_tasks; /* Tasks with key and state in ks_buffer on the
+                      device.  Protected by aes_dev->lock.  */
+  struct crypto_skcipher *sw_tfm; /* For sw_fallback, of mode sw_mode.
+                                     Protected by common_lock.  */
+  int sw_mode;
+
+  /* For debugfs, counters protected by common_lock, except bytes_read and
+     read_wait_ns, which belong to the reader (read_lock).  */
+  pid_t pid; /* Who opened the file.  */
+  char comm[TASK_COMM_LEN];
+  uint64_t bytes_written;
+  uint64_t bytes_read;
+  uint64_t read_wait_ns;
+  uint64_t write_wait_ns;
+
+  /* Asynchronous jobs, protected by aes_dev->lock.  */
+  struct list_head async_done; /* Completed, not reaped yet.  */
+  size_t async_inflight; /* Submitted, not completed yet.  */
+  size_t async_jobs; /* Submitted, not reaped yet.  */
+  struct eventfd_ctx *async_eventfd; /* Signalled on completion.  */
 };
 
 /* Complete set of information for one command.  */
 struct aes128_task
 {
-  dma_ptr inout_buffer;
+  dma_ptr inout_buffer; /* Input, and output unless out_ptr differs.  */
+  aes_dma_addr_t out_ptr;
+  aes_dma_addr_t ks_ptr;
+  dma_ptr ks_slot; /* Own key and state, from ks_pool of the device the
+                      task runs on.  */
+  int mode;
   size_t block_count;
-  aes128_context *context;
+  aes128_context *context; /* NULL for crypto API tasks.  */
+  size_t seq; /* Order of tasks of a context.  */
   int cmd_index;
   struct list_head task_list;
   aes_dma_addr_t write_ptr;
+  bool intr; /* Device will interrupt after this task.  */
+
+  /* Called after completion of a task with no context, outside of
+     spinlock.  */
+  void (*complete) (aes128_task *task);
+  void *data;
+};
+
+/* From ASYNC_SUBMIT until ASYNC_REAP.  */
+struct aes128_async_req
+{
+  struct list_head list; /* On context's async_done.  */
+  aes128_context *context;
+  uint64_t user_data;
+  uint64_t out; /* User address for the result.  */
+  uint32_t len;
+  char *bounce;
+  dma_addr_t bounce_dma;
+  dma_ptr ks_buffer; /* Key and state, from aes_dev->ks_pool.  */
+};
+
+/* Pinned and DMA-mapped piece of user memory.  */
+struct aes128_user_map
+{
+  struct page **pages;
+  int page_count;
+  struct sg_table sgt;
+  enum dma_data_direction dir;
+};
+
+struct aes128_crypto_alg
+{
+  struct skcipher_alg alg;
+  int enc_mode;
+  int dec_mode;
+};
+
+/* Transform context, one per crypto API user.  */
+struct aes128_crypto_ctx
+{
+  uint8_t key[AES_MAX_KEY_SIZE];
+  unsigned int key_len;
+  int enc_mode;
+  int dec_mode;
+  struct crypto_skcipher *fallback; /* For keys the device cannot do.  */
+};
+
+/* State of single crypto API request.  */
+struct aes128_crypto_req
+{
+  aes128_dev *aes_dev;
+  int mode;
+  dma_ptr ks_buffer; /* Key and state, from aes_dev->ks_pool.  */
+  int src_nents;
+  int dst_nents;
+  char *bounce; /* Used when scatterlists cannot be mapped directly.  */
+  dma_addr_t bounce_dma;
+  size_t bounce_len;
+  struct list_head tasks; /* Prepared, not submitted yet.  */
+  size_t task_count;
+  struct work_struct fallback_work; /* See aes_crypto_fallback.  */
+  struct skcipher_request *req; /* Owner, for fallback_work.  */
+
+  struct skcipher_request fallback_req; /* Must be the last one.  */
 };
 
 /* This is to reflect single entry in CMD block */
@@ -130,15 +317,43 @@ static int aesdrv_init (void);
 static void aesdrv_cleanup (void);
 
 /* File operations */
-static ssize_t file_read (struct file *, char __user *, size_t, loff_t *);
-static ssize_t file_write (struct file *, const char __user *, size_t, loff_t *);
+static ssize_t file_read_iter (struct kiocb *, struct iov_iter *);
+static ssize_t file_write_iter (struct kiocb *, struct iov_iter *);
+static unsigned int file_poll (struct file *, poll_table *);
 static int file_open (struct inode *, struct file *);
 static int file_release (struct inode *, struct file *);
 static long file_ioctl (struct file *f, unsigned int cmd, unsigned long arg);
+static int file_mmap (struct file *f, struct vm_area_struct *vma);
+
+/* Memory mapping operations */
+static void data_vm_open (struct vm_area_struct *vma);
+static void data_vm_close (struct vm_area_struct *vma);
+
+/* Software fallback */
+static int aes_sw_run_task (aes128_dev *aes_dev, aes128_task *task);
+
+/* Debugfs */
+static int aes_contexts_open (struct inode *inode, struct file *f);
+
+/* Crypto API */
+static aes128_dev *aes_crypto_get_dev (aes128_dev *near);
+static void aes_crypto_put_dev (aes128_dev *aes_dev);
+static void aes_crypto_pump (aes128_dev *aes_dev);
+static int aes_skcipher_fallback (struct skcipher_request *req, bool encrypt);
+static int aes_skcipher_encrypt (struct skcipher_request *req);
+static int aes_skcipher_decrypt (struct skcipher_request *req);
+static int aes_skcipher_setkey (struct crypto_skcipher *tfm, const u8 *key,
+                                unsigned int key_len);
+static int aes_skcipher_init (struct crypto_skcipher *tfm);
+static void aes_skcipher_exit (struct crypto_skcipher *tfm);
 
 /* PCI operations */
 static int pci_probe (struct pci_dev *dev, const struct pci_device_id *id);
 static void pci_remove (struct pci_dev *dev);
 static void pci_shutdown (struct pci_dev *dev);
 
+/* Software model operations */
+static int sim_probe (struct platform_device *pdev);
+static int sim_remove (struct platform_device *pdev);
+
 #endif /* _AESDEV_H */
\ No newline at end of file
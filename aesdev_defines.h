@@ -52,22 +52,56 @@
 #define AESDEV_BLOCK_XFER 0x40
 #define AESDEV_BLOCK_CMD 0x50
 
-#define AESDRV_IOBUFF_SIZE (0x100 * sizeof (aes128_block))
-#define AESDRV_CMDBUFF_SLOTS (0x40)
-#define AESDRV_CMDBUFF_SIZE (AESDRV_CMDBUFF_SLOTS * sizeof (aes128_command))
+#define AESDRV_IOBUFF_DEFAULT_SIZE (0x100 * sizeof (aes128_block))
+/* Whole buffer must fit in a single command (20-bit block count).  */
+#define AESDRV_IOBUFF_MAX_SIZE (0x80000 * sizeof (aes128_block))
+#define AESDRV_CMDBUFF_DEFAULT_SLOTS (0x40)
+#define AESDRV_CMDBUFF_MIN_SLOTS (0x04)
+#define AESDRV_CMDBUFF_MAX_SLOTS (0x1000)
+#define AESDRV_CMDBUFF_SIZE(slots) ((slots) * sizeof (aes128_command))
 #define AESDRV_MAX_DEV_COUNT 0xFF
+/* Minor of /dev/aes, which opens contexts on the least loaded device.  */
+#define AESDRV_ANY_DEV_MINOR AESDRV_MAX_DEV_COUNT
+/* ECB and CTR data is cut in pieces of this size, which run in parallel on
+   all devices.  */
+#define AESDRV_SPLIT_DEFAULT_LEN (0x10 * PAGE_SIZE)
+#define AESDRV_POLL_DEFAULT_BUDGET_US (20)
+#define AESDRV_POLL_MAX_BUDGET_US (1000)
+/* AESDEV_IOCTL_CRYPT requests are done in chunks of at most this size,
+   shorter ones are copied instead of pinning user pages.  */
+#define AESDRV_DIRECT_CHUNK (0x400 * PAGE_SIZE)
+#define AESDRV_DIRECT_MIN_LEN (4 * PAGE_SIZE)
+/* Unaligned parts of them are copied in pieces of at most this size, so the
+   kernel buffer stays small whatever the chunk is.  */
+#define AESDRV_BOUNCE_LEN (4 * PAGE_SIZE)
+/* Limits of single AESDEV_IOCTL_BATCH call, data is copied through one
+   kernel buffer.  */
+#define AESDRV_BATCH_MAX_JOBS (0x400)
+#define AESDRV_BATCH_MAX_LEN (0x40 * PAGE_SIZE)
+/* Limits of the asynchronous interface, per context (jobs submitted and
+   not reaped yet) and per job.  */
+#define AESDRV_ASYNC_MAX_INFLIGHT (0x400)
+#define AESDRV_ASYNC_MAX_LEN (0x40 * PAGE_SIZE)
+#define AESDRV_CRYPTO_PRIORITY (300)
+#define AESDRV_CRYPTO_QUEUE_LEN (0x100)
+/* Longer crypto API requests go to software fallback.  */
+#define AESDRV_CRYPTO_MAX_LEN AESDRV_IOBUFF_MAX_SIZE
+/* Requests with unaligned scatterlists are copied through a buffer
+   allocated with GFP_ATOMIC, so it must stay small.  Longer ones go to
+   software fallback too.  */
+#define AESDRV_CRYPTO_MAX_BOUNCE (8 * PAGE_SIZE)
 
 #define AESDEV_STOP(aes_dev) do\
   {\
-    iowrite32(0x00000000, aes_dev->bar0);\
-    iowrite32(0x00000000, aes_dev->bar0 + AESDEV_INTR_ENABLE);\
+    aes_reg_write(aes_dev, 0x00000000, AESDEV_ENABLE);\
+    aes_reg_write(aes_dev, 0x00000000, AESDEV_INTR_ENABLE);\
   }\
   while (0)
 
 #define AESDEV_START(aes_dev) do\
   {\
-    iowrite32(AESDEV_ENABLE_FETCH_CMD | AESDEV_ENABLE_XFER_DATA, aes_dev->bar0);\
-    iowrite32(0x000000FF, aes_dev->bar0 + AESDEV_INTR_ENABLE);\
+    aes_reg_write(aes_dev, AESDEV_ENABLE_FETCH_CMD | AESDEV_ENABLE_XFER_DATA, AESDEV_ENABLE);\
+    aes_reg_write(aes_dev, 0x000000FF, AESDEV_INTR_ENABLE);\
   }\
   while (0)
 
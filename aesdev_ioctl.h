@@ -19,6 +19,95 @@ struct aesdev_ioctl_set_iv {
 struct aesdev_ioctl_get_state {
   uint8_t state[0x10];
 };
+
+/* Zero-copy interface.  The io buffer of a context can be mapped at
+   AESDEV_RING_DATA_OFFSET and the current buffer state (read only, refreshed
+   by every call on the context) at AESDEV_RING_INFO_OFFSET.  User puts data
+   at write_head and calls RING_SUBMIT with its length, then takes encrypted
+   data at read_tail and calls RING_CONSUME.  All offsets wrap at size.
+   RING_SUBMIT fails with EBUSY while write copies data in, RING_CONSUME
+   while read is in progress on the context.  */
+struct aesdev_ring_info {
+  uint32_t size;
+  uint32_t write_head;
+  uint32_t write_free;
+  uint32_t read_tail;
+  uint32_t read_count;
+};
+/* Encrypt LEN bytes (whole blocks) at IN and put them at OUT (may be the
+   same), with current mode and state of the context, bypassing the io
+   buffer.  Large requests with 16-byte aligned IN and OUT are transferred
+   by the device directly from and to user memory.  No partial block may
+   be waiting in the io buffer.  */
+struct aesdev_ioctl_crypt {
+  uint64_t in;
+  uint64_t out;
+  uint32_t len;
+  uint32_t flags; /* Must be 0.  */
+};
+
+/* One job of AESDEV_IOCTL_BATCH: encrypt LEN bytes (whole blocks) at IN
+   and put them at OUT, with its own MODE (one of AESDEV_BATCH_*), KEY and
+   IV.  Afterwards IV holds the state to continue the stream with (unless
+   the mode is ECB).  */
+struct aesdev_batch_job {
+  uint32_t mode;
+  uint32_t len;
+  uint64_t in;
+  uint64_t out;
+  uint8_t key[0x10];
+  uint8_t iv[0x10];
+};
+/* Array of COUNT jobs at JOBS, done in one call without touching mode and
+   state of the context.  */
+struct aesdev_ioctl_batch {
+  uint64_t jobs;
+  uint32_t count;
+  uint32_t flags; /* Must be 0.  */
+};
+
+/* Asynchronous interface.  ASYNC_SUBMIT queues COUNT jobs from ENTRIES
+   (array of aesdev_async_job) and returns at once, with COUNT set to the
+   number of jobs accepted.  ASYNC_REAP fills ENTRIES (array of
+   aesdev_async_completion) with at most COUNT completed jobs, copying
+   their results to OUT on the way, so it has to be called by the
+   submitting process.  With AESDEV_ASYNC_WAIT it sleeps until at least one
+   job is done (or none is in flight).  Completions are signalled on the
+   eventfd set with SET_EVENTFD.  Jobs count against the per-context limit
+   until they are reaped; ASYNC_SUBMIT fails with EAGAIN when it is
+   reached.  */
+struct aesdev_async_job {
+  struct aesdev_batch_job job;
+  uint64_t user_data;
+};
+struct aesdev_async_completion {
+  uint64_t user_data;
+  int32_t result; /* 0 or negative errno.  */
+  uint32_t reserved;
+  uint8_t iv[0x10]; /* State to continue the stream with, as in
+                       aesdev_batch_job (unless the mode is ECB).  */
+};
+struct aesdev_ioctl_async {
+  uint64_t entries;
+  uint32_t count;
+  uint32_t flags;
+};
+
+#define AESDEV_ASYNC_WAIT            0x1
+
+#define AESDEV_BATCH_ECB_ENCRYPT     0
+#define AESDEV_BATCH_ECB_DECRYPT     1
+#define AESDEV_BATCH_CBC_ENCRYPT     2
+#define AESDEV_BATCH_CBC_DECRYPT     3
+#define AESDEV_BATCH_CFB_ENCRYPT     4
+#define AESDEV_BATCH_CFB_DECRYPT     5
+#define AESDEV_BATCH_OFB             6
+#define AESDEV_BATCH_CTR             7
+
+#define AESDEV_RING_INFO_OFFSET      0x00000
+#define AESDEV_RING_DATA_OFFSET      0x10000
+/* Encrypted data in out-of-place mode, read_tail refers to this area.  */
+#define AESDEV_RING_OUT_OFFSET       0x20000
 #define AESDEV_IOCTL_SET_ECB_ENCRYPT _IOW('C', 0x00, struct aesdev_ioctl_set_ecb)
 #define AESDEV_IOCTL_SET_ECB_DECRYPT _IOW('C', 0x01, struct aesdev_ioctl_set_ecb)
 #define AESDEV_IOCTL_SET_CBC_ENCRYPT _IOW('C', 0x02, struct aesdev_ioctl_set_iv)
@@ -28,5 +117,26 @@ struct aesdev_ioctl_get_state {
 #define AESDEV_IOCTL_SET_OFB         _IOW('C', 0x06, struct aesdev_ioctl_set_iv)
 #define AESDEV_IOCTL_SET_CTR         _IOW('C', 0x07, struct aesdev_ioctl_set_iv)
 #define AESDEV_IOCTL_GET_STATE       _IOR('C', 0x08, struct aesdev_ioctl_get_state)
+#define AESDEV_IOCTL_RING_SUBMIT     _IOW('C', 0x09, uint32_t)
+#define AESDEV_IOCTL_RING_CONSUME    _IOW('C', 0x0a, uint32_t)
+/* Set io buffer size in bytes (only with empty, unmapped buffer).  Size is
+   rounded up to whole pages and clamped; actual size is returned.  */
+#define AESDEV_IOCTL_SET_BUFFER_SIZE _IOWR('C', 0x0b, uint32_t)
+/* Nonzero makes blocking reads busy-poll the device for a while (see
+   poll_budget_us in sysfs) before going to sleep.  For small requests
+   where interrupt and wakeup latency dominates.  */
+#define AESDEV_IOCTL_SET_POLL        _IOW('C', 0x0c, uint32_t)
+#define AESDEV_IOCTL_CRYPT           _IOW('C', 0x0d, struct aesdev_ioctl_crypt)
+/* Nonzero makes the device write encrypted data to a separate output buffer
+   (out-of-place), so that writers do not wait for readers to free the
+   space.  Only with empty, unmapped buffer.  */
+#define AESDEV_IOCTL_SET_OUT_OF_PLACE _IOW('C', 0x0e, uint32_t)
+/* At most 0x400 jobs and 256 KiB of data in total per call.  */
+#define AESDEV_IOCTL_BATCH           _IOW('C', 0x0f, struct aesdev_ioctl_batch)
+/* Eventfd to signal async completions on, negative to stop signalling.  */
+#define AESDEV_IOCTL_SET_EVENTFD     _IOW('C', 0x10, int32_t)
+/* At most 0x400 jobs in flight per context, 256 KiB each.  */
+#define AESDEV_IOCTL_ASYNC_SUBMIT    _IOWR('C', 0x11, struct aesdev_ioctl_async)
+#define AESDEV_IOCTL_ASYNC_REAP      _IOWR('C', 0x12, struct aesdev_ioctl_async)
 
 #endif
@@ -0,0 +1,615 @@
+/* ZSO 2014/2015 Zadanie 2
+   Software model of the aes device, to run the driver without hardware.
+
+   Every model has the register block of aesdev_defines.h (control,
+   interrupts, data transfer block and command block, all eight modes with
+   state save) and executes commands in a kernel thread, with software AES
+   from the crypto API.  Devices show up as platform devices, see
+   aesdev_sim.h, and aesdev binds them like PCI ones:
+
+     insmod aesdev_sim.ko devices=2 block_ns=20 cmd_ns=2000
+     insmod aesdev.ko
+
+   DMA addresses given to the model are taken as physical addresses.  That
+   holds only with direct-mapped DMA (no IOMMU, no DMA offset), so aesdev
+   refuses to bind the devices otherwise, see sim_check_dma.  Bounce
+   buffers of swiotlb are fine, their DMA addresses are physical too.  */
+
+#include "aesdev_sim.h"
+#include "aesdev_defines.h"
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/platform_device.h>
+#include <linux/dma-mapping.h>
+#include <linux/kthread.h>
+#include <linux/interrupt.h>
+#include <linux/irq.h>
+#include <linux/highmem.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/crypto.h>
+#include <asm/unaligned.h>
+
+MODULE_LICENSE ("GPL");
+
+#define AESSIM_MAX_DEVICES (8)
+
+static unsigned int devices = 1;
+module_param (devices, uint, S_IRUGO);
+MODULE_PARM_DESC (devices, "Number of simulated devices");
+
+/* Time the model takes for a command of N blocks is cmd_ns + N * block_ns,
+   or as long as software AES takes, whichever is longer.  */
+static unsigned int block_ns;
+module_param (block_ns, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC (block_ns, "Simulated time per block in ns");
+static unsigned int cmd_ns;
+module_param (cmd_ns, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC (cmd_ns, "Simulated time per command in ns");
+
+struct aes_sim
+{
+  /* Registers, protected by lock.  */
+  spinlock_t lock;
+  uint32_t enable;
+  uint32_t intr;
+  uint32_t intr_enable;
+  uint32_t xfer_in;
+  uint32_t xfer_out;
+  uint32_t xfer_state;
+  uint32_t xfer_task;
+  uint32_t cmd_begin;
+  uint32_t cmd_end;
+  uint32_t cmd_read;
+  uint32_t cmd_write;
+  uint8_t op[AESDEV_BLOCK_XFER - AESDEV_BLOCK_OP]; /* Key, data and state of
+                                                     the last block.  */
+  bool xfer_busy; /* Task of transfer block is being executed.  */
+  bool cmd_busy; /* Fetched command is being executed.  */
+  bool irq_raised; /* Nothing new in intr since last interrupt.  */
+
+  struct aesdev_sim_regs regs;
+  struct platform_device *pdev;
+  struct task_struct *thread;
+  wait_queue_head_t wait;
+  struct crypto_cipher *tfm;
+  char *scratch; /* One page of data being encrypted.  */
+  int irq;
+};
+
+static struct aes_sim *sims[AESSIM_MAX_DEVICES];
+
+/*** Registers ***************************************************************/
+static uint32_t
+sim_reg_read (void *data, unsigned int reg)
+{
+  struct aes_sim *sim = data;
+  unsigned long flags;
+  uint32_t val;
+
+  spin_lock_irqsave (&sim->lock, flags);
+  switch (reg)
+    {
+    case AESDEV_ENABLE:
+      val = sim->enable;
+      break;
+    case AESDEV_STATUS:
+      val = 0;
+      if (sim->xfer_busy || ((sim->enable & AESDEV_ENABLE_XFER_DATA)
+                             && AESDEV_TASK_ACTIVE (sim->xfer_task)))
+        val |= AESDEV_STATUS_XFER_DATA;
+      if (sim->cmd_busy || ((sim->enable & AESDEV_ENABLE_FETCH_CMD)
+                            && sim->cmd_read != sim->cmd_write))
+        val |= AESDEV_STATUS_FETCH_CMD;
+      break;
+    case AESDEV_INTR:
+      val = sim->intr;
+      break;
+    case AESDEV_INTR_ENABLE:
+      val = sim->intr_enable;
+      break;
+    case AESDEV_XFER_IN_PTR:
+      val = sim->xfer_in;
+      break;
+    case AESDEV_XFER_OUT_PTR:
+      val = sim->xfer_out;
+      break;
+    case AESDEV_XFER_STATE_PTR:
+      val = sim->xfer_state;
+      break;
+    case AESDEV_XFER_TASK:
+      val = sim->xfer_task;
+      break;
+    case AESDEV_CMD_BEGIN_PTR:
+      val = sim->cmd_begin;
+      break;
+    case AESDEV_CMD_END_PTR:
+      val = sim->cmd_end;
+      break;
+    case AESDEV_CMD_READ_PTR:
+      val = sim->cmd_read;
+      break;
+    case AESDEV_CMD_WRITE_PTR:
+      val = sim->cmd_write;
+      break;
+    default:
+      if (reg >= AESDEV_BLOCK_OP && reg + 4 <= AESDEV_BLOCK_XFER)
+        val = get_unaligned_le32 (sim->op + reg - AESDEV_BLOCK_OP);
+      else
+        val = 0;
+      break;
+    }
+  spin_unlock_irqrestore (&sim->lock, flags);
+
+  return val;
+}
+
+static void
+sim_reg_write (void *data, uint32_t val, unsigned int reg)
+{
+  struct aes_sim *sim = data;
+  unsigned long flags;
+
+  spin_lock_irqsave (&sim->lock, flags);
+  switch (reg)
+    {
+    case AESDEV_ENABLE:
+      sim->enable = val & (AESDEV_ENABLE_XFER_DATA | AESDEV_ENABLE_FETCH_CMD);
+      break;
+    case AESDEV_INTR:
+      /* Writing ones acknowledges interrupts.  */
+      sim->intr &= ~val;
+      sim->irq_raised = false;
+      break;
+    case AESDEV_INTR_ENABLE:
+      sim->intr_enable = val & 0xff;
+      sim->irq_raised = false;
+      break;
+    case AESDEV_XFER_IN_PTR:
+      sim->xfer_in = val;
+      break;
+    case AESDEV_XFER_OUT_PTR:
+      sim->xfer_out = val;
+      break;
+    case AESDEV_XFER_STATE_PTR:
+      sim->xfer_state = val;
+      break;
+    case AESDEV_XFER_TASK:
+      sim->xfer_task = val;
+      break;
+    case AESDEV_CMD_BEGIN_PTR:
+      sim->cmd_begin = val;
+      break;
+    case AESDEV_CMD_END_PTR:
+      sim->cmd_end = val;
+      break;
+    case AESDEV_CMD_READ_PTR:
+      sim->cmd_read = val;
+      break;
+    case AESDEV_CMD_WRITE_PTR:
+      sim->cmd_write = val;
+      break;
+    default:
+      /* Key, data and state are only for looking.  */
+      break;
+    }
+  spin_unlock_irqrestore (&sim->lock, flags);
+
+  wake_up (&sim->wait);
+}
+/*****************************************************************************/
+
+/*** Engine ******************************************************************/
+/* Copy LEN bytes between BUF and memory at device address ADDR.  */
+static void
+sim_dma_copy (dma_addr_t addr, void *buf, size_t len, bool to_device)
+{
+  size_t offset, now;
+  char *page;
+
+  while (len > 0)
+    {
+      offset = offset_in_page (addr);
+      now = min (len, (size_t) PAGE_SIZE - offset);
+
+      page = kmap_atomic (pfn_to_page (addr >> PAGE_SHIFT));
+      if (to_device)
+        memcpy (page + offset, buf, now);
+      else
+        memcpy (buf, page + offset, now);
+      kunmap_atomic (page);
+
+      addr += now;
+      buf = (char *) buf + now;
+      len -= now;
+    }
+}
+
+static void
+sim_xor (uint8_t *dst, const uint8_t *src)
+{
+  int i;
+
+  for (i = 0; i < AESDEV_AES_BLOCK_SIZE; ++i)
+    dst[i] ^= src[i];
+}
+
+/* Big-endian 128-bit increment, as the device does in CTR mode.  */
+static void
+sim_ctr_inc (uint8_t *ctr)
+{
+  int i;
+
+  for (i = AESDEV_AES_BLOCK_SIZE - 1; i >= 0; --i)
+    if (++ctr[i] != 0)
+      break;
+}
+
+/* Encrypt one block in place with STATE, in MODE.  */
+static void
+sim_block (struct aes_sim *sim, int mode, uint8_t *block, uint8_t *state)
+{
+  uint8_t tmp[AESDEV_AES_BLOCK_SIZE];
+
+  switch (mode)
+    {
+    case AESDEV_MODE_ECB_ENCRYPT:
+      crypto_cipher_encrypt_one (sim->tfm, block, block);
+      break;
+    case AESDEV_MODE_ECB_DECRYPT:
+      crypto_cipher_decrypt_one (sim->tfm, block, block);
+      break;
+    case AESDEV_MODE_CBC_ENCRYPT:
+      sim_xor (block, state);
+      crypto_cipher_encrypt_one (sim->tfm, block, block);
+      memcpy (state, block, AESDEV_AES_BLOCK_SIZE);
+      break;
+    case AESDEV_MODE_CBC_DECRYPT:
+      memcpy (tmp, block, AESDEV_AES_BLOCK_SIZE);
+      crypto_cipher_decrypt_one (sim->tfm, block, block);
+      sim_xor (block, state);
+      memcpy (state, tmp, AESDEV_AES_BLOCK_SIZE);
+      break;
+    case AESDEV_MODE_CFB_ENCRYPT:
+      crypto_cipher_encrypt_one (sim->tfm, tmp, state);
+      sim_xor (block, tmp);
+      memcpy (state, block, AESDEV_AES_BLOCK_SIZE);
+      break;
+    case AESDEV_MODE_CFB_DECRYPT:
+      crypto_cipher_encrypt_one (sim->tfm, tmp, state);
+      memcpy (state, block, AESDEV_AES_BLOCK_SIZE);
+      sim_xor (block, tmp);
+      break;
+    case AESDEV_MODE_OFB:
+      crypto_cipher_encrypt_one (sim->tfm, state, state);
+      sim_xor (block, state);
+      break;
+    case AESDEV_MODE_CTR:
+      crypto_cipher_encrypt_one (sim->tfm, tmp, state);
+      sim_xor (block, tmp);
+      sim_ctr_inc (state);
+      break;
+    }
+}
+
+/* Execute task TASK (in AESDEV_TASK format) on data at IN, putting result
+   at OUT, with key and state at KS.  Takes the simulated time.  */
+static void
+sim_execute (struct aes_sim *sim, uint32_t in, uint32_t out, uint32_t ks,
+             uint32_t task)
+{
+  uint8_t key_state[2 * AESDEV_AES_BLOCK_SIZE];
+  uint8_t *state = key_state + AESDEV_AES_BLOCK_SIZE;
+  size_t len, done, now, i;
+  unsigned long flags;
+  ktime_t end;
+  int mode;
+
+  mode = AESDEV_TASK_MODE (task);
+  len = AESDEV_TASK_COUNT (task) * AESDEV_AES_BLOCK_SIZE;
+  end = ktime_add_ns (ktime_get (), READ_ONCE (cmd_ns)
+                      + (u64) READ_ONCE (block_ns) * AESDEV_TASK_COUNT (task));
+
+  sim_dma_copy (ks, key_state, sizeof (key_state), false);
+  crypto_cipher_setkey (sim->tfm, key_state, AESDEV_AES_KEY_SIZE);
+
+  now = 0;
+  for (done = 0; done < len; done += now)
+    {
+      now = min (len - done, (size_t) PAGE_SIZE);
+      sim_dma_copy (in + done, sim->scratch, now, false);
+      for (i = 0; i < now; i += AESDEV_AES_BLOCK_SIZE)
+        sim_block (sim, mode, (uint8_t *) sim->scratch + i, state);
+      sim_dma_copy (out + done, sim->scratch, now, true);
+      cond_resched ();
+    }
+
+  if (AESDEV_TASK_SAVE (task))
+    sim_dma_copy (ks + AESDEV_AES_BLOCK_SIZE, state, AESDEV_AES_BLOCK_SIZE,
+                  true);
+
+  spin_lock_irqsave (&sim->lock, flags);
+  memcpy (sim->op + AESDEV_AES_KEY (0) - AESDEV_BLOCK_OP, key_state,
+          AESDEV_AES_KEY_SIZE);
+  if (len > 0)
+    memcpy (sim->op + AESDEV_AES_DATA (0) - AESDEV_BLOCK_OP,
+            sim->scratch + now - AESDEV_AES_BLOCK_SIZE,
+            AESDEV_AES_BLOCK_SIZE);
+  memcpy (sim->op + AESDEV_AES_STATE (0) - AESDEV_BLOCK_OP, state,
+          AESDEV_AES_BLOCK_SIZE);
+  spin_unlock_irqrestore (&sim->lock, flags);
+
+  /* Device is slower than software AES.  */
+  if (ktime_before (ktime_get (), end))
+    {
+      u64 left = ktime_to_ns (ktime_sub (end, ktime_get ()));
+
+      if (left < 10 * NSEC_PER_USEC)
+        ndelay (left);
+      else
+        usleep_range (left / NSEC_PER_USEC, left / NSEC_PER_USEC + 1);
+    }
+}
+
+/* Run the task of data transfer block, if there is one.  */
+static void
+sim_run_xfer (struct aes_sim *sim)
+{
+  uint32_t in, out, ks, task;
+  unsigned long flags;
+
+  spin_lock_irqsave (&sim->lock, flags);
+  if (!(sim->enable & AESDEV_ENABLE_XFER_DATA)
+      || !AESDEV_TASK_ACTIVE (sim->xfer_task))
+    {
+      spin_unlock_irqrestore (&sim->lock, flags);
+      return;
+    }
+  in = sim->xfer_in;
+  out = sim->xfer_out;
+  ks = sim->xfer_state;
+  task = sim->xfer_task;
+  sim->xfer_busy = true;
+  spin_unlock_irqrestore (&sim->lock, flags);
+
+  sim_execute (sim, in, out, ks, task);
+
+  /* Pointers are left after the data and the task is done, as the device
+     leaves them.  */
+  spin_lock_irqsave (&sim->lock, flags);
+  sim->xfer_in = in + AESDEV_TASK_COUNT (task) * AESDEV_AES_BLOCK_SIZE;
+  sim->xfer_out = out + AESDEV_TASK_COUNT (task) * AESDEV_AES_BLOCK_SIZE;
+  sim->xfer_task = AESDEV_TASK_MODE (task);
+  sim->intr |= AESDEV_TASK_INTR (task);
+  sim->xfer_busy = false;
+  spin_unlock_irqrestore (&sim->lock, flags);
+}
+
+/* Fetch and run one command of command block, if there is one.  Read
+   pointer moves on as soon as the command is fetched, like in the
+   device.  */
+static void
+sim_run_cmd (struct aes_sim *sim)
+{
+  __le32 cmd[4]; /* As in struct aes128_command.  */
+  uint32_t addr;
+  unsigned long flags;
+
+  spin_lock_irqsave (&sim->lock, flags);
+  if (!(sim->enable & AESDEV_ENABLE_FETCH_CMD)
+      || sim->cmd_read == sim->cmd_write)
+    {
+      spin_unlock_irqrestore (&sim->lock, flags);
+      return;
+    }
+  addr = sim->cmd_read;
+  sim->cmd_read += sizeof (cmd);
+  if (sim->cmd_read >= sim->cmd_end)
+    sim->cmd_read = sim->cmd_begin;
+  sim->cmd_busy = true;
+  spin_unlock_irqrestore (&sim->lock, flags);
+
+  sim_dma_copy (addr, cmd, sizeof (cmd), false);
+  sim_execute (sim, le32_to_cpu (cmd[0]), le32_to_cpu (cmd[1]),
+               le32_to_cpu (cmd[2]), le32_to_cpu (cmd[3]));
+
+  spin_lock_irqsave (&sim->lock, flags);
+  sim->intr |= AESDEV_TASK_INTR (le32_to_cpu (cmd[3]));
+  sim->cmd_busy = false;
+  spin_unlock_irqrestore (&sim->lock, flags);
+}
+
+/* Interrupt the driver if there are new enabled interrupts.  */
+static void
+sim_update_irq (struct aes_sim *sim)
+{
+  unsigned long flags;
+  bool raise;
+
+  spin_lock_irqsave (&sim->lock, flags);
+  raise = (sim->intr & sim->intr_enable) && !sim->irq_raised;
+  if (raise)
+    sim->irq_raised = true;
+  spin_unlock_irqrestore (&sim->lock, flags);
+
+  if (raise)
+    {
+      local_irq_save (flags);
+      generic_handle_irq (sim->irq);
+      local_irq_restore (flags);
+    }
+}
+
+static bool
+sim_has_work (struct aes_sim *sim)
+{
+  unsigned long flags;
+  bool work;
+
+  spin_lock_irqsave (&sim->lock, flags);
+  work = ((sim->enable & AESDEV_ENABLE_XFER_DATA)
+          && AESDEV_TASK_ACTIVE (sim->xfer_task))
+          || ((sim->enable & AESDEV_ENABLE_FETCH_CMD)
+              && sim->cmd_read != sim->cmd_write)
+          || ((sim->intr & sim->intr_enable) && !sim->irq_raised);
+  spin_unlock_irqrestore (&sim->lock, flags);
+
+  return work;
+}
+
+static int
+sim_thread (void *data)
+{
+  struct aes_sim *sim = data;
+
+  while (!kthread_should_stop ())
+    {
+      wait_event_interruptible (sim->wait,
+                                sim_has_work (sim) || kthread_should_stop ());
+
+      sim_run_xfer (sim);
+      sim_update_irq (sim);
+      sim_run_cmd (sim);
+      sim_update_irq (sim);
+      cond_resched ();
+    }
+
+  return 0;
+}
+/*****************************************************************************/
+
+/*** Devices *****************************************************************/
+static void
+sim_destroy (struct aes_sim *sim)
+{
+  /* Driver lets go of the device (and its irq) first.  */
+  if (sim->pdev != NULL)
+    platform_device_unregister (sim->pdev);
+  if (sim->thread != NULL)
+    kthread_stop (sim->thread);
+  if (sim->irq > 0)
+    irq_free_desc (sim->irq);
+  if (!IS_ERR_OR_NULL (sim->tfm))
+    crypto_free_cipher (sim->tfm);
+  free_page ((unsigned long) sim->scratch);
+  kfree (sim);
+}
+
+__must_check static int
+sim_create (int id, struct aes_sim **result)
+{
+  struct aes_sim *sim;
+  struct platform_device *pdev;
+  int ret;
+
+  sim = kzalloc (sizeof (*sim), GFP_KERNEL);
+  if (sim == NULL)
+    return -ENOMEM;
+  spin_lock_init (&sim->lock);
+  init_waitqueue_head (&sim->wait);
+
+  sim->scratch = (char *) __get_free_page (GFP_KERNEL);
+  if (sim->scratch == NULL)
+    {
+      ret = -ENOMEM;
+      goto err;
+    }
+
+  sim->tfm = crypto_alloc_cipher ("aes", 0, 0);
+  if (IS_ERR (sim->tfm))
+    {
+      printk (KERN_WARNING "crypto_alloc_cipher\n");
+      ret = PTR_ERR (sim->tfm);
+      goto err;
+    }
+
+  /* Interrupt line of our own, raised by hand.  */
+  sim->irq = irq_alloc_desc (NUMA_NO_NODE);
+  if (sim->irq < 0)
+    {
+      printk (KERN_WARNING "irq_alloc_desc\n");
+      ret = sim->irq;
+      goto err;
+    }
+  irq_set_chip_and_handler (sim->irq, &dummy_irq_chip, handle_simple_irq);
+  irq_modify_status (sim->irq, IRQ_NOREQUEST, IRQ_NOPROBE);
+
+  sim->thread = kthread_run (sim_thread, sim, "aesdev_sim%d", id);
+  if (IS_ERR (sim->thread))
+    {
+      printk (KERN_WARNING "kthread_run\n");
+      ret = PTR_ERR (sim->thread);
+      sim->thread = NULL;
+      goto err;
+    }
+
+  sim->regs.read = sim_reg_read;
+  sim->regs.write = sim_reg_write;
+  sim->regs.sim = sim;
+  sim->regs.irq = sim->irq;
+
+  pdev = platform_device_alloc (AESDEV_SIM_NAME, id);
+  if (pdev == NULL)
+    {
+      ret = -ENOMEM;
+      goto err;
+    }
+  /* Like the PCI device, the model takes 32-bit addresses.  */
+  pdev->dev.coherent_dma_mask = DMA_BIT_MASK (32);
+  pdev->dev.dma_mask = &pdev->dev.coherent_dma_mask;
+
+  ret = platform_device_add_data (pdev, &sim->regs, sizeof (sim->regs));
+  if (ret == 0)
+    ret = platform_device_add (pdev);
+  if (ret != 0)
+    {
+      printk (KERN_WARNING "platform_device_add\n");
+      platform_device_put (pdev);
+      goto err;
+    }
+  sim->pdev = pdev;
+
+  *result = sim;
+  return 0;
+
+err:
+  sim_destroy (sim);
+  return ret;
+}
+/*****************************************************************************/
+
+static int
+aessim_init (void)
+{
+  unsigned int i;
+  int ret;
+
+  for (i = 0; i < min (devices, (unsigned int) AESSIM_MAX_DEVICES); ++i)
+    {
+      ret = sim_create (i, &sims[i]);
+      if (ret != 0)
+        {
+          while (i-- > 0)
+            sim_destroy (sims[i]);
+          return ret;
+        }
+    }
+
+  printk (KERN_WARNING "aesdev_sim: %u simulated devices\n", i);
+  return 0;
+}
+
+static void
+aessim_cleanup (void)
+{
+  int i;
+
+  for (i = 0; i < AESSIM_MAX_DEVICES; ++i)
+    if (sims[i] != NULL)
+      sim_destroy (sims[i]);
+}
+
+module_init (aessim_init);
+module_exit (aessim_cleanup);
@@ -0,0 +1,23 @@
+#ifndef _AESDEV_SIM_H
+#define _AESDEV_SIM_H
+
+/* Interface between aesdev and its software model (aesdev_sim.ko).  The
+   model registers platform devices named AESDEV_SIM_NAME with struct
+   aesdev_sim_regs as platform data.  They are driven exactly like PCI
+   ones, only registers are accessed through READ and WRITE instead of
+   BAR0, and interrupts come on IRQ, an ordinary irq number allocated by
+   the model.  */
+
+#include <linux/types.h>
+
+#define AESDEV_SIM_NAME "aesdev-sim"
+
+struct aesdev_sim_regs
+{
+  uint32_t (*read) (void *sim, unsigned int reg);
+  void (*write) (void *sim, uint32_t val, unsigned int reg);
+  void *sim; /* First argument of READ and WRITE.  */
+  int irq;
+};
+
+#endif /* _AESDEV_SIM_H */
@@ -0,0 +1,103 @@
+/* Tracepoints of the path of a task: created from data written by user,
+   submitted to the command buffer, completed by the device, accepted by
+   its context and finally read by user.  Tasks are identified by address,
+   which is unique while the task lives.  */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM aesdev
+
+#if !defined(_AESDEV_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _AESDEV_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#include "aesdev.h"
+
+DECLARE_EVENT_CLASS (aesdev_task,
+
+  TP_PROTO (aes128_dev *aes_dev, aes128_task *task),
+
+  TP_ARGS (aes_dev, task),
+
+  TP_STRUCT__entry (
+    __field (const void *, task)
+    __field (const void *, context)
+    __field (int, minor)
+    __field (int, mode)
+    __field (int, cmd_index)
+    __field (size_t, seq)
+    __field (size_t, block_count)
+  ),
+
+  TP_fast_assign (
+    __entry->task = task;
+    __entry->context = task->context;
+    __entry->minor = aes_dev->minor;
+    __entry->mode = task->mode;
+    __entry->cmd_index = task->cmd_index;
+    __entry->seq = task->seq;
+    __entry->block_count = task->block_count;
+  ),
+
+  TP_printk ("aes%d task=%p context=%p mode=%d cmd_index=%d seq=%zu "
+             "blocks=%zu", __entry->minor, __entry->task, __entry->context,
+             __entry->mode, __entry->cmd_index, __entry->seq,
+             __entry->block_count)
+);
+
+/* Task made of data in io buffer, before waiting for command slots.  */
+DEFINE_EVENT (aesdev_task, aesdev_task_create,
+  TP_PROTO (aes128_dev *aes_dev, aes128_task *task),
+  TP_ARGS (aes_dev, task)
+);
+
+/* Command written to the command buffer (doorbell follows in a moment).  */
+DEFINE_EVENT (aesdev_task, aesdev_task_submit,
+  TP_PROTO (aes128_dev *aes_dev, aes128_task *task),
+  TP_ARGS (aes_dev, task)
+);
+
+/* Completion noticed in irq thread (or by reap timer, or by polling).  */
+DEFINE_EVENT (aesdev_task, aesdev_task_complete,
+  TP_PROTO (aes128_dev *aes_dev, aes128_task *task),
+  TP_ARGS (aes_dev, task)
+);
+
+/* Encrypted data of the task accounted as ready to read.  */
+DEFINE_EVENT (aesdev_task, aesdev_task_consume,
+  TP_PROTO (aes128_dev *aes_dev, aes128_task *task),
+  TP_ARGS (aes_dev, task)
+);
+
+/* User took LEN bytes of encrypted data.  */
+TRACE_EVENT (aesdev_read,
+
+  TP_PROTO (aes128_context *context, size_t len),
+
+  TP_ARGS (context, len),
+
+  TP_STRUCT__entry (
+    __field (const void *, context)
+    __field (int, minor)
+    __field (size_t, len)
+    __field (size_t, read_count)
+  ),
+
+  TP_fast_assign (
+    __entry->context = context;
+    __entry->minor = context->aes_dev->minor;
+    __entry->len = len;
+    __entry->read_count = acb_read_count (&context->buffer);
+  ),
+
+  TP_printk ("aes%d context=%p len=%zu left=%zu", __entry->minor,
+             __entry->context, __entry->len, __entry->read_count)
+);
+
+#endif /* _AESDEV_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE aesdev_trace
+#include <trace/define_trace.h>
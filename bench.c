@@ -0,0 +1,477 @@
+/*
+ * File:   bench.c
+ * Author: hubert
+ *
+ * Throughput and latency benchmark.  Sweeps request size, mode, number of
+ * contexts (one thread each) and blocking/non-blocking io, and prints one
+ * CSV line per combination, so that results can be kept as a baseline and
+ * compared with -b.  The buffer column is the io buffer size the driver
+ * chose (it rounds up to pages and clamps to iobuff_max_size); points are
+ * compared with the baseline only if it is the same.
+ *
+ * gcc -Wall -O2 -pthread -o bench bench.c
+ * ./bench [-d device] [-s min:max] [-m mode,...] [-t threads,...]
+ *         [-n 0|1|both] [-T seconds] [-b baseline.csv]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include "aesdev_ioctl.h"
+
+#define MAX_THREADS 64
+#define MAX_BASELINE 4096
+
+const char *test_key_iv = "22222222444444443333333355555555";
+
+struct mode
+{
+  const char *name;
+  unsigned long ioctl;
+};
+
+const struct mode modes[] = {
+  { "ecb_encrypt", AESDEV_IOCTL_SET_ECB_ENCRYPT },
+  { "ecb_decrypt", AESDEV_IOCTL_SET_ECB_DECRYPT },
+  { "cbc_encrypt", AESDEV_IOCTL_SET_CBC_ENCRYPT },
+  { "cbc_decrypt", AESDEV_IOCTL_SET_CBC_DECRYPT },
+  { "cfb_encrypt", AESDEV_IOCTL_SET_CFB_ENCRYPT },
+  { "cfb_decrypt", AESDEV_IOCTL_SET_CFB_DECRYPT },
+  { "ofb", AESDEV_IOCTL_SET_OFB },
+  { "ctr", AESDEV_IOCTL_SET_CTR },
+};
+#define MODE_COUNT (sizeof (modes) / sizeof (modes[0]))
+
+/* Options.  */
+const char *device = "/dev/aes0";
+size_t min_size = 16, max_size = 1 << 20;
+int mode_enabled[MODE_COUNT];
+int thread_counts[MAX_THREADS], thread_count_n;
+int nonblock_from = 0, nonblock_to = 1;
+double duration = 1.0;
+
+/* One measurement point.  */
+struct worker
+{
+  pthread_t thread;
+  int fd;
+  size_t size;
+  size_t chunk; /* Io buffer size, requests are split in such pieces.  */
+  size_t buffer_size; /* Io buffer size returned by the driver.  */
+  int nonblock;
+  char *data;
+  double *lat; /* Latencies of single requests, in us.  */
+  size_t lat_count, lat_cap;
+};
+
+volatile int stop;
+pthread_barrier_t start_barrier;
+
+/* Earlier results, from -b.  */
+struct baseline
+{
+  char mode[32];
+  size_t size;
+  size_t buffer_size;
+  int threads;
+  int nonblock;
+  double mb_s;
+} baseline[MAX_BASELINE];
+int baseline_count;
+
+double
+now_us ()
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+void
+wait_for (int fd, short events)
+{
+  struct pollfd pfd;
+
+  pfd.fd = fd;
+  pfd.events = events;
+  pfd.revents = 0;
+  if (poll (&pfd, 1, 1000) < 0)
+    {
+      perror ("poll");
+      exit (1);
+    }
+}
+
+void
+do_write (struct worker *w, const char *data, size_t len)
+{
+  ssize_t ret;
+
+  while (len > 0)
+    {
+      ret = write (w->fd, data, len);
+      if (ret < 0 && errno == EAGAIN)
+        {
+          wait_for (w->fd, POLLOUT);
+          continue;
+        }
+      if (ret <= 0)
+        {
+          perror ("write");
+          exit (1);
+        }
+      data += ret;
+      len -= ret;
+    }
+}
+
+void
+do_read (struct worker *w, char *data, size_t len)
+{
+  ssize_t ret;
+
+  while (len > 0)
+    {
+      ret = read (w->fd, data, len);
+      if (ret < 0 && errno == EAGAIN)
+        {
+          wait_for (w->fd, POLLIN);
+          continue;
+        }
+      if (ret <= 0)
+        {
+          perror ("read");
+          exit (1);
+        }
+      data += ret;
+      len -= ret;
+    }
+}
+
+/* Encrypt SIZE bytes through the context, in pieces that fit in its io
+   buffer.  */
+void
+one_request (struct worker *w)
+{
+  size_t done, now;
+
+  for (done = 0; done < w->size; done += now)
+    {
+      now = w->size - done < w->chunk ? w->size - done : w->chunk;
+      do_write (w, w->data + done, now);
+      do_read (w, w->data + done, now);
+    }
+}
+
+void *
+worker_main (void *arg)
+{
+  struct worker *w = arg;
+  double start;
+
+  pthread_barrier_wait (&start_barrier);
+  while (!stop)
+    {
+      start = now_us ();
+      one_request (w);
+      if (w->lat_count == w->lat_cap)
+        {
+          w->lat_cap = w->lat_cap ? 2 * w->lat_cap : 0x1000;
+          w->lat = realloc (w->lat, w->lat_cap * sizeof (double));
+          if (w->lat == NULL)
+            {
+              perror ("realloc");
+              exit (1);
+            }
+        }
+      w->lat[w->lat_count++] = now_us () - start;
+    }
+  return NULL;
+}
+
+void
+open_worker (struct worker *w, const struct mode *mode, size_t size,
+             int nonblock)
+{
+  uint32_t buffer_size;
+
+  memset (w, 0, sizeof (*w));
+  w->size = size;
+  w->nonblock = nonblock;
+  w->fd = open (device, O_RDWR | (nonblock ? O_NONBLOCK : 0));
+  if (w->fd == -1)
+    {
+      perror ("open");
+      exit (1);
+    }
+
+  /* Whole request in the io buffer if the driver allows.  */
+  buffer_size = size;
+  if (ioctl (w->fd, AESDEV_IOCTL_SET_BUFFER_SIZE, &buffer_size) == -1)
+    {
+      perror ("ioctl");
+      exit (1);
+    }
+  w->buffer_size = buffer_size;
+  w->chunk = buffer_size < size ? buffer_size : size;
+
+  if (ioctl (w->fd, mode->ioctl, test_key_iv) == -1)
+    {
+      perror ("ioctl");
+      exit (1);
+    }
+
+  w->data = malloc (size);
+  if (w->data == NULL)
+    {
+      perror ("malloc");
+      exit (1);
+    }
+  memset (w->data, 0x5a, size);
+}
+
+int
+compare_double (const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+double
+percentile (const double *sorted, size_t count, double p)
+{
+  size_t i;
+
+  if (count == 0)
+    return 0;
+  i = (size_t) (p * (count - 1) + 0.5);
+  return sorted[i];
+}
+
+const struct baseline *
+find_baseline (const char *mode, size_t size, size_t buffer_size,
+               int threads, int nonblock)
+{
+  int i;
+
+  for (i = 0; i < baseline_count; ++i)
+    if (strcmp (baseline[i].mode, mode) == 0 && baseline[i].size == size
+        && baseline[i].buffer_size == buffer_size
+        && baseline[i].threads == threads && baseline[i].nonblock == nonblock)
+      return &baseline[i];
+  return NULL;
+}
+
+void
+run_point (const struct mode *mode, size_t size, int threads, int nonblock)
+{
+  struct worker workers[MAX_THREADS];
+  const struct baseline *base;
+  double *all, start, seconds, mb_s, ops_s;
+  size_t ops, count, buffer_size;
+  int i;
+
+  for (i = 0; i < threads; ++i)
+    open_worker (&workers[i], mode, size, nonblock);
+
+  stop = 0;
+  pthread_barrier_init (&start_barrier, NULL, threads + 1);
+  for (i = 0; i < threads; ++i)
+    if (pthread_create (&workers[i].thread, NULL, worker_main, &workers[i]))
+      {
+        perror ("pthread_create");
+        exit (1);
+      }
+
+  pthread_barrier_wait (&start_barrier);
+  start = now_us ();
+  usleep ((useconds_t) (duration * 1e6));
+  stop = 1;
+  for (i = 0; i < threads; ++i)
+    pthread_join (workers[i].thread, NULL);
+  seconds = (now_us () - start) / 1e6;
+  pthread_barrier_destroy (&start_barrier);
+
+  ops = 0;
+  for (i = 0; i < threads; ++i)
+    ops += workers[i].lat_count;
+  all = malloc ((ops ? ops : 1) * sizeof (double));
+  if (all == NULL)
+    {
+      perror ("malloc");
+      exit (1);
+    }
+  buffer_size = workers[0].buffer_size;
+  for (i = 0, count = 0; i < threads; ++i)
+    {
+      memcpy (all + count, workers[i].lat,
+              workers[i].lat_count * sizeof (double));
+      count += workers[i].lat_count;
+      close (workers[i].fd);
+      free (workers[i].lat);
+      free (workers[i].data);
+    }
+  qsort (all, ops, sizeof (double), compare_double);
+
+  ops_s = ops / seconds;
+  mb_s = ops_s * size / 1e6;
+  printf ("%s,%zu,%zu,%d,%d,%zu,%.3f,%.2f,%.1f,%.1f,%.1f,%.1f",
+          mode->name, size, buffer_size, threads, nonblock, ops, seconds,
+          mb_s, ops_s, percentile (all, ops, 0.5),
+          percentile (all, ops, 0.99), percentile (all, ops, 0.999));
+  base = find_baseline (mode->name, size, buffer_size, threads, nonblock);
+  if (base != NULL && base->mb_s > 0)
+    printf (",%.2f,%+.1f", base->mb_s, (mb_s / base->mb_s - 1) * 100);
+  else if (baseline_count > 0)
+    printf (",,");
+  printf ("\n");
+  fflush (stdout);
+  free (all);
+}
+
+void
+load_baseline (const char *path)
+{
+  char line[512];
+  FILE *f;
+
+  f = fopen (path, "r");
+  if (f == NULL)
+    {
+      perror (path);
+      exit (1);
+    }
+  while (fgets (line, sizeof line, f) && baseline_count < MAX_BASELINE)
+    {
+      struct baseline *b = &baseline[baseline_count];
+
+      /* Header and anything else not looking like a result is skipped.  */
+      if (sscanf (line, "%31[^,],%zu,%zu,%d,%d,%*u,%*f,%lf", b->mode,
+                  &b->size, &b->buffer_size, &b->threads, &b->nonblock,
+                  &b->mb_s) == 6)
+        baseline_count++;
+    }
+  fclose (f);
+}
+
+void
+usage (const char *prog)
+{
+  fprintf (stderr,
+           "usage: %s [-d device] [-s min:max] [-m mode,...] [-t threads,...]\n"
+           "          [-n 0|1|both] [-T seconds] [-b baseline.csv]\n", prog);
+  exit (1);
+}
+
+void
+parse_modes (char *list)
+{
+  char *name;
+  size_t i;
+
+  memset (mode_enabled, 0, sizeof (mode_enabled));
+  for (name = strtok (list, ","); name; name = strtok (NULL, ","))
+    {
+      for (i = 0; i < MODE_COUNT; ++i)
+        if (strcmp (name, modes[i].name) == 0)
+          break;
+      if (i == MODE_COUNT)
+        {
+          fprintf (stderr, "unknown mode %s\n", name);
+          exit (1);
+        }
+      mode_enabled[i] = 1;
+    }
+}
+
+void
+parse_threads (char *list)
+{
+  char *num;
+
+  thread_count_n = 0;
+  for (num = strtok (list, ","); num; num = strtok (NULL, ","))
+    {
+      if (thread_count_n == MAX_THREADS || atoi (num) < 1
+          || atoi (num) > MAX_THREADS)
+        {
+          fprintf (stderr, "bad thread count %s\n", num);
+          exit (1);
+        }
+      thread_counts[thread_count_n++] = atoi (num);
+    }
+}
+
+/*****************************************************************************/
+
+int
+main (int argc, char **argv)
+{
+  size_t size, i;
+  int opt, t, nonblock;
+
+  for (i = 0; i < MODE_COUNT; ++i)
+    mode_enabled[i] = 1;
+  thread_counts[0] = 1;
+  thread_count_n = 1;
+
+  while ((opt = getopt (argc, argv, "d:s:m:t:n:T:b:")) != -1)
+    switch (opt)
+      {
+      case 'd':
+        device = optarg;
+        break;
+      case 's':
+        if (sscanf (optarg, "%zu:%zu", &min_size, &max_size) != 2
+            || min_size < 16 || min_size % 16 || max_size < min_size)
+          usage (argv[0]);
+        break;
+      case 'm':
+        parse_modes (optarg);
+        break;
+      case 't':
+        parse_threads (optarg);
+        break;
+      case 'n':
+        if (strcmp (optarg, "both") == 0)
+          nonblock_from = 0, nonblock_to = 1;
+        else
+          nonblock_from = nonblock_to = !!atoi (optarg);
+        break;
+      case 'T':
+        duration = atof (optarg);
+        break;
+      case 'b':
+        load_baseline (optarg);
+        break;
+      default:
+        usage (argv[0]);
+      }
+
+  printf ("mode,size,buffer,threads,nonblock,ops,seconds,mb_s,ops_s,"
+          "p50_us,p99_us,p999_us%s\n",
+          baseline_count > 0 ? ",base_mb_s,delta_pct" : "");
+
+  for (i = 0; i < MODE_COUNT; ++i)
+    {
+      if (!mode_enabled[i])
+        continue;
+      for (size = min_size; size <= max_size; size *= 2)
+        for (t = 0; t < thread_count_n; ++t)
+          for (nonblock = nonblock_from; nonblock <= nonblock_to; ++nonblock)
+            run_point (&modes[i], size, thread_counts[t], nonblock);
+    }
+
+  return (EXIT_SUCCESS);
+}
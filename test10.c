@@ -0,0 +1,334 @@
+/* 
+ * File:   test10.c
+ * Author: hubert
+ *
+ * Vectored read and write, splice, large CTR streams (split over devices).
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "aesdev_ioctl.h"
+
+int fd;
+void
+do_write (int fd, const char *data, size_t len)
+{
+  ssize_t written, ret;
+
+  written = 0;
+
+  while (written < len)
+    {
+      ret = write (fd, data, len - written);
+      if (ret < 0)
+        {
+          perror ("write");
+          exit (1);
+        }
+      if (ret == 0)
+        {
+          fprintf (stderr, "unexpected EOF in write\n");
+          exit (1);
+        }
+      written += ret;
+    }
+}
+
+void
+do_read (int fd, char *data, size_t len)
+{
+  ssize_t readed, ret;
+
+  readed = 0;
+
+  while (readed < len)
+    {
+      ret = read (fd, data + readed, len - readed);
+      if (ret < 0)
+        {
+          perror ("read");
+          exit (1);
+        }
+      if (ret == 0)
+        {
+          fprintf (stderr, "unexpected EOF in read\n");
+          exit (1);
+        }
+      readed += ret;
+    }
+}
+
+void
+set_mode (int mode, const char *key_iv)
+{
+  int ret;
+  ret = ioctl (fd, mode, key_iv);
+  if (ret == -1)
+    {
+      perror ("ioctl");
+      exit (1);
+    }
+}
+
+void
+open_file ()
+{
+  fd = open ("/dev/aes0", O_RDWR);
+  if (fd == -1)
+    {
+      perror ("open");
+      exit (1);
+    }
+}
+
+char
+is_equal (const char *d1, const char *d2, size_t len)
+{
+  char ok;
+  size_t i;
+
+  ok = 1;
+  for (i = 0; i < len; ++i) if (d1[i] != d2[i]) ok = 0;
+
+  return ok;
+}
+
+void
+print_vec (const char *d, size_t len)
+{
+  int i;
+  for (i = 0; i < len; ++i) fprintf (stderr, "%02x", d[i] & 0xFF);
+  fprintf (stderr, "\n");
+}
+
+void
+assert_equal (const char *d1, const char *d2, size_t len)
+{
+  if (!is_equal (d1, d2, len))
+    {
+      fprintf (stderr, "is        ");
+      print_vec (d1, len);
+      fprintf (stderr, "should be ");
+      print_vec (d2, len);
+    }
+}
+
+/*** TESTS *******************************************************************/
+void
+test_writev ()
+{
+  const char *text1 = "\x6b\xc1\xbe\xe2\x2e\x40\x9f\x96\xe9\x3d\x7e\x11\x73\x93\x17\x2a";
+  const char *cipher1 = "\x3a\xd7\x7b\xb4\x0d\x7a\x36\x60\xa8\x9e\xca\xf3\x24\x66\xef\x97";
+
+  const char *key = "\x2b\x7e\x15\x16\x28\xae\xd2\xa6\xab\xf7\x15\x88\x09\xcf\x4f\x3c";
+
+  struct iovec iov[64];
+  char result[64 * 16];
+  ssize_t ret;
+  int i, ok;
+
+  set_mode (AESDEV_IOCTL_SET_ECB_ENCRYPT, key);
+
+  /*** Test 1 ***/
+  /* Many small fields, split in the middle of blocks.  */
+  for (i = 0; i < 64; ++i)
+    {
+      iov[i].iov_base = (char *) text1 + (i % 2 ? 5 : 0);
+      iov[i].iov_len = i % 2 ? 11 : 5;
+    }
+  ret = writev (fd, iov, 64);
+  ok = ret == 32 * 16;
+  do_read (fd, result, 32 * 16);
+  for (i = 0; i < 32; ++i)
+    ok = ok && is_equal (result + i * 16, cipher1, 16);
+  fprintf (stderr, "ECB writev (1): %s\n", ok ? "ok" : "err");
+  assert_equal (result, cipher1, 16);
+
+  /*** Test 2 ***/
+  /* Single task, so all of it is ready at once.  */
+  memcpy (result, text1, 16);
+  memcpy (result + 16, text1, 16);
+  do_write (fd, result, 32);
+  for (i = 0; i < 4; ++i)
+    {
+      iov[i].iov_base = result + i * 8;
+      iov[i].iov_len = 8;
+    }
+  ret = readv (fd, iov, 4);
+  ok = ret == 32 && is_equal (result, cipher1, 16)
+          && is_equal (result + 16, cipher1, 16);
+  fprintf (stderr, "ECB readv (2): %s\n", ok ? "ok" : "err");
+  assert_equal (result, cipher1, 16);
+}
+
+void
+test_splice ()
+{
+  const char *text1 = "\x6b\xc1\xbe\xe2\x2e\x40\x9f\x96\xe9\x3d\x7e\x11\x73\x93\x17\x2a";
+  const char *cipher1 = "\x3a\xd7\x7b\xb4\x0d\x7a\x36\x60\xa8\x9e\xca\xf3\x24\x66\xef\x97";
+
+  const char *key = "\x2b\x7e\x15\x16\x28\xae\xd2\xa6\xab\xf7\x15\x88\x09\xcf\x4f\x3c";
+
+  char data[0x1000];
+  int in_pipe[2], out_pipe[2];
+  size_t total, i;
+  ssize_t ret;
+  int ok;
+
+  set_mode (AESDEV_IOCTL_SET_ECB_ENCRYPT, key);
+
+  if (pipe (in_pipe) == -1 || pipe (out_pipe) == -1)
+    {
+      perror ("pipe");
+      exit (1);
+    }
+
+  for (i = 0; i < sizeof data; i += 16)
+    memcpy (data + i, text1, 16);
+  if (write (in_pipe[1], data, sizeof data) != sizeof data)
+    {
+      perror ("write");
+      exit (1);
+    }
+
+  /*** Test 1 ***/
+  /* Pipe -> device -> pipe, data never seen by user.  */
+  for (total = 0; total < sizeof data; total += ret)
+    {
+      ret = splice (in_pipe[0], NULL, fd, NULL, sizeof data - total, 0);
+      if (ret <= 0)
+        {
+          perror ("splice to device");
+          exit (1);
+        }
+    }
+  for (total = 0; total < sizeof data; total += ret)
+    {
+      ret = splice (fd, NULL, out_pipe[1], NULL, sizeof data - total, 0);
+      if (ret <= 0)
+        {
+          perror ("splice from device");
+          exit (1);
+        }
+    }
+
+  memset (data, 0, sizeof data);
+  for (total = 0; total < sizeof data; total += ret)
+    {
+      ret = read (out_pipe[0], data + total, sizeof data - total);
+      if (ret <= 0)
+        {
+          perror ("read");
+          exit (1);
+        }
+    }
+  for (i = 0, ok = 1; i < sizeof data; i += 16)
+    ok = ok && is_equal (data + i, cipher1, 16);
+  fprintf (stderr, "ECB splice (1): %s\n", ok ? "ok" : "err");
+  assert_equal (data, cipher1, 16);
+
+  close (in_pipe[0]);
+  close (in_pipe[1]);
+  close (out_pipe[0]);
+  close (out_pipe[1]);
+}
+
+void
+test_ctr_split ()
+{
+  const char *key_iv = "\x2b\x7e\x15\x16\x28\xae\xd2\xa6\xab\xf7\x15\x88\x09\xcf\x4f\x3c"
+          "\xf0\xf1\xf2\xf3\xf4\xf5\xf6\xf7\xf8\xf9\xfa\xfb\xfc\xfd\xfe\xff";
+  const size_t length = 0x100000;
+  unsigned char *counters, *zeros, *keystream, *result;
+  uint32_t size;
+  size_t i;
+  int j, ecb_fd, ok;
+
+  counters = malloc (length);
+  zeros = calloc (1, length);
+  keystream = malloc (length);
+  result = malloc (length);
+
+  /* Counter blocks, big-endian increment of the IV.  */
+  memcpy (counters, key_iv + 16, 16);
+  for (i = 16; i < length; i += 16)
+    {
+      memcpy (counters + i, counters + i - 16, 16);
+      for (j = 15; j >= 0 && ++counters[i + j] == 0; --j)
+        ;
+    }
+
+  /* Reference keystream from ECB on another context.  */
+  ecb_fd = fd;
+  open_file ();
+  set_mode (AESDEV_IOCTL_SET_ECB_ENCRYPT, key_iv);
+  for (i = 0; i < length; i += 0x1000)
+    {
+      do_write (fd, (char *) counters + i, 0x1000);
+      do_read (fd, (char *) keystream + i, 0x1000);
+    }
+  close (fd);
+  fd = ecb_fd;
+
+  /*** Test 1 ***/
+  /* Big chunks, so they are cut in pieces running in parallel.  */
+  size = length;
+  if (ioctl (fd, AESDEV_IOCTL_SET_BUFFER_SIZE, &size) == -1)
+    {
+      perror ("ioctl");
+      exit (1);
+    }
+  set_mode (AESDEV_IOCTL_SET_CTR, key_iv);
+  do_write (fd, (char *) zeros, length);
+  do_read (fd, (char *) result, length);
+  ok = memcmp (result, keystream, length) == 0;
+  fprintf (stderr, "CTR split (1): %s\n", ok ? "ok" : "err");
+
+  /*** Test 2 ***/
+  /* State continues after all pieces.  */
+  do_write (fd, (char *) zeros, 16);
+  do_read (fd, (char *) result, 16);
+  memcpy (counters, counters + length - 16, 16);
+  for (j = 15; j >= 0 && ++counters[j] == 0; --j)
+    ;
+  set_mode (AESDEV_IOCTL_SET_ECB_ENCRYPT, key_iv);
+  do_write (fd, (char *) counters, 16);
+  do_read (fd, (char *) keystream, 16);
+  ok = memcmp (result, keystream, 16) == 0;
+  fprintf (stderr, "CTR split state (2): %s\n", ok ? "ok" : "err");
+
+  free (counters);
+  free (zeros);
+  free (keystream);
+  free (result);
+}
+
+/*****************************************************************************/
+
+int
+main ()
+{
+  open_file ();
+  test_writev ();
+  close (fd);
+
+  open_file ();
+  test_splice ();
+  close (fd);
+
+  open_file ();
+  test_ctr_split ();
+  close (fd);
+
+  return (EXIT_SUCCESS);
+}
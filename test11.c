@@ -0,0 +1,190 @@
+/* 
+ * File:   test11.c
+ * Author: hubert
+ *
+ * Asynchronous jobs signalled through eventfd.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/eventfd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "aesdev_ioctl.h"
+
+int fd;
+
+void
+open_file ()
+{
+  fd = open ("/dev/aes0", O_RDWR);
+  if (fd == -1)
+    {
+      perror ("open");
+      exit (1);
+    }
+}
+
+char
+is_equal (const char *d1, const char *d2, size_t len)
+{
+  char ok;
+  size_t i;
+
+  ok = 1;
+  for (i = 0; i < len; ++i) if (d1[i] != d2[i]) ok = 0;
+
+  return ok;
+}
+
+void
+print_vec (const char *d, size_t len)
+{
+  int i;
+  for (i = 0; i < len; ++i) fprintf (stderr, "%02x", d[i] & 0xFF);
+  fprintf (stderr, "\n");
+}
+
+void
+assert_equal (const char *d1, const char *d2, size_t len)
+{
+  if (!is_equal (d1, d2, len))
+    {
+      fprintf (stderr, "is        ");
+      print_vec (d1, len);
+      fprintf (stderr, "should be ");
+      print_vec (d2, len);
+    }
+}
+
+/*** TESTS *******************************************************************/
+void
+test_async ()
+{
+  const char *text1 = "\x6b\xc1\xbe\xe2\x2e\x40\x9f\x96\xe9\x3d\x7e\x11\x73\x93\x17\x2a";
+  const char *cipher1 = "\x3a\xd7\x7b\xb4\x0d\x7a\x36\x60\xa8\x9e\xca\xf3\x24\x66\xef\x97";
+
+  const char *cipher2 = "\x76\x49\xab\xac\x81\x19\xb2\x46\xce\xe9\x8e\x9b\x12\xe9\x19\x7d";
+
+  const char *key = "\x2b\x7e\x15\x16\x28\xae\xd2\xa6\xab\xf7\x15\x88\x09\xcf\x4f\x3c";
+  const char *iv = "\x00\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b\x0c\x0d\x0e\x0f";
+
+  struct aesdev_async_job jobs[0x200];
+  struct aesdev_async_completion comps[0x40];
+  struct aesdev_ioctl_async req;
+  char result[0x200][16], seen[0x200];
+  uint64_t events;
+  int32_t efd;
+  int i, reaped, ok;
+
+  efd = eventfd (0, 0);
+  if (efd == -1 || ioctl (fd, AESDEV_IOCTL_SET_EVENTFD, &efd) == -1)
+    {
+      perror ("eventfd");
+      exit (1);
+    }
+
+  for (i = 0; i < 0x200; ++i)
+    {
+      jobs[i].job.mode = AESDEV_BATCH_ECB_ENCRYPT;
+      jobs[i].job.len = 16;
+      jobs[i].job.in = (uintptr_t) text1;
+      jobs[i].job.out = (uintptr_t) result[i];
+      memcpy (jobs[i].job.key, key, 16);
+      jobs[i].user_data = i;
+    }
+
+  /*** Test 1 ***/
+  /* Everything in flight at once, from a single thread.  */
+  req.entries = (uintptr_t) jobs;
+  req.count = 0x200;
+  req.flags = 0;
+  if (ioctl (fd, AESDEV_IOCTL_ASYNC_SUBMIT, &req) == -1)
+    {
+      perror ("ioctl");
+      exit (1);
+    }
+  ok = req.count == 0x200;
+  fprintf (stderr, "async submit (1): %s\n", ok ? "ok" : "err");
+
+  /*** Test 2 ***/
+  ok = read (efd, &events, sizeof events) == sizeof events && events > 0;
+  fprintf (stderr, "async eventfd (2): %s\n", ok ? "ok" : "err");
+
+  /*** Test 3 ***/
+  memset (seen, 0, sizeof seen);
+  for (reaped = 0, ok = 1; reaped < 0x200 && ok; reaped += req.count)
+    {
+      req.entries = (uintptr_t) comps;
+      req.count = 0x40;
+      req.flags = AESDEV_ASYNC_WAIT;
+      if (ioctl (fd, AESDEV_IOCTL_ASYNC_REAP, &req) == -1)
+        {
+          perror ("ioctl");
+          exit (1);
+        }
+      ok = req.count > 0;
+      for (i = 0; i < req.count; ++i)
+        {
+          ok = ok && comps[i].result == 0 && comps[i].user_data < 0x200
+                  && !seen[comps[i].user_data];
+          if (ok)
+            seen[comps[i].user_data] = 1;
+        }
+    }
+  for (i = 0; i < 0x200 && ok; ++i)
+    ok = is_equal (result[i], cipher1, 16);
+  fprintf (stderr, "async reap (3): %s\n", ok ? "ok" : "err");
+  assert_equal (result[0], cipher1, 16);
+
+  /*** Test 4 ***/
+  /* State to continue a CBC stream with is the last ciphertext block.  */
+  memset (&jobs[0], 0, sizeof jobs[0]);
+  jobs[0].job.mode = AESDEV_BATCH_CBC_ENCRYPT;
+  jobs[0].job.len = 16;
+  jobs[0].job.in = (uintptr_t) text1;
+  jobs[0].job.out = (uintptr_t) result[0];
+  memcpy (jobs[0].job.key, key, 16);
+  memcpy (jobs[0].job.iv, iv, 16);
+  req.entries = (uintptr_t) jobs;
+  req.count = 1;
+  req.flags = 0;
+  if (ioctl (fd, AESDEV_IOCTL_ASYNC_SUBMIT, &req) == -1)
+    {
+      perror ("ioctl");
+      exit (1);
+    }
+  req.entries = (uintptr_t) comps;
+  req.count = 1;
+  req.flags = AESDEV_ASYNC_WAIT;
+  if (ioctl (fd, AESDEV_IOCTL_ASYNC_REAP, &req) == -1)
+    {
+      perror ("ioctl");
+      exit (1);
+    }
+  ok = req.count == 1 && comps[0].result == 0
+          && is_equal (result[0], cipher2, 16)
+          && is_equal ((const char *) comps[0].iv, cipher2, 16);
+  fprintf (stderr, "async state (4): %s\n", ok ? "ok" : "err");
+  assert_equal ((const char *) comps[0].iv, cipher2, 16);
+
+  close (efd);
+}
+
+/*****************************************************************************/
+
+int
+main ()
+{
+  open_file ();
+  test_async ();
+  close (fd);
+
+  return (EXIT_SUCCESS);
+}
@@ -0,0 +1,380 @@
+/*
+ * File:   test12.c
+ * Author: hubert
+ *
+ * One writer and one reader thread on the same context, with sw_fallback
+ * enabled and disabled, checked against AES done in software here.  Also
+ * checks the byte counters in sysfs.  Changing sw_fallback needs root,
+ * otherwise only the current setting is tested.
+ *
+ * gcc -Wall -pthread -o test12 test12.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "aesdev_ioctl.h"
+
+#define STREAM_LEN (4 << 20)
+#define MAX_DEVICES 8
+
+const char *sw_fallback_param = "/sys/module/aesdev/parameters/sw_fallback";
+
+int fd;
+const uint8_t *key_iv = (const uint8_t *)
+        "\x2b\x7e\x15\x16\x28\xae\xd2\xa6\xab\xf7\x15\x88\x09\xcf\x4f\x3c"
+        "\x00\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b\x0c\x0d\x0e\x0f";
+uint8_t *plain, *expected, *result;
+
+/*** Software AES-128 ********************************************************/
+const uint8_t sbox[256] = {
+  0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+  0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+  0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+  0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+  0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+  0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+  0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+  0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+  0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+  0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+  0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+  0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+  0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+  0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+  0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+  0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16
+};
+
+uint8_t round_keys[11][16];
+
+uint8_t
+xtime (uint8_t x)
+{
+  return (x << 1) ^ (x & 0x80 ? 0x1b : 0);
+}
+
+void
+sw_set_key (const uint8_t *key)
+{
+  uint8_t rcon;
+  int i, j;
+
+  memcpy (round_keys[0], key, 16);
+  for (i = 1, rcon = 1; i <= 10; ++i, rcon = xtime (rcon))
+    {
+      const uint8_t *prev = round_keys[i - 1];
+      uint8_t *rk = round_keys[i];
+
+      rk[0] = prev[0] ^ sbox[prev[13]] ^ rcon;
+      rk[1] = prev[1] ^ sbox[prev[14]];
+      rk[2] = prev[2] ^ sbox[prev[15]];
+      rk[3] = prev[3] ^ sbox[prev[12]];
+      for (j = 4; j < 16; ++j)
+        rk[j] = prev[j] ^ rk[j - 4];
+    }
+}
+
+void
+sw_encrypt_block (const uint8_t *in, uint8_t *out)
+{
+  uint8_t s[16], t[16];
+  int round, i, c;
+
+  for (i = 0; i < 16; ++i)
+    s[i] = in[i] ^ round_keys[0][i];
+
+  for (round = 1; round <= 10; ++round)
+    {
+      /* SubBytes and ShiftRows.  */
+      for (i = 0; i < 16; ++i)
+        t[i] = sbox[s[(i + 4 * (i % 4)) % 16]];
+
+      /* MixColumns, except in the last round.  */
+      if (round < 10)
+        for (c = 0; c < 4; ++c)
+          {
+            uint8_t *col = t + 4 * c;
+            uint8_t all = col[0] ^ col[1] ^ col[2] ^ col[3];
+            uint8_t first = col[0];
+
+            col[0] ^= all ^ xtime (col[0] ^ col[1]);
+            col[1] ^= all ^ xtime (col[1] ^ col[2]);
+            col[2] ^= all ^ xtime (col[2] ^ col[3]);
+            col[3] ^= all ^ xtime (col[3] ^ first);
+          }
+
+      for (i = 0; i < 16; ++i)
+        s[i] = t[i] ^ round_keys[round][i];
+    }
+
+  memcpy (out, s, 16);
+}
+
+/* Expected output of the whole stream in MODE.  */
+void
+sw_crypt (int mode, const uint8_t *in, uint8_t *out, size_t len)
+{
+  uint8_t state[16], block[16];
+  size_t i;
+  int j;
+
+  sw_set_key (key_iv);
+  memcpy (state, key_iv + 16, 16);
+
+  for (i = 0; i < len; i += 16)
+    {
+      if (mode == AESDEV_IOCTL_SET_ECB_ENCRYPT)
+        sw_encrypt_block (in + i, out + i);
+      else if (mode == AESDEV_IOCTL_SET_CBC_ENCRYPT)
+        {
+          for (j = 0; j < 16; ++j)
+            state[j] ^= in[i + j];
+          sw_encrypt_block (state, state);
+          memcpy (out + i, state, 16);
+        }
+      else
+        {
+          sw_encrypt_block (state, block);
+          for (j = 0; j < 16; ++j)
+            out[i + j] = in[i + j] ^ block[j];
+          for (j = 15; j >= 0 && ++state[j] == 0; --j)
+            ;
+        }
+    }
+}
+/*****************************************************************************/
+
+void
+open_file ()
+{
+  fd = open ("/dev/aes0", O_RDWR);
+  if (fd == -1)
+    {
+      perror ("open");
+      exit (1);
+    }
+}
+
+void
+set_mode (int mode, const uint8_t *key_iv)
+{
+  int ret;
+  ret = ioctl (fd, mode, key_iv);
+  if (ret == -1)
+    {
+      perror ("ioctl");
+      exit (1);
+    }
+}
+
+/* Sizes of single reads and writes, not whole blocks on purpose.  */
+size_t
+next_size (size_t i)
+{
+  static const size_t sizes[] = { 1, 15, 17, 100, 4093, 4096, 12345, 65537 };
+
+  return sizes[i % (sizeof (sizes) / sizeof (sizes[0]))];
+}
+
+void *
+writer_main (void *arg)
+{
+  size_t done, now, i;
+  ssize_t ret;
+
+  for (done = 0, i = 0; done < STREAM_LEN; done += ret, ++i)
+    {
+      now = next_size (i);
+      if (now > STREAM_LEN - done)
+        now = STREAM_LEN - done;
+      ret = write (fd, plain + done, now);
+      if (ret < 0)
+        {
+          perror ("write");
+          exit (1);
+        }
+      if (ret == 0)
+        {
+          fprintf (stderr, "unexpected EOF in write\n");
+          exit (1);
+        }
+    }
+  return NULL;
+}
+
+void *
+reader_main (void *arg)
+{
+  size_t done, now, i;
+  ssize_t ret;
+
+  for (done = 0, i = 3; done < STREAM_LEN; done += ret, ++i)
+    {
+      now = next_size (i);
+      if (now > STREAM_LEN - done)
+        now = STREAM_LEN - done;
+      ret = read (fd, result + done, now);
+      if (ret < 0)
+        {
+          perror ("read");
+          exit (1);
+        }
+      if (ret == 0)
+        {
+          fprintf (stderr, "unexpected EOF in read\n");
+          exit (1);
+        }
+    }
+  return NULL;
+}
+
+/* Returns the current setting, or -1 if it cannot be read.  */
+int
+get_sw_fallback ()
+{
+  FILE *f;
+  int val;
+
+  f = fopen (sw_fallback_param, "r");
+  if (f == NULL)
+    return -1;
+  if (fscanf (f, "%d", &val) != 1)
+    val = -1;
+  fclose (f);
+  return val;
+}
+
+/* Returns -1 if the parameter cannot be changed.  */
+int
+set_sw_fallback (int enable)
+{
+  FILE *f;
+
+  f = fopen (sw_fallback_param, "w");
+  if (f == NULL)
+    return -1;
+  fprintf (f, "%d\n", enable);
+  return fclose (f) == 0 ? 0 : -1;
+}
+
+/* Sum of a counter over all devices, their streams can be split.  */
+unsigned long long
+read_counter (const char *name)
+{
+  unsigned long long sum, val;
+  char path[128];
+  FILE *f;
+  int i;
+
+  for (i = 0, sum = 0; i < MAX_DEVICES; ++i)
+    {
+      snprintf (path, sizeof path, "/sys/class/aesdev/aes%d/%s", i, name);
+      f = fopen (path, "r");
+      if (f == NULL)
+        continue;
+      if (fscanf (f, "%llu", &val) == 1)
+        sum += val;
+      fclose (f);
+    }
+  return sum;
+}
+
+/*** TESTS *******************************************************************/
+void
+test_reader_writer (int mode, const char *name, const char *counter,
+                    const char *fallback)
+{
+  pthread_t writer, reader;
+  unsigned long long bytes, sw_bytes;
+  int ok;
+
+  sw_crypt (mode, plain, expected, STREAM_LEN);
+  memset (result, 0, STREAM_LEN);
+  bytes = read_counter (counter);
+  sw_bytes = read_counter ("bytes_sw_fallback");
+
+  open_file ();
+  set_mode (mode, key_iv);
+  if (pthread_create (&writer, NULL, writer_main, NULL)
+      || pthread_create (&reader, NULL, reader_main, NULL))
+    {
+      perror ("pthread_create");
+      exit (1);
+    }
+  pthread_join (writer, NULL);
+  pthread_join (reader, NULL);
+  close (fd);
+
+  /*** Test 1 ***/
+  ok = memcmp (result, expected, STREAM_LEN) == 0;
+  fprintf (stderr, "%s reader/writer, sw_fallback %s (1): %s\n", name,
+           fallback, ok ? "ok" : "err");
+
+  /*** Test 2 ***/
+  /* Sysfs counts every byte of the stream, hardware or not.  */
+  bytes = read_counter (counter) - bytes;
+  sw_bytes = read_counter ("bytes_sw_fallback") - sw_bytes;
+  ok = bytes >= STREAM_LEN;
+  if (strcmp (fallback, "off") == 0)
+    ok = ok && sw_bytes == 0;
+  fprintf (stderr, "%s counters, sw_fallback %s (2): %s (%llu bytes, "
+           "%llu in software)\n", name, fallback, ok ? "ok" : "err", bytes,
+           sw_bytes);
+}
+
+void
+test_all_modes (const char *fallback)
+{
+  test_reader_writer (AESDEV_IOCTL_SET_ECB_ENCRYPT, "ECB", "bytes_ecb_encrypt",
+                      fallback);
+  test_reader_writer (AESDEV_IOCTL_SET_CBC_ENCRYPT, "CBC", "bytes_cbc_encrypt",
+                      fallback);
+  test_reader_writer (AESDEV_IOCTL_SET_CTR, "CTR", "bytes_ctr", fallback);
+}
+
+/*****************************************************************************/
+
+int
+main ()
+{
+  size_t i;
+  int old_sw_fallback;
+
+  plain = malloc (STREAM_LEN);
+  expected = malloc (STREAM_LEN);
+  result = malloc (STREAM_LEN);
+  if (plain == NULL || expected == NULL || result == NULL)
+    {
+      perror ("malloc");
+      exit (1);
+    }
+  for (i = 0; i < STREAM_LEN; ++i)
+    plain[i] = (i * 2654435761u) >> 13;
+
+  old_sw_fallback = get_sw_fallback ();
+  if (old_sw_fallback >= 0 && set_sw_fallback (1) == 0)
+    {
+      test_all_modes ("on");
+      set_sw_fallback (0);
+      test_all_modes ("off");
+      set_sw_fallback (old_sw_fallback);
+    }
+  else
+    {
+      fprintf (stderr, "cannot change sw_fallback, testing as it is\n");
+      test_all_modes ("unchanged");
+    }
+
+  free (plain);
+  free (expected);
+  free (result);
+  return (EXIT_SUCCESS);
+}
@@ -0,0 +1,358 @@
+/* 
+ * File:   test7.c
+ * Author: hubert
+ *
+ * Multiplexing non-blocking contexts with poll.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <assert.h>
+#include "aesdev_ioctl.h"
+
+int fd;
+const char *test_block = "1111111122222222"; // 31 31 31 31 31 31 31 31 32 32 32 32 32 32 32 32
+const char *test_key = "2222222244444444"; // 32 32 32 32 32 32 32 32 34 34 34 34 34 34 34 34
+const char *test_iv = "3333333355555555"; // 
+const char *test_key_iv = "22222222444444443333333355555555"; // 32 32 32 32 32 32 32 32 34 34 34 34 34 34 34 34
+const char *test_enc_block = "\x7d\xe9\x85\x6a\xa1\xc4\x33\xcc\x87\x70\x5e\xab\x7d\x83\x88\xab";
+// 7de9856aa1c433cc87705eab7d8388ab
+
+short
+wait_for (int fd, short events)
+{
+  struct pollfd pfd;
+  int ret;
+
+  pfd.fd = fd;
+  pfd.events = events;
+  pfd.revents = 0;
+
+  ret = poll (&pfd, 1, 1000);
+  if (ret < 0)
+    {
+      perror ("poll");
+      exit (1);
+    }
+  if (pfd.revents & (POLLERR | POLLHUP))
+    {
+      fprintf (stderr, "unexpected error condition in poll\n");
+      exit (1);
+    }
+  return pfd.revents;
+}
+
+void
+do_write (int fd, const char *data, size_t len)
+{
+  ssize_t written, ret;
+
+  written = 0;
+
+  while (written < len)
+    {
+      if (!(wait_for (fd, POLLOUT) & POLLOUT))
+        {
+          fprintf (stderr, "timeout waiting for POLLOUT\n");
+          exit (1);
+        }
+      ret = write (fd, data + written, len - written);
+      if (ret < 0)
+        {
+          perror ("write");
+          exit (1);
+        }
+      written += ret;
+    }
+}
+
+void
+do_read (int fd, char *data, size_t len)
+{
+  ssize_t readed, ret;
+
+  readed = 0;
+
+  while (readed < len)
+    {
+      if (!(wait_for (fd, POLLIN) & POLLIN))
+        {
+          fprintf (stderr, "timeout waiting for POLLIN\n");
+          exit (1);
+        }
+      ret = read (fd, data + readed, len - readed);
+      if (ret < 0)
+        {
+          perror ("read");
+          exit (1);
+        }
+      readed += ret;
+    }
+}
+
+void
+set_mode (int mode, const char *key_iv)
+{
+  int ret;
+  ret = ioctl (fd, mode, key_iv);
+  if (ret == -1)
+    {
+      perror ("ioctl");
+      exit (1);
+    }
+}
+
+void
+open_file ()
+{
+  fd = open ("/dev/aes0", O_RDWR | O_NONBLOCK);
+  if (fd == -1)
+    {
+      perror ("open");
+      exit (1);
+    }
+}
+
+char
+is_equal (const char *d1, const char *d2, size_t len)
+{
+  char ok;
+  size_t i;
+
+  ok = 1;
+  for (i = 0; i < len; ++i) if (d1[i] != d2[i]) ok = 0;
+
+  return ok;
+}
+
+void
+print_vec (const char *d, size_t len)
+{
+  int i;
+  for (i = 0; i < len; ++i) fprintf (stderr, "%02x", d[i] & 0xFF);
+  fprintf (stderr, "\n");
+}
+
+void
+assert_equal (const char *d1, const char *d2, size_t len)
+{
+  if (!is_equal (d1, d2, len))
+    {
+      fprintf (stderr, "is        ");
+      print_vec (d1, len);
+      fprintf (stderr, "should be ");
+      print_vec (d2, len);
+    }
+}
+
+/*** TESTS *******************************************************************/
+void
+test_ecb_poll ()
+{
+  const char *text1 = "\x6b\xc1\xbe\xe2\x2e\x40\x9f\x96\xe9\x3d\x7e\x11\x73\x93\x17\x2a";
+  const char *cipher1 = "\x3a\xd7\x7b\xb4\x0d\x7a\x36\x60\xa8\x9e\xca\xf3\x24\x66\xef\x97";
+
+  const char *key = "\x2b\x7e\x15\x16\x28\xae\xd2\xa6\xab\xf7\x15\x88\x09\xcf\x4f\x3c";
+
+  struct pollfd pfd;
+  char result[16];
+  int i, ok;
+
+  /*** Test 0 ***/
+  /* No mode yet is not an error, there is just nothing to do.  */
+  pfd.fd = fd;
+  pfd.events = POLLIN | POLLOUT;
+  pfd.revents = 0;
+  ok = poll (&pfd, 1, 0) == 0 && pfd.revents == 0;
+  fprintf (stderr, "ECB poll no mode (0): %s\n", ok ? "ok" : "err");
+
+  set_mode (AESDEV_IOCTL_SET_ECB_ENCRYPT, key);
+
+  /*** Test 1 ***/
+  ok = (wait_for (fd, POLLIN | POLLOUT) == POLLOUT);
+  fprintf (stderr, "ECB poll idle (1): %s\n", ok ? "ok" : "err");
+
+  /*** Test 2 ***/
+  do_write (fd, text1, 16);
+  do_read (fd, result, 16);
+  fprintf (stderr, "ECB poll (2): %s\n", is_equal (result, cipher1, 16) ? "ok" : "err");
+  assert_equal (result, cipher1, 16);
+
+  /*** Test 3 ***/
+  for (i = 0, ok = 1; i < 16; ++i)
+    do_write (fd, text1 + i, 1);
+  do_read (fd, result, 16);
+  ok = is_equal (result, cipher1, 16);
+  fprintf (stderr, "ECB poll (3): %s\n", ok ? "ok" : "err");
+  assert_equal (result, cipher1, 16);
+}
+
+void
+test_full_buffer ()
+{
+  const char *key = "\x2b\x7e\x15\x16\x28\xae\xd2\xa6\xab\xf7\x15\x88\x09\xcf\x4f\x3c";
+  char data[0x100];
+  size_t total, drained;
+  ssize_t ret;
+  int ok;
+
+  set_mode (AESDEV_IOCTL_SET_ECB_ENCRYPT, key);
+  memset (data, 0, sizeof data);
+
+  /* Fill the buffer without reading anything.  */
+  total = 0;
+  while ((ret = write (fd, data, sizeof data)) > 0)
+    total += ret;
+  if (errno != EAGAIN)
+    {
+      perror ("write");
+      exit (1);
+    }
+
+  /*** Test 1 ***/
+  ok = !(wait_for (fd, POLLOUT) & POLLOUT);
+  fprintf (stderr, "full buffer no POLLOUT (1): %s\n", ok ? "ok" : "err");
+
+  /*** Test 2 ***/
+  do_read (fd, data, sizeof data);
+  ok = !!(wait_for (fd, POLLOUT) & POLLOUT);
+  fprintf (stderr, "POLLOUT after read (2): %s\n", ok ? "ok" : "err");
+
+  for (drained = sizeof data; drained < total; drained += sizeof data)
+    do_read (fd, data, sizeof data);
+}
+
+void
+test_busy_poll ()
+{
+  const char *text1 = "\x6b\xc1\xbe\xe2\x2e\x40\x9f\x96\xe9\x3d\x7e\x11\x73\x93\x17\x2a";
+  const char *cipher1 = "\x3a\xd7\x7b\xb4\x0d\x7a\x36\x60\xa8\x9e\xca\xf3\x24\x66\xef\x97";
+
+  const char *key = "\x2b\x7e\x15\x16\x28\xae\xd2\xa6\xab\xf7\x15\x88\x09\xcf\x4f\x3c";
+
+  char result[16];
+  uint32_t enable;
+  int i, ok;
+
+  /* Polling is used by blocking reads only.  */
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) & ~O_NONBLOCK);
+
+  enable = 1;
+  if (ioctl (fd, AESDEV_IOCTL_SET_POLL, &enable) == -1)
+    {
+      perror ("ioctl");
+      exit (1);
+    }
+  set_mode (AESDEV_IOCTL_SET_ECB_ENCRYPT, key);
+
+  /*** Test 1 ***/
+  for (i = 0, ok = 1; i < 1000; ++i)
+    {
+      do_write (fd, text1, 16);
+      do_read (fd, result, 16);
+      ok = ok && is_equal (result, cipher1, 16);
+    }
+  fprintf (stderr, "ECB busy poll (1): %s\n", ok ? "ok" : "err");
+  assert_equal (result, cipher1, 16);
+}
+
+/* Fill the buffer without reading and return how much was accepted.  */
+size_t
+fill_buffer ()
+{
+  char data[0x100];
+  size_t total;
+  ssize_t ret;
+
+  memset (data, 0, sizeof data);
+  total = 0;
+  for (;;)
+    {
+      ret = write (fd, data, sizeof data);
+      if (ret > 0)
+        total += ret;
+      else if (errno != EAGAIN)
+        {
+          perror ("write");
+          exit (1);
+        }
+      /* Out-of-place buffer frees input space as the device goes, so
+         give it a moment before giving up.  */
+      else if (!(wait_for (fd, POLLOUT) & POLLOUT))
+        break;
+    }
+  return total;
+}
+
+void
+test_out_of_place ()
+{
+  const char *text1 = "\x6b\xc1\xbe\xe2\x2e\x40\x9f\x96\xe9\x3d\x7e\x11\x73\x93\x17\x2a";
+  const char *cipher1 = "\x3a\xd7\x7b\xb4\x0d\x7a\x36\x60\xa8\x9e\xca\xf3\x24\x66\xef\x97";
+
+  const char *key = "\x2b\x7e\x15\x16\x28\xae\xd2\xa6\xab\xf7\x15\x88\x09\xcf\x4f\x3c";
+
+  char result[16], data[0x100];
+  size_t in_place, out_of_place, drained;
+  uint32_t enable;
+  int ok;
+
+  set_mode (AESDEV_IOCTL_SET_ECB_ENCRYPT, key);
+  in_place = fill_buffer ();
+  for (drained = 0; drained < in_place; drained += sizeof data)
+    do_read (fd, data, sizeof data);
+
+  enable = 1;
+  if (ioctl (fd, AESDEV_IOCTL_SET_OUT_OF_PLACE, &enable) == -1)
+    {
+      perror ("ioctl");
+      exit (1);
+    }
+
+  /*** Test 1 ***/
+  do_write (fd, text1, 16);
+  do_read (fd, result, 16);
+  fprintf (stderr, "ECB out-of-place (1): %s\n", is_equal (result, cipher1, 16) ? "ok" : "err");
+  assert_equal (result, cipher1, 16);
+
+  /*** Test 2 ***/
+  /* Both input and output space can be full.  */
+  out_of_place = fill_buffer ();
+  ok = out_of_place == 2 * in_place;
+  fprintf (stderr, "out-of-place buffer holds more (2): %s\n", ok ? "ok" : "err");
+  for (drained = 0; drained < out_of_place; drained += sizeof data)
+    do_read (fd, data, sizeof data);
+}
+
+/*****************************************************************************/
+
+int
+main ()
+{
+  open_file ();
+  test_ecb_poll ();
+  close (fd);
+
+  open_file ();
+  test_full_buffer ();
+  close (fd);
+
+  open_file ();
+  test_busy_poll ();
+  close (fd);
+
+  open_file ();
+  test_out_of_place ();
+  close (fd);
+
+  return (EXIT_SUCCESS);
+}
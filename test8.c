@@ -0,0 +1,436 @@
+/* 
+ * File:   test8.c
+ * Author: hubert
+ *
+ * Zero-copy encryption through the mmaped io buffer and directly from user
+ * memory (AESDEV_IOCTL_CRYPT), batches of independent jobs
+ * (AESDEV_IOCTL_BATCH).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <assert.h>
+#include "aesdev_ioctl.h"
+
+int fd;
+const char *test_block = "1111111122222222"; // 31 31 31 31 31 31 31 31 32 32 32 32 32 32 32 32
+const char *test_key = "2222222244444444"; // 32 32 32 32 32 32 32 32 34 34 34 34 34 34 34 34
+const char *test_iv = "3333333355555555"; // 
+const char *test_key_iv = "22222222444444443333333355555555"; // 32 32 32 32 32 32 32 32 34 34 34 34 34 34 34 34
+const char *test_enc_block = "\x7d\xe9\x85\x6a\xa1\xc4\x33\xcc\x87\x70\x5e\xab\x7d\x83\x88\xab";
+// 7de9856aa1c433cc87705eab7d8388ab
+
+void
+do_write (int fd, const char *data, size_t len)
+{
+  ssize_t written, ret;
+
+  written = 0;
+
+  while (written < len)
+    {
+      ret = write (fd, data, len - written);
+      if (ret < 0)
+        {
+          perror ("write");
+          exit (1);
+        }
+      if (ret == 0)
+        {
+          fprintf (stderr, "unexpected EOF in write\n");
+          exit (1);
+        }
+      written += ret;
+    }
+}
+
+void
+do_read (int fd, char *data, size_t len)
+{
+  ssize_t readed, ret;
+
+  readed = 0;
+
+  while (readed < len)
+    {
+      ret = read (fd, data + readed, len - readed);
+      if (ret < 0)
+        {
+          perror ("read");
+          exit (1);
+        }
+      if (ret == 0)
+        {
+          fprintf (stderr, "unexpected EOF in read\n");
+          exit (1);
+        }
+      readed += ret;
+    }
+}
+
+void
+set_mode (int mode, const char *key_iv)
+{
+  int ret;
+  ret = ioctl (fd, mode, key_iv);
+  if (ret == -1)
+    {
+      perror ("ioctl");
+      exit (1);
+    }
+}
+
+void
+open_file ()
+{
+  fd = open ("/dev/aes0", O_RDWR);
+  if (fd == -1)
+    {
+      perror ("open");
+      exit (1);
+    }
+}
+
+char
+is_equal (const char *d1, const char *d2, size_t len)
+{
+  char ok;
+  size_t i;
+
+  ok = 1;
+  for (i = 0; i < len; ++i) if (d1[i] != d2[i]) ok = 0;
+
+  return ok;
+}
+
+void
+print_vec (const char *d, size_t len)
+{
+  int i;
+  for (i = 0; i < len; ++i) fprintf (stderr, "%02x", d[i] & 0xFF);
+  fprintf (stderr, "\n");
+}
+
+void
+assert_equal (const char *d1, const char *d2, size_t len)
+{
+  if (!is_equal (d1, d2, len))
+    {
+      fprintf (stderr, "is        ");
+      print_vec (d1, len);
+      fprintf (stderr, "should be ");
+      print_vec (d2, len);
+    }
+}
+
+/*** TESTS *******************************************************************/
+volatile struct aesdev_ring_info *info;
+char *ring;
+
+void
+map_ring ()
+{
+  info = mmap (NULL, sysconf (_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd,
+               AESDEV_RING_INFO_OFFSET);
+  if (info == MAP_FAILED)
+    {
+      perror ("mmap info");
+      exit (1);
+    }
+  ring = mmap (NULL, info->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+               AESDEV_RING_DATA_OFFSET);
+  if (ring == MAP_FAILED)
+    {
+      perror ("mmap data");
+      exit (1);
+    }
+}
+
+void
+ring_ioctl (unsigned long cmd, uint32_t len)
+{
+  if (ioctl (fd, cmd, &len) == -1)
+    {
+      perror ("ioctl ring");
+      exit (1);
+    }
+}
+
+/* Copy-free counterparts of do_write/do_read: data goes straight to and
+   from the mapped buffer.  */
+void
+ring_put (const char *data, size_t len)
+{
+  size_t to_end;
+
+  ring_ioctl (AESDEV_IOCTL_RING_SUBMIT, 0);
+  assert (info->write_free >= len);
+
+  /* Data may wrap around the end of buffer, one doorbell is enough.  */
+  to_end = info->size - info->write_head;
+  if (len > to_end)
+    {
+      memcpy (ring + info->write_head, data, to_end);
+      memcpy (ring, data + to_end, len - to_end);
+    }
+  else
+    memcpy (ring + info->write_head, data, len);
+  ring_ioctl (AESDEV_IOCTL_RING_SUBMIT, len);
+}
+
+void
+ring_get (char *data, size_t len)
+{
+  struct pollfd pfd;
+  size_t i;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+
+  while (info->read_count < len)
+    {
+      if (poll (&pfd, 1, 1000) <= 0)
+        {
+          fprintf (stderr, "timeout waiting for encrypted data\n");
+          exit (1);
+        }
+      ring_ioctl (AESDEV_IOCTL_RING_CONSUME, 0);
+    }
+
+  for (i = 0; i < len; ++i)
+    data[i] = ring[(info->read_tail + i) % info->size];
+  ring_ioctl (AESDEV_IOCTL_RING_CONSUME, len);
+}
+
+void
+test_ecb_ring ()
+{
+  const char *text = "\x6b\xc1\xbe\xe2\x2e\x40\x9f\x96\xe9\x3d\x7e\x11\x73\x93\x17\x2a"
+          "\xae\x2d\x8a\x57\x1e\x03\xac\x9c\x9e\xb7\x6f\xac\x45\xaf\x8e\x51";
+  const char *cipher = "\x3a\xd7\x7b\xb4\x0d\x7a\x36\x60\xa8\x9e\xca\xf3\x24\x66\xef\x97"
+          "\xf5\xd3\xd5\x85\x03\xb9\x69\x9d\xe7\x85\x89\x5a\x96\xfd\xba\xaf";
+  const char *key = "\x2b\x7e\x15\x16\x28\xae\xd2\xa6\xab\xf7\x15\x88\x09\xcf\x4f\x3c";
+
+  char result[32];
+  int i, ok;
+
+  set_mode (AESDEV_IOCTL_SET_ECB_ENCRYPT, key);
+
+  /*** Test 1 ***/
+  ring_put (text, 32);
+  ring_get (result, 32);
+  fprintf (stderr, "ECB ring (1): %s\n", is_equal (result, cipher, 32) ? "ok" : "err");
+  assert_equal (result, cipher, 32);
+
+  /*** Test 2 ***/
+  /* Go around the buffer a few times, so that data wraps.  */
+  for (i = 0, ok = 1; i < 3 * info->size / 40; ++i)
+    {
+      ring_put (text, 8);
+      ring_put (text + 8, 24);
+      ring_put (text, 16);
+      ring_get (result, 16);
+      if (!is_equal (result, cipher, 16))
+        ok = 0;
+      ring_get (result, 32);
+      if (!is_equal (result, cipher + 16, 16) || !is_equal (result + 16, cipher, 16))
+        ok = 0;
+    }
+  fprintf (stderr, "ECB ring (2): %s\n", ok ? "ok" : "err");
+
+  /*** Test 3 ***/
+  /* Mixing with ordinary write/read is allowed.  */
+  ring_put (text, 32);
+  do_read (fd, result, 32);
+  fprintf (stderr, "ECB ring (3): %s\n", is_equal (result, cipher, 32) ? "ok" : "err");
+  assert_equal (result, cipher, 32);
+}
+
+void
+test_big_buffer ()
+{
+  const char *text1 = "\x6b\xc1\xbe\xe2\x2e\x40\x9f\x96\xe9\x3d\x7e\x11\x73\x93\x17\x2a";
+  const char *cipher1 = "\x3a\xd7\x7b\xb4\x0d\x7a\x36\x60\xa8\x9e\xca\xf3\x24\x66\xef\x97";
+  const char *key = "\x2b\x7e\x15\x16\x28\xae\xd2\xa6\xab\xf7\x15\x88\x09\xcf\x4f\x3c";
+  const uint32_t length = 0x40000;
+  uint32_t size;
+  char *all_text, *all_result;
+  int i, ok;
+
+  set_mode (AESDEV_IOCTL_SET_ECB_ENCRYPT, key);
+
+  /*** Test 1 ***/
+  size = 0x100000;
+  if (ioctl (fd, AESDEV_IOCTL_SET_BUFFER_SIZE, &size) == -1)
+    {
+      perror ("ioctl set buffer size");
+      exit (1);
+    }
+  fprintf (stderr, "buffer size (1): %s\n", size == 0x100000 ? "ok" : "err");
+
+  /*** Test 2 ***/
+  all_text = malloc (length);
+  all_result = malloc (length);
+  for (i = 0; i < length; i += 16)
+    memcpy (all_text + i, text1, 16);
+
+  do_write (fd, all_text, length);
+  do_read (fd, all_result, length);
+  for (i = 0, ok = 1; i < length; i += 16)
+    if (!is_equal (all_result + i, cipher1, 16))
+      ok = 0;
+  fprintf (stderr, "big buffer (2): %s\n", ok ? "ok" : "err");
+
+  /*** Test 3 ***/
+  do_write (fd, all_text, 16);
+  ok = (ioctl (fd, AESDEV_IOCTL_SET_BUFFER_SIZE, &size) == -1);
+  fprintf (stderr, "no resize with data (3): %s\n", ok ? "ok" : "err");
+  do_read (fd, all_result, 16);
+
+  free (all_text);
+  free (all_result);
+}
+
+void
+do_crypt (const char *in, char *out, uint32_t len)
+{
+  struct aesdev_ioctl_crypt req;
+
+  req.in = (uintptr_t) in;
+  req.out = (uintptr_t) out;
+  req.len = len;
+  req.flags = 0;
+  if (ioctl (fd, AESDEV_IOCTL_CRYPT, &req) == -1)
+    {
+      perror ("ioctl crypt");
+      exit (1);
+    }
+}
+
+void
+test_direct ()
+{
+  const char *text1 = "\x6b\xc1\xbe\xe2\x2e\x40\x9f\x96\xe9\x3d\x7e\x11\x73\x93\x17\x2a";
+  const char *cipher1 = "\x3a\xd7\x7b\xb4\x0d\x7a\x36\x60\xa8\x9e\xca\xf3\x24\x66\xef\x97";
+  const char *key = "\x2b\x7e\x15\x16\x28\xae\xd2\xa6\xab\xf7\x15\x88\x09\xcf\x4f\x3c";
+  const uint32_t length = 0x500000;
+  char *all_text, *all_result;
+  int i, ok;
+
+  set_mode (AESDEV_IOCTL_SET_ECB_ENCRYPT, key);
+
+  all_text = malloc (length + 16);
+  all_result = malloc (length + 16);
+  for (i = 0; i < length + 16; i += 16)
+    memcpy (all_text + i, text1, 16);
+
+  /*** Test 1: pinned user pages ***/
+  do_crypt (all_text, all_result, length);
+  for (i = 0, ok = 1; i < length; i += 16)
+    if (!is_equal (all_result + i, cipher1, 16))
+      ok = 0;
+  fprintf (stderr, "direct (1): %s\n", ok ? "ok" : "err");
+
+  /*** Test 2: unaligned, copied ***/
+  do_crypt (all_text + 16, all_result + 1, length);
+  for (i = 0, ok = 1; i < length; i += 16)
+    if (!is_equal (all_result + 1 + i, cipher1, 16))
+      ok = 0;
+  fprintf (stderr, "direct unaligned (2): %s\n", ok ? "ok" : "err");
+
+  /*** Test 3: in place ***/
+  do_crypt (all_text, all_text, length);
+  for (i = 0, ok = 1; i < length; i += 16)
+    if (!is_equal (all_text + i, cipher1, 16))
+      ok = 0;
+  fprintf (stderr, "direct in place (3): %s\n", ok ? "ok" : "err");
+
+  free (all_text);
+  free (all_result);
+}
+
+void
+test_batch ()
+{
+  const char *text1 = "\x6b\xc1\xbe\xe2\x2e\x40\x9f\x96\xe9\x3d\x7e\x11\x73\x93\x17\x2a";
+  const char *key = "\x2b\x7e\x15\x16\x28\xae\xd2\xa6\xab\xf7\x15\x88\x09\xcf\x4f\x3c";
+  const char *cbc_iv = "\x00\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b\x0c\x0d\x0e\x0f";
+  const char *ctr_iv = "\xf0\xf1\xf2\xf3\xf4\xf5\xf6\xf7\xf8\xf9\xfa\xfb\xfc\xfd\xfe\xff";
+  const char *ecb_cipher = "\x3a\xd7\x7b\xb4\x0d\x7a\x36\x60\xa8\x9e\xca\xf3\x24\x66\xef\x97";
+  const char *cbc_cipher = "\x76\x49\xab\xac\x81\x19\xb2\x46\xce\xe9\x8e\x9b\x12\xe9\x19\x7d";
+  const char *ctr_cipher = "\x87\x4d\x61\x91\xb6\x20\xe3\x26\x1b\xef\x68\x64\x99\x0d\xb6\xce";
+  const char *ciphers[3];
+  struct aesdev_batch_job jobs[0x300];
+  struct aesdev_ioctl_batch batch;
+  char result[0x300][16];
+  int i, ok;
+
+  ciphers[0] = ecb_cipher;
+  ciphers[1] = cbc_cipher;
+  ciphers[2] = ctr_cipher;
+
+  /* Different mode, key and IV for every job, like a record per key.  */
+  for (i = 0; i < 0x300; ++i)
+    {
+      jobs[i].mode = i % 3 == 0 ? AESDEV_BATCH_ECB_ENCRYPT
+              : i % 3 == 1 ? AESDEV_BATCH_CBC_ENCRYPT : AESDEV_BATCH_CTR;
+      jobs[i].len = 16;
+      jobs[i].in = (uintptr_t) text1;
+      jobs[i].out = (uintptr_t) result[i];
+      memcpy (jobs[i].key, key, 16);
+      memcpy (jobs[i].iv, i % 3 == 1 ? cbc_iv : ctr_iv, 16);
+    }
+  batch.jobs = (uintptr_t) jobs;
+  batch.count = 0x300;
+  batch.flags = 0;
+
+  /*** Test 1 ***/
+  if (ioctl (fd, AESDEV_IOCTL_BATCH, &batch) == -1)
+    {
+      perror ("ioctl");
+      exit (1);
+    }
+  for (i = 0, ok = 1; i < 0x300; ++i)
+    ok = ok && is_equal (result[i], ciphers[i % 3], 16);
+  fprintf (stderr, "batch (1): %s\n", ok ? "ok" : "err");
+  assert_equal (result[1], cbc_cipher, 16);
+
+  /*** Test 2 ***/
+  /* CBC state is the last cipher block.  */
+  ok = is_equal ((char *) jobs[1].iv, cbc_cipher, 16);
+  fprintf (stderr, "batch state (2): %s\n", ok ? "ok" : "err");
+}
+
+/*****************************************************************************/
+
+int
+main ()
+{
+  open_file ();
+  map_ring ();
+  test_ecb_ring ();
+  close (fd);
+
+  open_file ();
+  test_big_buffer ();
+  close (fd);
+
+  open_file ();
+  test_direct ();
+  close (fd);
+
+  open_file ();
+  test_batch ();
+  close (fd);
+
+  return (EXIT_SUCCESS);
+}
@@ -0,0 +1,192 @@
+/* 
+ * File:   test9.c
+ * Author: hubert
+ *
+ * Crypto API algorithms of the driver, used through AF_ALG.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <linux/if_alg.h>
+
+#ifndef SOL_ALG
+#define SOL_ALG 279
+#endif
+
+const char *key = "\x2b\x7e\x15\x16\x28\xae\xd2\xa6\xab\xf7\x15\x88\x09\xcf\x4f\x3c";
+const char *text1 = "\x6b\xc1\xbe\xe2\x2e\x40\x9f\x96\xe9\x3d\x7e\x11\x73\x93\x17\x2a";
+
+char
+is_equal (const char *d1, const char *d2, size_t len)
+{
+  char ok;
+  size_t i;
+
+  ok = 1;
+  for (i = 0; i < len; ++i) if (d1[i] != d2[i]) ok = 0;
+
+  return ok;
+}
+
+void
+print_vec (const char *d, size_t len)
+{
+  int i;
+  for (i = 0; i < len; ++i) fprintf (stderr, "%02x", d[i] & 0xFF);
+  fprintf (stderr, "\n");
+}
+
+void
+assert_equal (const char *d1, const char *d2, size_t len)
+{
+  if (!is_equal (d1, d2, len))
+    {
+      fprintf (stderr, "is        ");
+      print_vec (d1, len);
+      fprintf (stderr, "should be ");
+      print_vec (d2, len);
+    }
+}
+
+/* Encrypt or decrypt LEN bytes with algorithm implemented by driver DRIVER
+   (e.g. cbc-aes-aesdev).  IV may be NULL for ECB.  */
+void
+alg_crypt (const char *driver, int op, const char *iv, const char *in,
+           char *out, size_t len)
+{
+  struct sockaddr_alg sa;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct af_alg_iv *alg_iv;
+  struct iovec iov;
+  char cbuf[CMSG_SPACE (sizeof (int)) + CMSG_SPACE (sizeof (struct af_alg_iv) + 16)];
+  int tfm_fd, op_fd;
+
+  memset (&sa, 0, sizeof sa);
+  sa.salg_family = AF_ALG;
+  strcpy ((char *) sa.salg_type, "skcipher");
+  strcpy ((char *) sa.salg_name, driver);
+
+  tfm_fd = socket (AF_ALG, SOCK_SEQPACKET, 0);
+  if (tfm_fd == -1 || bind (tfm_fd, (struct sockaddr *) &sa, sizeof sa) == -1)
+    {
+      perror ("AF_ALG bind");
+      exit (1);
+    }
+  if (setsockopt (tfm_fd, SOL_ALG, ALG_SET_KEY, key, 16) == -1)
+    {
+      perror ("ALG_SET_KEY");
+      exit (1);
+    }
+  op_fd = accept (tfm_fd, NULL, 0);
+  if (op_fd == -1)
+    {
+      perror ("accept");
+      exit (1);
+    }
+
+  memset (cbuf, 0, sizeof cbuf);
+  memset (&msg, 0, sizeof msg);
+  msg.msg_control = cbuf;
+  msg.msg_controllen = iv ? sizeof cbuf : CMSG_SPACE (sizeof (int));
+
+  cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg->cmsg_level = SOL_ALG;
+  cmsg->cmsg_type = ALG_SET_OP;
+  cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+  *(int *) CMSG_DATA (cmsg) = op;
+
+  if (iv)
+    {
+      cmsg = CMSG_NXTHDR (&msg, cmsg);
+      cmsg->cmsg_level = SOL_ALG;
+      cmsg->cmsg_type = ALG_SET_IV;
+      cmsg->cmsg_len = CMSG_LEN (sizeof (struct af_alg_iv) + 16);
+      alg_iv = (struct af_alg_iv *) CMSG_DATA (cmsg);
+      alg_iv->ivlen = 16;
+      memcpy (alg_iv->iv, iv, 16);
+    }
+
+  iov.iov_base = (void *) in;
+  iov.iov_len = len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  if (sendmsg (op_fd, &msg, 0) != len || read (op_fd, out, len) != len)
+    {
+      perror ("AF_ALG crypt");
+      exit (1);
+    }
+
+  close (op_fd);
+  close (tfm_fd);
+}
+
+/*** TESTS *******************************************************************/
+void
+test_ecb ()
+{
+  const char *cipher1 = "\x3a\xd7\x7b\xb4\x0d\x7a\x36\x60\xa8\x9e\xca\xf3\x24\x66\xef\x97";
+  char result[16];
+
+  /*** Test 1 ***/
+  alg_crypt ("ecb-aes-aesdev", ALG_OP_ENCRYPT, NULL, text1, result, 16);
+  fprintf (stderr, "ECB crypto API (1): %s\n", is_equal (result, cipher1, 16) ? "ok" : "err");
+  assert_equal (result, cipher1, 16);
+
+  /*** Test 2 ***/
+  alg_crypt ("ecb-aes-aesdev", ALG_OP_DECRYPT, NULL, cipher1, result, 16);
+  fprintf (stderr, "ECB crypto API (2): %s\n", is_equal (result, text1, 16) ? "ok" : "err");
+  assert_equal (result, text1, 16);
+}
+
+void
+test_cbc ()
+{
+  const char *iv = "\x00\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b\x0c\x0d\x0e\x0f";
+  const char *cipher1 = "\x76\x49\xab\xac\x81\x19\xb2\x46\xce\xe9\x8e\x9b\x12\xe9\x19\x7d";
+  char result[16];
+
+  /*** Test 1 ***/
+  alg_crypt ("cbc-aes-aesdev", ALG_OP_ENCRYPT, iv, text1, result, 16);
+  fprintf (stderr, "CBC crypto API (1): %s\n", is_equal (result, cipher1, 16) ? "ok" : "err");
+  assert_equal (result, cipher1, 16);
+
+  /*** Test 2 ***/
+  alg_crypt ("cbc-aes-aesdev", ALG_OP_DECRYPT, iv, cipher1, result, 16);
+  fprintf (stderr, "CBC crypto API (2): %s\n", is_equal (result, text1, 16) ? "ok" : "err");
+  assert_equal (result, text1, 16);
+}
+
+void
+test_ctr ()
+{
+  const char *iv = "\xf0\xf1\xf2\xf3\xf4\xf5\xf6\xf7\xf8\xf9\xfa\xfb\xfc\xfd\xfe\xff";
+  const char *cipher1 = "\x87\x4d\x61\x91\xb6\x20\xe3\x26\x1b\xef\x68\x64\x99\x0d\xb6\xce";
+  char result[16];
+
+  /*** Test 1 ***/
+  alg_crypt ("ctr-aes-aesdev", ALG_OP_ENCRYPT, iv, text1, result, 16);
+  fprintf (stderr, "CTR crypto API (1): %s\n", is_equal (result, cipher1, 16) ? "ok" : "err");
+  assert_equal (result, cipher1, 16);
+
+  /*** Test 2: partial block ***/
+  alg_crypt ("ctr-aes-aesdev", ALG_OP_ENCRYPT, iv, text1, result, 5);
+  fprintf (stderr, "CTR crypto API (2): %s\n", is_equal (result, cipher1, 5) ? "ok" : "err");
+  assert_equal (result, cipher1, 5);
+}
+
+/*****************************************************************************/
+
+int
+main ()
+{
+  test_ecb ();
+  test_cbc ();
+  test_ctr ();
+
+  return (EXIT_SUCCESS);
+}